@@ -0,0 +1,373 @@
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "bench.h"
+#include "outputs.h"
+#include "osdep.h"
+
+using namespace std;
+
+//  Largest block size.
+static const word bench_max_size = 1 << 20;
+
+//  Bytes transferred per row (at least 2 and at most 64 transfers).
+static const word bench_row_bytes = 64 << 10;
+
+//  One row of the benchmark.
+struct bench_row
+{
+  bool is_write;
+  bool scattered;
+  bool unaligned;
+  bool warm;
+  word size;
+};
+
+//  Offset of the K-th transfer of ROW, within LEN bytes.
+static word
+bench_offset (const bench_row &row, word len, unsigned int k)
+{
+  word span = len - row.size - 4;
+  word align = row.size < 4096 ? row.size : 4096;
+  word off;
+
+  if (row.scattered)
+    {
+      //  Deterministic pseudo-random sequence, so that all the rows of a
+      //  size use the same addresses.
+      word x = 12345;
+      for (unsigned int i = 0; i <= k; i++)
+	x = x * 1103515245 + 12345;
+      off = (x >> 8) % span;
+    }
+  else
+    off = (k * row.size) % span;
+
+  off &= ~(align - 1);
+  if (row.unaligned)
+    off += 4;
+  return off;
+}
+
+//  Run ROW and display its results.  Return false in case of link error.
+static bool
+bench_run (dsu_link *link, word addr, word len, const bench_row &row)
+{
+  unsigned int nxfers = bench_row_bytes / row.size;
+  vector<unsigned char> buf (row.size);
+  latency_histogram lat;
+  chrono::steady_clock::duration busy (0);
+
+  if (nxfers < 2)
+    nxfers = 2;
+  else if (nxfers > 64)
+    nxfers = 64;
+
+  for (word i = 0; i < row.size; i++)
+    buf[i] = i * 7;
+
+  //  Warm run: read the same blocks once before measuring.
+  if (row.warm)
+    {
+      link->invalidate ();
+      for (unsigned int k = 0; k < nxfers; k++)
+	{
+	  word a = addr + bench_offset (row, len, k);
+	  dsu_xfer x = { a, row.size / 4, buf.data (), false };
+
+	  if (!link->transact (&x, 1))
+	    {
+	      cout << "link error at " << hex8 (a) << endl;
+	      return false;
+	    }
+	}
+    }
+
+  for (unsigned int k = 0; k < nxfers; k++)
+    {
+      word a = addr + bench_offset (row, len, k);
+      dsu_xfer x = { a, row.size / 4, buf.data (), row.is_write };
+
+      if (!row.warm)
+	link->invalidate ();
+
+      auto start = chrono::steady_clock::now ();
+      bool ok = link->transact (&x, 1);
+      auto end = chrono::steady_clock::now ();
+
+      if (!ok)
+	{
+	  cout << "link error at " << hex8 (a) << endl;
+	  return false;
+	}
+      busy += end - start;
+      lat.add (chrono::duration_cast<chrono::microseconds>
+	       (end - start).count ());
+    }
+
+  double us = chrono::duration<double, micro> (busy).count ();
+
+  printf ("%-5s %-7s %-5s %-4s %8u %9.2f %9.0f %8llu %8llu\n",
+	  row.is_write ? "write" : "read",
+	  row.scattered ? "scatter" : "seq",
+	  row.unaligned ? "+4" : "align",
+	  row.is_write ? "-" : (row.warm ? "warm" : "cold"),
+	  (unsigned) row.size,
+	  (double) nxfers * row.size / us,
+	  nxfers * 1e6 / us,
+	  (unsigned long long)lat.percentile (0.5),
+	  (unsigned long long)lat.percentile (0.99));
+  return true;
+}
+
+void
+bench_link (dsu_link *link, word addr, word len)
+{
+  addr &= ~3U;
+  len &= ~3U;
+  if (len < 64)
+    {
+      cout << "benchmark area too small (at least 64 bytes)" << endl;
+      return;
+    }
+
+  cout << "link:";
+  for (dsu_link *l = link; l != nullptr; l = l->get_next ())
+    cout << " " << l->get_name ();
+  cout << ", max packet: " << link->get_max_len () << " bytes"
+       << ", area: " << hex8 (addr) << "-" << hex8 (addr + len - 1) << endl;
+
+  printf ("%-5s %-7s %-5s %-4s %8s %9s %9s %8s %8s\n",
+	  "op", "pattern", "base", "run", "size", "MB/s", "xact/s",
+	  "p50(us)", "p99(us)");
+
+  for (word size = 4; size <= bench_max_size && size <= len / 2; size *= 4)
+    for (int is_write = 0; is_write <= 1; is_write++)
+      for (int scattered = 0; scattered <= 1; scattered++)
+	for (int unaligned = 0; unaligned <= 1; unaligned++)
+	  for (int warm = 0; warm <= !is_write; warm++)
+	    {
+	      bench_row row = { is_write != 0, scattered != 0,
+				unaligned != 0, warm != 0, size };
+
+	      if (user_stop)
+		{
+		  cout << "interrupted!" << endl;
+		  link->invalidate ();
+		  return;
+		}
+	      if (!bench_run (link, addr, len, row))
+		{
+		  link->invalidate ();
+		  return;
+		}
+	    }
+
+  //  The content of the target memory has changed.
+  link->invalidate ();
+}
+
+//  Largest soak transfer.
+static const word soak_max_size = 64 << 10;
+
+//  Number of mismatches displayed.
+static const unsigned int soak_max_report = 8;
+
+bool
+soak_link (dsu_link *link, word addr, word len, unsigned int seconds)
+{
+  mt19937 rng (1);
+  //  Expected content of the memory.
+  vector<unsigned char> mem;
+  uint64_t nbytes = 0;
+  uint64_t nxacts = 0;
+  uint64_t nbad = 0;
+
+  addr &= ~3U;
+  len &= ~3U;
+  if (len < 4096)
+    {
+      cout << "soak area too small (at least 4 kB)" << endl;
+      return false;
+    }
+
+  //  Check the LEN bytes read at A against the expected content EXP.
+  auto check = [&](word a, const unsigned char *buf,
+		   const unsigned char *exp, word len)
+    {
+      for (word i = 0; i < len; i++)
+	if (buf[i] != exp[i])
+	  {
+	    if (nbad < soak_max_report)
+	      cout << "mismatch at " << hex8 (a + i) << ": " << hex2 (buf[i])
+		   << " instead of " << hex2 (exp[i]) << endl;
+	    nbad++;
+	  }
+    };
+
+  //  Initial content.
+  mem.resize (len);
+  for (auto &c : mem)
+    c = rng ();
+  dsu_xfer init = { addr, len / 4, mem.data (), true };
+  if (!link->transact (&init, 1))
+    {
+      cout << "link error at " << hex8 (addr) << endl;
+      return false;
+    }
+
+  cout << "soak: " << seconds << " s on " << hex8 (addr) << "-"
+       << hex8 (addr + len - 1) << endl;
+
+  auto start = chrono::steady_clock::now ();
+  auto end = start + chrono::seconds (seconds);
+  bool ok = true;
+
+  while (ok && !user_stop && chrono::steady_clock::now () < end)
+    {
+      unsigned int kind = rng () % 8;
+
+      if (kind == 7)
+	{
+	  //  Bytes at any address, with read-modify-writes.
+	  word size = 1 + rng () % 64;
+	  word off = rng () % (len - size + 1);
+	  vector<unsigned char> buf (size);
+
+	  if (rng () & 1)
+	    {
+	      for (auto &c : buf)
+		c = rng ();
+	      ok = link->write_bytes (addr + off, size, buf.data ());
+	      copy (buf.begin (), buf.end (), mem.begin () + off);
+	    }
+	  else
+	    {
+	      ok = link->read_bytes (addr + off, size, buf.data ());
+	      if (ok)
+		check (addr + off, buf.data (), &mem[off], size);
+	    }
+	  nbytes += size;
+	}
+      else
+	{
+	  //  A batch of small transfers (which may overlap), or a bulk one.
+	  unsigned int n = kind < 5 ? 1 + rng () % 8 : 1;
+	  vector<dsu_xfer> xfers (n);
+	  vector<vector<unsigned char>> bufs (n);
+	  //  Expected result of the reads.
+	  vector<vector<unsigned char>> exps (n);
+
+	  for (unsigned int i = 0; i < n; i++)
+	    {
+	      word size = kind < 5 ? 4 * (1 + rng () % 16)
+		: 4 * (1 + rng () % (soak_max_size / 4));
+	      if (size > len)
+		size = len;
+	      word off = (rng () % (len - size + 1)) & ~3U;
+	      bool is_write = rng () & 1;
+
+	      bufs[i].resize (size);
+	      if (is_write)
+		{
+		  for (auto &c : bufs[i])
+		    c = rng ();
+		  copy (bufs[i].begin (), bufs[i].end (), mem.begin () + off);
+		}
+	      else
+		exps[i].assign (mem.begin () + off, mem.begin () + off + size);
+	      xfers[i] = { addr + off, size / 4, bufs[i].data (), is_write };
+	      nbytes += size;
+	    }
+
+	  ok = link->transact (xfers.data (), n);
+	  if (ok)
+	    for (unsigned int i = 0; i < n; i++)
+	      if (!xfers[i].is_write)
+		check (xfers[i].addr, bufs[i].data (), exps[i].data (),
+		       bufs[i].size ());
+	}
+      nxacts++;
+    }
+  if (!ok)
+    cout << "link error" << endl;
+
+  double secs = chrono::duration<double>
+    (chrono::steady_clock::now () - start).count ();
+  printf ("soak: %.1f s, %llu transactions, %.2f MB, %.2f MB/s,"
+	  " %llu bad bytes\n",
+	  secs, (unsigned long long)nxacts, nbytes / 1e6,
+	  nbytes / 1e6 / secs, (unsigned long long)nbad);
+
+  //  The content of the target memory has changed.
+  link->invalidate ();
+  return ok && nbad == 0;
+}
+
+bool
+stripe_check_link (dsu_link *link, word addr, word len)
+{
+  mt19937 rng (1);
+  dsu_link *stripe = link;
+
+  //  The stripe is the link with several links below it.
+  while (stripe != nullptr && stripe->get_branch (1) == nullptr)
+    stripe = stripe->get_next ();
+  if (stripe == nullptr)
+    {
+      cout << "stripe check: the link is not striped" << endl;
+      return false;
+    }
+
+  addr &= ~3U;
+  len &= ~3U;
+  vector<unsigned char> mem (len);
+  vector<unsigned char> buf (len);
+  for (auto &c : mem)
+    c = rng ();
+  if (!link->write (addr, len / 4, mem.data ()))
+    {
+      cout << "link error at " << hex8 (addr) << endl;
+      return false;
+    }
+
+  //  Read through the whole stack, cache included, but not from it.
+  link->invalidate ();
+  reset_link_stats (link);
+  if (!link->read (addr, len / 4, buf.data ()))
+    {
+      cout << "link error at " << hex8 (addr) << endl;
+      return false;
+    }
+
+  bool ok = true;
+  word nbad = 0;
+  for (word i = 0; i < len; i++)
+    if (buf[i] != mem[i])
+      nbad++;
+  if (nbad != 0)
+    {
+      cout << "stripe check: " << nbad << " bad bytes" << endl;
+      ok = false;
+    }
+
+  for (unsigned int i = 0; stripe->get_branch (i) != nullptr; i++)
+    {
+      dsu_link *l = stripe->get_branch (i);
+      uint64_t bytes = 0;
+
+      for (auto &s : l->stats.ops)
+	bytes += s.bytes;
+      cout << "stripe check: link " << i << " (" << l->get_name ()
+	   << "): " << bytes << " bytes" << endl;
+      if (bytes == 0)
+	ok = false;
+    }
+  cout << "stripe check: " << (ok ? "ok" : "failed") << endl;
+
+  //  The content of the target memory has changed.
+  link->invalidate ();
+  return ok;
+}
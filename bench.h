@@ -0,0 +1,23 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "links.h"
+
+//  Measure the throughput and the latency of LINK, by reading and writing
+//  blocks of 1 word to 1MB (at most LEN / 2) in the LEN bytes of memory at
+//  ADDR, whose content is destroyed.
+void bench_link (dsu_link *link, word addr, word len);
+
+//  Soak test of LINK during SECONDS: random reads and writes (single
+//  words, batches, bulk blocks and unaligned bytes) in the LEN bytes of
+//  memory at ADDR, checked against a copy of that memory.  Display the
+//  throughput and the errors, and return true if all the data read was
+//  right.
+bool soak_link (dsu_link *link, word addr, word len, unsigned int seconds);
+
+//  Check that large reads of LINK are striped: write LEN bytes of random
+//  data at ADDR and read them back in one transfer.  Return true if the
+//  data is right and each link of the stripe carried part of the read.
+bool stripe_check_link (dsu_link *link, word addr, word len);
+
+#endif /* BENCH_H_ */
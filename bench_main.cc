@@ -0,0 +1,108 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "bench.h"
+#include "osdep.h"
+#include "trace.h"
+
+using namespace std;
+
+//  Standalone link benchmark:
+//    lemon-bench [LINK-OPTIONS] [--soak SECONDS | --stripe-check]
+//                [ADDR [LENGTH]]
+
+static void
+usage (void)
+{
+  cerr << "usage: lemon-bench [--usb | --usb-async | --eth IP | --sim"
+       << " | --jtag CABLE" << endl
+       << "                     | --eth-raw IFACE,MAC,IP"
+       << " | --remote HOST:PORT] [--no-cache]" << endl
+       << "                   [--trace FILE [--trace-slots N]]"
+       << " [--soak SECONDS | --stripe-check]" << endl
+       << "                   [ADDR [LENGTH]]" << endl;
+}
+
+int
+main (int argc, char **argv)
+{
+  link_options link_opts;
+  word addr = 0x40000000;
+  word len = 2 << 20;
+  int narg = 0;
+  //  Duration of the soak test (0 for the benchmark).
+  unsigned int soak = 0;
+  bool stripe_check = false;
+
+  for (int i = 1; i < argc; i++)
+    {
+      int res = parse_link_option (argc, argv, i, link_opts);
+      if (res < 0)
+	return 1;
+      if (res > 0)
+	continue;
+
+      if (strcmp (argv[i], "--soak") == 0)
+	{
+	  if (++i >= argc)
+	    {
+	      usage ();
+	      return 1;
+	    }
+	  soak = atoi (argv[i]);
+	  continue;
+	}
+      if (strcmp (argv[i], "--stripe-check") == 0)
+	{
+	  stripe_check = true;
+	  continue;
+	}
+
+      if (argv[i][0] == '-')
+	{
+	  cerr << "unknown option '" << argv[i] << "'" << endl;
+	  usage ();
+	  return 1;
+	}
+
+      word val = strtoul (argv[i], nullptr, 0);
+      if (narg == 0)
+	addr = val;
+      else if (narg == 1)
+	len = val;
+      else
+	{
+	  usage ();
+	  return 1;
+	}
+      narg++;
+    }
+
+  dsu_link *link = create_link (link_opts);
+  if (link == nullptr)
+    return 1;
+
+  if (!link->open ())
+    {
+      cerr << "failed to create link" << endl;
+      return 1;
+    }
+
+  install_handler ();
+  bool ok = true;
+  if (soak != 0)
+    {
+      ok = soak_link (link, addr, len, soak);
+      if (!ok)
+	trace_error ();
+    }
+  else if (stripe_check)
+    ok = stripe_check_link (link, addr, len);
+  else
+    bench_link (link, addr, len);
+
+  link->close ();
+  disp_link_stats (link);
+  return ok ? 0 : 1;
+}
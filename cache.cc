@@ -0,0 +1,295 @@
+#include <array>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "links.h"
+
+using namespace std;
+
+//  A dsu_link that caches reads of the target memory by lines.  Writes are
+//  written through.  Reads of I/O areas are never cached, and reads larger
+//  than a packet (memory dumps, verifications) are sent to the link as they
+//  are, without filling the cache.
+class cache_dsu_link : public dsu_link
+{
+ public:
+  cache_dsu_link (dsu_link *link) : link (link) {}
+  bool open (void) { return link->open (); }
+  void close (void) { link->close (); }
+  unsigned get_max_len (void) { return link->get_max_len (); }
+  link_constraints get_constraints (void)
+  {
+    return link->get_constraints ();
+  }
+  const char *get_name (void) { return "cache"; }
+  dsu_link *get_next (void) { return link; }
+  void invalidate (void);
+  void add_io_range (word first, word last);
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
+ private:
+  //  Size (in bytes) of a line.
+  static const unsigned int line_len = 32;
+  //  Maximum number of lines.  When the cache is full, the least recently
+  //  used lines are evicted.
+  static const unsigned int max_lines = 8192;
+  //  Prefetch doesn't cross this boundary, so that it doesn't read past
+  //  the end of a memory.
+  static const word prefetch_bound = 4096;
+
+  struct line
+  {
+    array<unsigned char, line_len> data;
+    //  Position in LRU.
+    list<word>::iterator pos;
+    //  Value of STAMP when last used.
+    unsigned long stamp;
+  };
+
+  bool is_io (word addr, unsigned int len);
+  //  Make the line at IT the most recently used.
+  void touch (unordered_map<word, line>::iterator it);
+  //  Evict lines, so that ROOM lines can be added.  Lines used by the
+  //  current transfers are kept, even if the cache is then too large.
+  void evict (unsigned int room);
+  void clear (void);
+
+  dsu_link *link;
+  unordered_map<word, line> lines;
+  //  Addresses of the lines, the most recently used first.
+  list<word> lru;
+  //  Incremented after each list of transfers.
+  unsigned long stamp = 0;
+  vector<pair<word, word>> io_ranges;
+  //  Line after the last line read from the target, to detect sequential
+  //  accesses.
+  word next_miss = 1;
+};
+
+void
+cache_dsu_link::clear (void)
+{
+  lines.clear ();
+  lru.clear ();
+}
+
+void
+cache_dsu_link::invalidate (void)
+{
+  clear ();
+  next_miss = 1;
+  link->invalidate ();
+}
+
+void
+cache_dsu_link::add_io_range (word first, word last)
+{
+  io_ranges.push_back (make_pair (first, last));
+  link->add_io_range (first, last);
+}
+
+bool
+cache_dsu_link::is_io (word addr, unsigned int len)
+{
+  word last = addr + len - 1;
+
+  for (auto &r : io_ranges)
+    if (addr <= r.second && last >= r.first)
+      return true;
+  return false;
+}
+
+void
+cache_dsu_link::touch (unordered_map<word, line>::iterator it)
+{
+  lru.splice (lru.begin (), lru, it->second.pos);
+  it->second.stamp = stamp;
+}
+
+void
+cache_dsu_link::evict (unsigned int room)
+{
+  while (!lru.empty () && lines.size () + room > max_lines)
+    {
+      auto it = lines.find (lru.back ());
+
+      if (it->second.stamp == stamp)
+	break;
+      lines.erase (it);
+      lru.pop_back ();
+    }
+}
+
+bool
+cache_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  //  Lines to be read from the target, and number of them to be read
+  //  before each transfer.
+  vector<word> fetches;
+  vector<unsigned int> nfetches (n);
+  unordered_set<word> planned;
+  //  True for the transfers directly sent to the link.
+  vector<bool> direct (n);
+
+  auto fetch = [&](word l)
+    {
+      fetches.push_back (l);
+      planned.insert (l);
+      next_miss = l + line_len;
+    };
+  //  The lines already cached are marked as used, so that they are not
+  //  evicted before the transfers are served.
+  auto missing = [&](word l)
+    {
+      auto it = lines.find (l);
+
+      if (it != lines.end ())
+	{
+	  touch (it);
+	  return false;
+	}
+      return planned.count (l) == 0;
+    };
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      dsu_xfer &x = xfers[i];
+      unsigned int len = x.nwords * 4;
+
+      if (x.is_write || len == 0 || len > get_max_len ()
+	  || is_io (x.addr, len))
+	direct[i] = true;
+      else
+	{
+	  word l = x.addr & ~(line_len - 1);
+	  word end = (x.addr + len - 1) & ~(line_len - 1);
+	  word seq = next_miss;
+	  bool missed = false;
+	  bool sequential = false;
+
+	  while (1)
+	    {
+	      if (missing (l))
+		{
+		  if (!missed)
+		    sequential = l == seq;
+		  missed = true;
+		  fetch (l);
+		}
+	      if (l == end)
+		break;
+	      l += line_len;
+	    }
+
+	  //  Sequential access: also read the next lines, up to one more
+	  //  packet.
+	  if (sequential)
+	    for (unsigned int cnt = get_max_len () / line_len; cnt > 0; cnt--)
+	      {
+		l += line_len;
+		if ((l & (prefetch_bound - 1)) == 0
+		    || !missing (l) || is_io (l, line_len))
+		  break;
+		fetch (l);
+	      }
+	}
+      nfetches[i] = fetches.size ();
+    }
+
+  //  Read missing lines before the transfers that need them.
+  vector<unsigned char> data (fetches.size () * line_len);
+  vector<dsu_xfer> fwd;
+  unsigned int k = 0;
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      for (; k < nfetches[i]; k++)
+	fwd.push_back ({ fetches[k], line_len / 4, &data[k * line_len],
+			 false });
+      if (direct[i])
+	fwd.push_back (xfers[i]);
+    }
+
+  if (!fwd.empty () && !link->transact (fwd.data (), fwd.size ()))
+    {
+      //  Writes may have been partially done.
+      clear ();
+      return false;
+    }
+
+  //  Update the cache and serve the reads, in order.
+  k = 0;
+  for (unsigned int i = 0; i < n; i++)
+    {
+      dsu_xfer &x = xfers[i];
+      unsigned int len = x.nwords * 4;
+
+      evict (nfetches[i] - k);
+      for (; k < nfetches[i]; k++)
+	{
+	  auto r = lines.emplace (fetches[k], line ());
+	  line &ln = r.first->second;
+
+	  lru.push_front (fetches[k]);
+	  ln.pos = lru.begin ();
+	  ln.stamp = stamp;
+	  memcpy (ln.data.data (), &data[k * line_len], line_len);
+	}
+
+      //  Large reads were done directly in X.BUF.
+      if (len == 0 || is_io (x.addr, len) || (direct[i] && !x.is_write))
+	continue;
+
+      for (unsigned int off = 0; off < len; )
+	{
+	  word a = x.addr + off;
+	  word l = a & ~(line_len - 1);
+	  unsigned int loff = a - l;
+	  unsigned int cnt = min (line_len - loff, len - off);
+	  auto it = lines.find (l);
+
+	  if (x.is_write)
+	    {
+	      if (it != lines.end ())
+		memcpy (it->second.data.data () + loff, x.buf + off, cnt);
+	    }
+	  else
+	    memcpy (x.buf + off, it->second.data.data () + loff, cnt);
+	  off += cnt;
+	}
+    }
+
+  //  Now that the transfers are served, the cache can shrink again.
+  stamp++;
+  evict (0);
+  return true;
+}
+
+bool
+cache_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  dsu_xfer x = { addr, nwords, res, false };
+
+  return do_transact (&x, 1);
+}
+
+bool
+cache_dsu_link::do_write (word addr, unsigned int nwords,
+			  const unsigned char *buf)
+{
+  dsu_xfer x = { addr, nwords, const_cast<unsigned char *>(buf), true };
+
+  return do_transact (&x, 1);
+}
+
+dsu_link *
+create_cache_dsu_link (dsu_link *link)
+{
+  return new cache_dsu_link (link);
+}
@@ -0,0 +1,34 @@
+ 0x09, 0x3b, 0x6e, 0x20, 0x88, 0x11, 0x23, 0x20,
+ 0x84, 0x10, 0x20, 0x00, 0x82, 0x10, 0x00, 0x02,
+ 0x86, 0x10, 0x20, 0x08, 0x80, 0x88, 0x60, 0x01,
+ 0x02, 0x80, 0x00, 0x03, 0x83, 0x30, 0x60, 0x01,
+ 0x82, 0x18, 0x40, 0x04, 0x86, 0xa0, 0xe0, 0x01,
+ 0x12, 0xbf, 0xff, 0xfb, 0x01, 0x00, 0x00, 0x00,
+ 0x87, 0x28, 0xa0, 0x02, 0xc2, 0x23, 0x00, 0x03,
+ 0x84, 0x00, 0xa0, 0x01, 0x80, 0xa0, 0xa1, 0x00,
+ 0x12, 0xbf, 0xff, 0xf3, 0x01, 0x00, 0x00, 0x00,
+ 0x80, 0xa2, 0x60, 0x00, 0x02, 0x80, 0x00, 0x2c,
+ 0x01, 0x00, 0x00, 0x00, 0x9a, 0x10, 0x00, 0x0a,
+ 0x80, 0xa2, 0x40, 0x0a, 0x1a, 0x80, 0x00, 0x03,
+ 0x01, 0x00, 0x00, 0x00, 0x9a, 0x10, 0x00, 0x09,
+ 0x92, 0x22, 0x40, 0x0d, 0x82, 0x10, 0x3f, 0xff,
+ 0xc4, 0x02, 0x00, 0x00, 0x87, 0x30, 0xa0, 0x18,
+ 0x86, 0x18, 0xc0, 0x01, 0x86, 0x08, 0xe0, 0xff,
+ 0x87, 0x28, 0xe0, 0x02, 0xc6, 0x03, 0x00, 0x03,
+ 0x83, 0x30, 0x60, 0x08, 0x82, 0x18, 0x40, 0x03,
+ 0x87, 0x30, 0xa0, 0x10, 0x86, 0x18, 0xc0, 0x01,
+ 0x86, 0x08, 0xe0, 0xff, 0x87, 0x28, 0xe0, 0x02,
+ 0xc6, 0x03, 0x00, 0x03, 0x83, 0x30, 0x60, 0x08,
+ 0x82, 0x18, 0x40, 0x03, 0x87, 0x30, 0xa0, 0x08,
+ 0x86, 0x18, 0xc0, 0x01, 0x86, 0x08, 0xe0, 0xff,
+ 0x87, 0x28, 0xe0, 0x02, 0xc6, 0x03, 0x00, 0x03,
+ 0x83, 0x30, 0x60, 0x08, 0x82, 0x18, 0x40, 0x03,
+ 0x86, 0x18, 0x80, 0x01, 0x86, 0x08, 0xe0, 0xff,
+ 0x87, 0x28, 0xe0, 0x02, 0xc6, 0x03, 0x00, 0x03,
+ 0x83, 0x30, 0x60, 0x08, 0x82, 0x18, 0x40, 0x03,
+ 0x9a, 0xa3, 0x60, 0x04, 0x12, 0xbf, 0xff, 0xe3,
+ 0x90, 0x02, 0x20, 0x04, 0x82, 0x38, 0x40, 0x00,
+ 0xc2, 0x22, 0xc0, 0x00, 0x10, 0xbf, 0xff, 0xd5,
+ 0x96, 0x02, 0xe0, 0x04, 0x90, 0x10, 0x20, 0x00,
+ 0x91, 0xd0, 0x20, 0x01, 0x10, 0xbf, 0xff, 0xfe,
+ 0x01, 0x00, 0x00, 0x00
\ No newline at end of file
@@ -14,6 +14,10 @@ using namespace std;
 
 static list<forwarder *> poll_queue;
 
+//  Number of trace entries read by each transaction, so that the first
+//  entries are displayed while the next ones are read.
+static const unsigned int trace_group = 32;
+
 void
 register_poll (forwarder *p)
 {
@@ -40,6 +44,8 @@ class dsu4 : public dsu
   virtual void set_entry (word addr);
   virtual void stop (void);
   virtual void go (void);
+  virtual void call_start (void);
+  virtual bool call_wait (void);
   virtual void ahb_traces (int num);
   virtual void ahb_set (bool en);
   virtual void ahb_mask (bool en, bool mast, unsigned num);
@@ -51,8 +57,14 @@ class dsu4 : public dsu
   //  Single step for processor NUM.
   void step (int num);
 
+  //  Discard the state read from the target, as the cpus may have run.
+  void invalidate (void);
+
   word read_reg (word off);
   void write_reg (word off, word val);
+
+  //  Bus address of register OFF.
+  word reg_addr (word off) { return base + off; }
 private:
 
   word read_reg (int cpu, word off) { return read_reg ((cpu << 24) + off); }
@@ -60,9 +72,12 @@ private:
   {
     write_reg ((cpu << 24) + off, val);
   }
+  word reg_addr (int cpu, word off) { return reg_addr ((cpu << 24) + off); }
   word read_asi (int cpu, int asi, word off);
 
-  void wait_event (void);
+  //  Wait until a cpu enters debug mode, and report it if VERBOSE.  Return
+  //  false if interrupted by the user.
+  bool wait_event (bool verbose = true);
   void disp_event (int cpu);
 
   word ahb_idx_mask;
@@ -103,7 +118,24 @@ class leon4 : public Cpu
 
   void init (void);
   void reset (void);
+
+  //  Discard the register snapshot.
+  void invalidate_state (void) { state.valid = false; }
 private:
+  //  Snapshot of the registers, read at once when the cpu is halted.
+  struct cpu_state
+  {
+    bool valid = false;
+    //  Window registers (nwin * 16 words), followed by the globals.
+    vector<word> iu;
+    word y, psr, wim, tbr, pc, npc, fsr;
+    //  Only if the cpu has an FPU.
+    word fpu[32];
+  };
+
+  const cpu_state &get_state (void);
+  bool has_fpu (void) { return ((asr17 >> 10) & 3) != 0; }
+
   word map_cpu_gpr (int cwp, int n);
 
   //  Read/write a per-cpu DSU register
@@ -115,6 +147,10 @@ private:
   {
     parent_dsu.write_reg (dsu_base + off, val);
   }
+  word dsu_reg_addr (word off)
+  {
+    return parent_dsu.reg_addr (dsu_base + off);
+  }
   word read_asi (int asi, word off)
   {
     write_dsu_reg (DSU_ASI, asi);
@@ -137,6 +173,8 @@ private:
 
   word asr17;
   int nwin; // Number of windows.  Set by init().
+
+  cpu_state state;
 };
 
 dsu *
@@ -159,6 +197,9 @@ find_dsu (soc *s)
 		ahb_device *ddev = dynamic_cast<ahb_device *>(d);
 		word base = bar_to_base (ddev->get_pnp ().bar[0],
 					 ddev->get_parent ()->base);
+		s->get_link ()->add_io_range
+		  (base, bar_to_last (ddev->get_pnp ().bar[0],
+				      ddev->get_parent ()->base));
 		r = new dsu4 (s, base);
 	      }
 	      break;
@@ -247,15 +288,48 @@ static reg_desc psr_desc ("psr",
 void
 dsu4::disp_info (void)
 {
-  cout << " break ss: " << hex8 << read_reg (BREAK);
-  cout << " debug mode mask: " << hex8 << read_reg (MASK) << endl;
+  //  Registers of a cpu, read in one batch.
+  struct cpu_regs
+  {
+    word ctrl, trap, time, psr, wim, tbr, pc, npc, asr17, ccr, iccr, dccr;
+  };
+  vector<cpu_regs> regs (get_ncpus ());
+  word brk, mask;
+  dsu_batch b (get_link ());
+
+  b.read_word (reg_addr (BREAK), &brk);
+  b.read_word (reg_addr (MASK), &mask);
+  for (int i = 0; i < get_ncpus (); i++)
+    {
+      cpu_regs &r = regs[i];
+
+      b.read_word (reg_addr (i, CTRL), &r.ctrl);
+      b.read_word (reg_addr (i, TIME), &r.time);
+      b.read_word (reg_addr (i, DSU_TRAP), &r.trap);
+      b.read_word (reg_addr (i, PSR), &r.psr);
+      b.read_word (reg_addr (i, WIM), &r.wim);
+      b.read_word (reg_addr (i, TBR), &r.tbr);
+      b.read_word (reg_addr (i, PC), &r.pc);
+      b.read_word (reg_addr (i, NPC), &r.npc);
+      b.read_word (reg_addr (i, ASR17), &r.asr17);
+      b.write_word (reg_addr (i, DSU_ASI), 2);
+      b.read_word (reg_addr (i, ASI_DIAG + 0), &r.ccr);
+      b.read_word (reg_addr (i, ASI_DIAG + 8), &r.iccr);
+      b.read_word (reg_addr (i, ASI_DIAG + 12), &r.dccr);
+    }
+  b.submit ();
+
+  cout << " break ss: " << hex8 << brk;
+  cout << " debug mode mask: " << hex8 << mask << endl;
 
   for (int i = 0; i < get_ncpus (); i++)
     {
+      const cpu_regs &r = regs[i];
+
       cout << "CPU#" << i << ":" << endl;
-      word ctrl = read_reg (i, CTRL);
+      word ctrl = r.ctrl;
       cout << " control: " << hex8 << ctrl;
-      word trap = read_reg (i, DSU_TRAP);
+      word trap = r.trap;
       cout << " trap: " << hex8 (trap) << "  ";
       disp_tt ((trap >> 4) & 0xff);
       cout << endl;
@@ -272,17 +346,17 @@ dsu4::disp_info (void)
       cout << " BE:" << ((ctrl & CTRL_BE) ? '1' : '0');
       cout << " TE:" << ((ctrl & CTRL_TE) ? '1' : '0');
       cout << endl;
-      cout << " time cntrl: " << hex8 << read_reg (i, TIME) << endl;
-
-      cout << "   psr: " << hex8 << read_reg (i, PSR);
-      cout << " wim: " << hex8 << read_reg (i, WIM);
-      cout << "   tbr: " << hex8 << read_reg (i, TBR);
-      cout << "   pc : " << hex8 << read_reg (i, PC);
-      cout << " npc: " << hex8 << read_reg (i, NPC) << endl;
-      cout << " asr17: " << hex8 << read_reg (i, ASR17);
-      cout << " ccr: " << hex8 << read_asi (i, 2, 0);
-      cout << " i-ccr: " << hex8 << read_asi (i, 2, 8);
-      cout << " d-ccr: " << hex8 << read_asi (i, 2, 12) << endl;
+      cout << " time cntrl: " << hex8 << r.time << endl;
+
+      cout << "   psr: " << hex8 << r.psr;
+      cout << " wim: " << hex8 << r.wim;
+      cout << "   tbr: " << hex8 << r.tbr;
+      cout << "   pc : " << hex8 << r.pc;
+      cout << " npc: " << hex8 << r.npc << endl;
+      cout << " asr17: " << hex8 << r.asr17;
+      cout << " ccr: " << hex8 << r.ccr;
+      cout << " i-ccr: " << hex8 << r.iccr;
+      cout << " d-ccr: " << hex8 << r.dccr << endl;
     }
 }
 
@@ -365,6 +439,15 @@ dsu4::reset (void)
   //  Powerdown all slave cpus
   for (auto c: cpus)
     static_cast<leon4*>(c)->reset ();
+  invalidate ();
+}
+
+void
+dsu4::invalidate (void)
+{
+  for (auto c: cpus)
+    static_cast<leon4*>(c)->invalidate_state ();
+  get_link ()->invalidate ();
 }
 
 void
@@ -415,6 +498,7 @@ leon4::set_entry (word addr)
   write_dsu_reg (NPC, addr + 4);
   write_dsu_reg (PSR, 0x80);
   write_dsu_reg (WIM, 0);
+  invalidate_state ();
 
 #if 0
   //  Flush icache only if powered.
@@ -432,6 +516,8 @@ leon4::set_gpr (unsigned reg, word value)
     return;
   word addr = map_cpu_gpr (0, reg);
   write_dsu_reg(addr, value);
+  if (state.valid)
+    state.iu[(addr - IU_REGS) / 4] = value;
 }
 
 word
@@ -461,28 +547,34 @@ dsu4::disp_event (int cpu)
   cout << endl;
 }
 
-void
-dsu4::wait_event (void)
+bool
+dsu4::wait_event (bool verbose)
 {
   int timeout = 1;
 
+  vector<word> ctrl (get_ncpus ());
+
   while (1)
     {
+      //  Poll all cpus at once.
+      dsu_batch b (get_link ());
       for (int i = 0; i < get_ncpus (); i++)
-	{
-	  word ctrl = read_reg (i, CTRL);
-	  if (ctrl & CTRL_DM)
-	    {
+	b.read_word (reg_addr (i, CTRL), &ctrl[i]);
+      b.submit ();
+
+      for (int i = 0; i < get_ncpus (); i++)
+	if (ctrl[i] & CTRL_DM)
+	  {
+	    if (verbose)
 	      disp_event (i);
-	      return;
-	    }
-	}
+	    return true;
+	  }
 
       if (user_stop)
 	{
 	  cout << "User interrupt!" << endl;
 	  stop ();
-	  break;
+	  return false;
 	}
 
       if (execute_polls ())
@@ -519,6 +611,7 @@ dsu4::step (int num)
   ahb_set (false);
   wait_event ();
   write_reg (MASK, msk);
+  invalidate ();
 }
 
 void
@@ -537,6 +630,25 @@ dsu4::go (void)
 
   ahb_set (false);
   remove_all_bp ();
+  invalidate ();
+}
+
+void
+dsu4::call_start (void)
+{
+  //  Remove break-now flag, remove SS flag.
+  word ss = read_reg (BREAK);
+  word mask = (1 << get_ncpus ()) - 1;
+  ss &= (~mask) & 0xffff;
+  write_reg (BREAK, ss);
+}
+
+bool
+dsu4::call_wait (void)
+{
+  bool res = wait_event (false);
+  invalidate ();
+  return res;
 }
 
 void
@@ -555,6 +667,7 @@ dsu4::release (void)
   for (auto c: cpus)
     static_cast<leon4*>(c)->release ();
   write_reg (BREAK, 0);
+  invalidate ();
 }
 
 word
@@ -574,6 +687,43 @@ leon4::map_cpu_gpr (int cwp, int n)
     abort ();
 }
 
+const leon4::cpu_state &
+leon4::get_state (void)
+{
+  if (state.valid)
+    return state;
+
+  //  The whole window file, the special registers and the FPU registers
+  //  in one transaction.
+  unsigned int niu = nwin * 16 + 8;
+  vector<unsigned char> iu (niu * 4);
+  unsigned char spec[7 * 4];
+  unsigned char fpu[32 * 4];
+  dsu_batch b (parent_dsu.get_link ());
+
+  b.read (dsu_reg_addr (IU_REGS), niu, iu.data ());
+  b.read (dsu_reg_addr (Y), 7, spec);
+  if (has_fpu ())
+    b.read (dsu_reg_addr (FPU_REGS), 32, fpu);
+  b.submit ();
+
+  state.iu.resize (niu);
+  for (unsigned int i = 0; i < niu; i++)
+    state.iu[i] = unpack_be32 (&iu[4 * i]);
+  state.y = unpack_be32 (spec + 0);
+  state.psr = unpack_be32 (spec + 4);
+  state.wim = unpack_be32 (spec + 8);
+  state.tbr = unpack_be32 (spec + 12);
+  state.pc = unpack_be32 (spec + 16);
+  state.npc = unpack_be32 (spec + 20);
+  state.fsr = unpack_be32 (spec + 24);
+  if (has_fpu ())
+    for (int i = 0; i < 32; i++)
+      state.fpu[i] = unpack_be32 (fpu + 4 * i);
+  state.valid = true;
+  return state;
+}
+
 word
 leon4::read_cpu_gpr (int cwp, int n)
 {
@@ -585,15 +735,22 @@ leon4::read_cpu_gpr (int cwp, int n)
   else
     {
       word addr = map_cpu_gpr (cwp, n);
-      return read_dsu_reg (addr);
+      return get_state ().iu[(addr - IU_REGS) / 4];
     }
 }
 
 void
 leon4::disp_regs (void)
 {
-  word psr = read_dsu_reg (PSR);
+  const cpu_state &st = get_state ();
+  word psr = st.psr;
+  word pc = st.pc;
   word cwp = psr & 0x1f;
+  word regs[32];
+
+  for (int n = 0; n < 32; n++)
+    regs[n] = read_cpu_gpr (cwp, n);
+  word insn = parent_dsu.get_link ()->read_word (pc);
 
   cout << "   [cpu:" << name << " cwp=" << cwp << "  nwin=" << nwin << "]";
   cout << endl;
@@ -605,34 +762,42 @@ leon4::disp_regs (void)
       else
 	cout << "  o" << i;
       cout << ": ";
-      word o_reg = read_cpu_gpr (cwp, 8 + i);
-      cout << hex8 (o_reg);
+      cout << hex8 (regs[8 + i]);
 
       cout << "  l" << i << ": ";
-      word l_reg = read_cpu_gpr (cwp, 16 + i);
-      cout << hex8 (l_reg);
+      cout << hex8 (regs[16 + i]);
 
       if (i == 6)
 	cout << "  fp";
       else
 	cout << "  i" << i;
       cout << ": ";
-      word i_reg = read_cpu_gpr (cwp, 24 + i);
-      cout << hex8 (i_reg);
+      cout << hex8 (regs[24 + i]);
 
       cout << "  g" << i << ": ";
-      word g_reg = read_cpu_gpr (cwp, i);
-      cout << hex8 (g_reg) << endl;
+      cout << hex8 (regs[i]) << endl;
     }
   cout << " psr: " << hex8 (psr);
   psr_desc.disp (cout, "  ", psr);
-  cout << " wim: " << hex8 (read_dsu_reg (WIM));
-  cout << " tbr: " << hex8 (read_dsu_reg (TBR)) << endl;
-  word pc = read_dsu_reg (PC);
+  cout << " wim: " << hex8 (st.wim);
+  cout << " tbr: " << hex8 (st.tbr);
+  cout << " y: " << hex8 (st.y) << endl;
   cout << " pc : " << hex8 (pc) << " " << symbolize (pc) << endl;
-  word insn = parent_dsu.get_link ()->read_word (pc);
   cout << "    [" << hex8 (insn) << "]  " << disa_sparc (pc, insn) << endl;
-  cout << " npc: " << hex8 (read_dsu_reg (NPC)) << endl;
+  cout << " npc: " << hex8 (st.npc) << endl;
+
+  //  FPU registers, if enabled.
+  if (has_fpu () && (psr & 0x1000))
+    {
+      cout << " fsr: " << hex8 (st.fsr) << endl;
+      for (int i = 0; i < 8; i++)
+	{
+	  for (int j = i; j < 32; j += 8)
+	    cout << (j < 10 ? "   f" : "  f") << j << ": "
+		 << hex8 (st.fpu[j]);
+	  cout << endl;
+	}
+    }
 }
 
 void
@@ -649,13 +814,13 @@ leon4::disp_frame (word pc, word sp)
 void
 leon4::disp_bt (void)
 {
-  word psr = read_dsu_reg (PSR);
-  word cwp = psr & 0x1f;
-  word wim = read_dsu_reg (WIM);
+  const cpu_state &st = get_state ();
+  word cwp = st.psr & 0x1f;
+  word wim = st.wim;
   word last_pc;
   word last_sp;
 
-  last_pc = read_dsu_reg (PC);
+  last_pc = st.pc;
   last_sp = read_cpu_gpr (cwp, 14);
   disp_frame (last_pc, last_sp);
 
@@ -928,26 +1093,58 @@ static reg_desc ahbtbcr_desc
 void
 dsu4::ahb_traces (int nbr)
 {
-  word tbcr = read_reg (AHB_TB_CTRL);
+  word tbcr, tbidx, time, fmask;
+  {
+    dsu_batch b (get_link ());
+    b.read_word (reg_addr (AHB_TB_CTRL), &tbcr);
+    b.read_word (reg_addr (AHB_TB_INDEX), &tbidx);
+    b.read_word (reg_addr (TIME), &time);
+    b.read_word (reg_addr (AHB_TB_FILTER_MASK), &fmask);
+    b.submit ();
+  }
+
   cout << "AHB trace buffer control: " << hex8 (tbcr) << endl;
   ahbtbcr_desc.disp (cout, "  ", tbcr);
 
-  word tbidx = read_reg (AHB_TB_INDEX);
   cout << "AHB trace buffer index: " << hex8 (tbidx) << endl;
-  cout << "  time cntrl: " << hex8 (read_reg (TIME)) << endl;
-  cout << " filter mask: " << hex8 (read_reg (AHB_TB_FILTER_MASK)) << endl;
+  cout << "  time cntrl: " << hex8 (time) << endl;
+  cout << " filter mask: " << hex8 (fmask) << endl;
 
   if (nbr > ahb_idx_mask + 1)
     nbr = ahb_idx_mask + 1;
+
+  //  Start the reads of all the entries, by groups which are displayed as
+  //  soon as they are read.
+  vector<unsigned char> tb (16 * nbr);
+  vector<unsigned long> tickets;
+  dsu_link *link = get_link ();
+  word start = (tbidx - nbr * 16) & ahb_idx_mask;
+  for (unsigned int k = 0; k < (unsigned int) nbr; k += trace_group)
+    {
+      vector<dsu_xfer> xfers;
+      for (unsigned int j = k;
+	   j < (unsigned int) nbr && j < k + trace_group;
+	   j++)
+	xfers.push_back
+	  ({ reg_addr (AHB_TB + ((start + 16 * j) & ahb_idx_mask)),
+	     4, &tb[16 * j], false });
+      tickets.push_back (link->start (xfers.data (), xfers.size ()));
+    }
+
   cout << "    Bp TimeTag  W Tr Sz Br Mst Lk Rsp Data     Addr" << endl;
-  for (word i = (tbidx - nbr * 16) & ahb_idx_mask;
+  for (word i = start, k = 0;
        nbr != 0;
-       i = (i + 16) & ahb_idx_mask, nbr--)
+       i = (i + 16) & ahb_idx_mask, nbr--, k++)
     {
-      word w0 = read_reg (AHB_TB + i + 0);
-      word w1 = read_reg (AHB_TB + i + 4);
-      word w2 = read_reg (AHB_TB + i + 8);
-      word w3 = read_reg (AHB_TB + i + 12);
+      if (k % trace_group == 0 && !link->wait (tickets[k / trace_group]))
+	{
+	  link->sync ();
+	  throw link_error (reg_addr (AHB_TB));
+	}
+      word w0 = unpack_be32 (&tb[16 * k + 0]);
+      word w1 = unpack_be32 (&tb[16 * k + 4]);
+      word w2 = unpack_be32 (&tb[16 * k + 8]);
+      word w3 = unpack_be32 (&tb[16 * k + 12]);
 
       cout << hex4 (i) << ": ";
       cout << ((w0 >> 31) ? "*" : " ") << hex8 (w0 & 0x7fffffffU);
@@ -995,15 +1192,38 @@ leon4::disp_itrace (unsigned int nbr)
   if (nbr > itrace_num)
     nbr = itrace_num - 1;
 
+  //  Start the reads of all the entries, by groups which are disassembled
+  //  as soon as they are read.
+  vector<unsigned char> tb (16 * nbr);
+  vector<unsigned long> tickets;
+  vector<dsu_xfer> xfers;
+  dsu_link *link = parent_dsu.get_link ();
+  word start = (itp - nbr) & itrace_mask;
+  for (word i = start, k = 0; i != itp; i = (i + 1) & itrace_mask, k++)
+    {
+      xfers.push_back
+	({ dsu_reg_addr (INSTR_TB + 16 * i), 4, &tb[16 * k], false });
+      if (xfers.size () == trace_group || ((i + 1) & itrace_mask) == itp)
+	{
+	  tickets.push_back (link->start (xfers.data (), xfers.size ()));
+	  xfers.clear ();
+	}
+    }
+
   cout << "M TimeTag  Result   T E PC       Opcode" << endl;
-  for (int i = (itp - nbr) & itrace_mask;
+  for (word i = start, k = 0;
        i != itp;
-       i = (i + 1) & itrace_mask)
+       i = (i + 1) & itrace_mask, k++)
     {
-      word w0 = read_dsu_reg (INSTR_TB + 16 * i + 0);
-      word res = read_dsu_reg (INSTR_TB + 16 * i + 4);
-      word pc = read_dsu_reg (INSTR_TB + 16 * i + 8);
-      word insn = read_dsu_reg (INSTR_TB + 16 * i + 12);
+      if (k % trace_group == 0 && !link->wait (tickets[k / trace_group]))
+	{
+	  link->sync ();
+	  throw link_error (dsu_reg_addr (INSTR_TB));
+	}
+      word w0 = unpack_be32 (&tb[16 * k + 0]);
+      word res = unpack_be32 (&tb[16 * k + 4]);
+      word pc = unpack_be32 (&tb[16 * k + 8]);
+      word insn = unpack_be32 (&tb[16 * k + 12]);
 
       if (i == ((itp - 1) & itrace_mask))
 	cout << "->";
@@ -76,6 +76,16 @@ class dsu
   // Resume execution
   virtual void go (void) = 0;
 
+  // Resume execution until the cpus break (e.g. on a ta 1), without
+  // reporting it nor inserting the breakpoints.  Used to run helper
+  // programs.  Return false if interrupted.
+  bool call (void) { call_start (); return call_wait (); }
+
+  // The two halves of call: resume, then wait for the break (so that the
+  // link can be used meanwhile).
+  virtual void call_start (void) = 0;
+  virtual bool call_wait (void) = 0;
+
   // Stop execution.
   virtual void stop (void) = 0;
 
@@ -210,6 +220,8 @@ enum sparc_regs : unsigned
   REG_SPARC_G0 = 0,
   REG_SPARC_O0 = 8,
   REG_SPARC_O1 = 9,
-  REG_SPARC_O2 = 10
+  REG_SPARC_O2 = 10,
+  REG_SPARC_O3 = 11,
+  REG_SPARC_O4 = 12
 };
 #endif /* DSU_H */
@@ -0,0 +1,298 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+#include <sys/types.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "lemon.h"
+#include "osdep.h"
+#include "sim.h"
+
+using namespace std;
+
+//  EDCL stand-in: answers the EDCL requests (UDP) sent to ADDR (127.0.0.1
+//  by default) with a simulated board (see sim.h), with configurable
+//  losses, delays and reordering, to test the eth links without hardware:
+//
+//    edcl-sim [--addr ADDR] [--port N] [--drop PCT] [--delay US]
+//             [--jitter US] [--reorder PCT] [--max-len BYTES] [--seed N]
+//             [--edcls N]
+//
+//  Like the hardware, only the request with the expected sequence number
+//  is executed; the others get a NAK with the expected number, which
+//  starts at a random value.  Each request, and each reply, is dropped
+//  with probability PCT %.  Replies are sent after DELAY plus a random
+//  part of JITTER, and some of them are held back (REORDER) so that the
+//  next ones overtake them.  Requests with more than MAX-LEN data bytes
+//  are dropped, as by an EDCL with a small buffer.
+//
+//  With --edcls N, the board has N EDCLs, at ADDR and the N - 1 following
+//  addresses, each with its own sequence number, to test the striping over
+//  several links.
+//
+//  --eth-raw is tested with the address of the far end of a veth pair (see
+//  the soak-raw target of the Makefile).
+
+//  Maximum time (in us) the board runs between two requests.
+static const unsigned long max_run = 20000;
+
+struct edcl_sim_stats
+{
+  unsigned long requests = 0;
+  unsigned long executed = 0;
+  unsigned long naks = 0;
+  unsigned long dropped = 0;
+  unsigned long oversize = 0;
+  unsigned long reordered = 0;
+};
+
+static void
+usage (void)
+{
+  cerr << "usage: edcl-sim [--addr ADDR] [--port N] [--drop PCT]"
+       << " [--delay US]" << endl
+       << "                [--jitter US] [--reorder PCT] [--max-len BYTES]"
+       << " [--seed N]" << endl
+       << "                [--edcls N]" << endl;
+}
+
+static void
+disp_stats (const edcl_sim_stats &st)
+{
+  cout << "edcl-sim: " << st.requests << " requests, "
+       << st.executed << " executed, " << st.naks << " naks, "
+       << st.dropped << " dropped, " << st.oversize << " oversize, "
+       << st.reordered << " reordered" << endl;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned int port = 1025;
+  double drop = 0;
+  unsigned int delay = 0;
+  unsigned int jitter = 0;
+  double reorder = 0;
+  unsigned int max_len = 0x3ff & ~3;
+  unsigned int seed = 1;
+  unsigned int nedcls = 1;
+  struct in_addr addr;
+
+  addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  for (int i = 1; i < argc; i++)
+    {
+      const char *opt = argv[i];
+
+      if (i + 1 >= argc)
+	{
+	  usage ();
+	  return 1;
+	}
+      const char *arg = argv[++i];
+
+      if (strcmp (opt, "--addr") == 0)
+	{
+	  if (!::inet_aton (arg, &addr))
+	    {
+	      cerr << "cannot parse ip address '" << arg << "'" << endl;
+	      return 1;
+	    }
+	}
+      else if (strcmp (opt, "--port") == 0)
+	port = atoi (arg);
+      else if (strcmp (opt, "--drop") == 0)
+	drop = atof (arg) / 100;
+      else if (strcmp (opt, "--delay") == 0)
+	delay = atoi (arg);
+      else if (strcmp (opt, "--jitter") == 0)
+	jitter = atoi (arg);
+      else if (strcmp (opt, "--reorder") == 0)
+	reorder = atof (arg) / 100;
+      else if (strcmp (opt, "--max-len") == 0)
+	max_len = atoi (arg);
+      else if (strcmp (opt, "--seed") == 0)
+	seed = atoi (arg);
+      else if (strcmp (opt, "--edcls") == 0)
+	nedcls = atoi (arg);
+      else
+	{
+	  cerr << "unknown option '" << opt << "'" << endl;
+	  usage ();
+	  return 1;
+	}
+    }
+
+  if (nedcls == 0 || nedcls > 254)
+    {
+      cerr << "edcl-sim: --edcls must be between 1 and 254" << endl;
+      return 1;
+    }
+
+  mt19937 rng (seed);
+  uniform_real_distribution<double> uniform (0, 1);
+  sim_board board;
+  edcl_sim_stats st;
+  //  For each EDCL: its socket and the sequence number it expects.
+  vector<int> socks (nedcls);
+  vector<unsigned int> expected (nedcls);
+  int maxfd = 0;
+  //  EDCL whose request is handled first.
+  unsigned int turn = 0;
+
+  for (unsigned int e = 0; e < nedcls; e++)
+    {
+      int sock = ::socket (PF_INET, SOCK_DGRAM, 0);
+      if (sock < 0)
+	{
+	  perror ("cannot create socket");
+	  return 1;
+	}
+
+      struct sockaddr_in local;
+      memset (&local, 0, sizeof (local));
+      local.sin_family = AF_INET;
+      local.sin_port = htons (port);
+      local.sin_addr.s_addr = htonl (ntohl (addr.s_addr) + e);
+      if (::bind (sock, (struct sockaddr *)&local, sizeof (local)) < 0)
+	{
+	  perror ("cannot bind socket");
+	  return 1;
+	}
+      socks[e] = sock;
+      expected[e] = rng () & 0x3fff;
+      if (sock > maxfd)
+	maxfd = sock;
+      cout << "edcl-sim: listening on " << inet_ntoa (local.sin_addr)
+	   << ":" << port << endl;
+    }
+
+  //  Replies to send, by due time.
+  struct reply
+  {
+    int sock;
+    struct sockaddr_in to;
+    vector<unsigned char> pkt;
+  };
+  multimap<chrono::steady_clock::time_point, reply> replies;
+  auto last = chrono::steady_clock::now ();
+
+  install_handler ();
+
+  while (!user_stop)
+    {
+      //  Send the replies that are due, and wait for the next one (or for
+      //  a request).
+      auto now = chrono::steady_clock::now ();
+      while (!replies.empty () && replies.begin ()->first <= now)
+	{
+	  const reply &r = replies.begin ()->second;
+
+	  ::sendto (r.sock, r.pkt.data (), r.pkt.size (), 0,
+		    (const struct sockaddr *)&r.to, sizeof (r.to));
+	  replies.erase (replies.begin ());
+	}
+
+      long us = 100000;
+      if (!replies.empty ())
+	us = chrono::duration_cast<chrono::microseconds>
+	  (replies.begin ()->first - now).count ();
+      struct timeval tv = { us / 1000000, us % 1000000 };
+      fd_set fds;
+      FD_ZERO (&fds);
+      for (int sock : socks)
+	FD_SET (sock, &fds);
+      if (select (maxfd + 1, &fds, nullptr, nullptr, &tv) <= 0)
+	continue;
+
+      //  One request, from the EDCLs in turn.
+      unsigned int e = turn;
+      while (!FD_ISSET (socks[e], &fds))
+	e = (e + 1) % nedcls;
+      turn = (e + 1) % nedcls;
+
+      unsigned char pkt[1536];
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof (from);
+      int len = ::recvfrom (socks[e], pkt, sizeof (pkt), 0,
+			    (struct sockaddr *)&from, &fromlen);
+      if (len < 10)
+	continue;
+      st.requests++;
+      if (uniform (rng) < drop)
+	{
+	  st.dropped++;
+	  continue;
+	}
+
+      word ctrl = unpack_be32 (pkt + 2);
+      word addr = unpack_be32 (pkt + 6);
+      unsigned int seq = ctrl >> 18;
+      bool is_write = (ctrl >> 17) & 1;
+      unsigned int dlen = (ctrl >> 7) & 0x3ff;
+      if (dlen > max_len || (is_write && (unsigned int)len < 10 + dlen))
+	{
+	  st.oversize++;
+	  continue;
+	}
+
+      reply r;
+      r.sock = socks[e];
+      r.to = from;
+      r.pkt.assign (pkt, pkt + 10);
+      if (seq != expected[e])
+	{
+	  pack_be32 (&r.pkt[2], (expected[e] << 18) | (1 << 17));
+	  st.naks++;
+	}
+      else
+	{
+	  //  Let the board run for the time elapsed since the last request.
+	  now = chrono::steady_clock::now ();
+	  unsigned long elapsed = chrono::duration_cast<chrono::microseconds>
+	    (now - last).count ();
+	  last = now;
+	  board.run ((elapsed < max_run ? elapsed : max_run) * sim_board::mhz);
+
+	  //  Unmapped addresses read as 0.
+	  if (is_write)
+	    board.write (addr, dlen / 4, pkt + 10);
+	  else
+	    {
+	      r.pkt.resize (10 + dlen, 0);
+	      board.read (addr, dlen / 4, &r.pkt[10]);
+	    }
+	  pack_be32 (&r.pkt[2], (seq << 18) | (is_write ? 0 : dlen << 7));
+	  expected[e] = (expected[e] + 1) & 0x3fff;
+	  st.executed++;
+	}
+
+      if (uniform (rng) < drop)
+	{
+	  st.dropped++;
+	  continue;
+	}
+      unsigned long wait = delay;
+      if (jitter != 0)
+	wait += rng () % jitter;
+      if (uniform (rng) < reorder)
+	{
+	  wait += 2 * (delay + jitter) + 500;
+	  st.reordered++;
+	}
+      replies.insert
+	(make_pair (chrono::steady_clock::now ()
+		    + chrono::microseconds (wait), r));
+    }
+
+  disp_stats (st);
+  return 0;
+}
@@ -39,6 +39,9 @@
 #include "osdep.h"
 #include "breakpoint.h"
 #include "spim.h"
+#include "bench.h"
+#include "serve.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -48,23 +51,6 @@ static soc *board;
 static bool quit = false;
 static bool flag_forward = true;
 
-word
-bar_to_base (word bar, word bus_base)
-{
-  word addr = bar >> 20;
-
-  switch (bar_to_typ (bar))
-    {
-    case BAR_AHB_MEM:
-      return addr << 20;
-    case BAR_AHB_IO:
-    case BAR_APB_IO:
-      return bus_base + (addr << 8);
-    default:
-      return bad_base;
-    }
-}
-
 static void
 cmd_devices (bool all)
 {
@@ -320,17 +306,46 @@ dump_memory (int sz, menu_item_arg &args)
   else
     len = 64;
 
-  while (len > 0)
+  //  The memory is read by blocks, the next block being read while the
+  //  current one is displayed.  The blocks start at the word containing
+  //  their first byte, SKEW bytes before it.
+  dsu_link *link = board->get_link ();
+  static const word block = 1024;
+  unsigned char blocks[2][block + 8];
+  unsigned long tickets[2];
+  word skew = addr & 3;
+  word next = addr;
+  auto start_block = [&](int k)
     {
-      word l = len > 16 ? 16 : len;
-      unsigned char buf[16];
+      word l = min (block, addr + len - next);
+      dsu_xfer x = { next - skew, (skew + l + 3) / 4, blocks[k], false };
 
-      cout << hex8 << addr << " ";
-      if (!board->get_link ()->read (addr, (l + 3) / 4, buf))
+      tickets[k] = link->start (&x, 1);
+      next += l;
+    };
+
+  if (len > 0)
+    start_block (0);
+
+  for (word off = 0; off < len; off += 16)
+    {
+      word l = len - off > 16 ? 16 : len - off;
+      int k = (off / block) & 1;
+      unsigned char *buf = blocks[k] + skew + off % block;
+
+      if (off % block == 0)
 	{
-	  cout << "link error" << endl;
-	  break;
+	  if (!link->wait (tickets[k]))
+	    {
+	      link->sync ();
+	      cout << "link error" << endl;
+	      break;
+	    }
+	  if (next < addr + len)
+	    start_block (k ^ 1);
 	}
+
+      cout << hex8 << addr + off << " ";
       if (sz == 1)
 	{
 	  for (word i = 0; i < l; i++)
@@ -351,9 +366,6 @@ dump_memory (int sz, menu_item_arg &args)
 	  cout << char ((c >= 0x20 && c <= 0x7e) ? c : '.');
 	}
       cout << endl;
-
-      addr += l;
-      len -= l;
     }
 }
 
@@ -396,9 +408,26 @@ cmd_disa (menu_item_arg &args)
 
 static void
 cmd_load (menu_item_arg &args)
+{
+  cmd_arg_options *opts = dynamic_cast<cmd_arg_options *>(args.get_arg (0));
+  cmd_arg_file *arg = dynamic_cast<cmd_arg_file *>(args.get_arg (1));
+  unsigned int flags = 0;
+
+  if (opts->is_set ("--delta"))
+    flags |= LOAD_DELTA;
+  if (opts->is_set ("--verify"))
+    flags |= LOAD_VERIFY;
+  if (opts->is_set ("--compress"))
+    flags |= LOAD_COMPRESS;
+  load_elf (board_dsu, arg->filename.c_str (), true, flags);
+}
+
+static void
+cmd_verify (menu_item_arg &args)
 {
   cmd_arg_file *arg = dynamic_cast<cmd_arg_file *>(args.get_arg (0));
-  load_elf (board_dsu, arg->filename.c_str (), true);
+
+  verify_elf (board_dsu, arg->filename.c_str ());
 }
 
 static void
@@ -667,6 +696,16 @@ cmd_ahb (menu_item_arg &args)
     }
 }
 
+static void
+cmd_bench_link (menu_item_arg &args)
+{
+  cmd_arg_expr *arg0 = dynamic_cast<cmd_arg_expr *>(args.get_arg (0));
+  cmd_arg_expr *arg1 = dynamic_cast<cmd_arg_expr *>(args.get_arg (1));
+  word len = arg1->present ? arg1->value : 2 << 20;
+
+  bench_link (board->get_link (), arg0->value, len);
+}
+
 static void
 cmd_tracecom (menu_item_arg &args)
 {
@@ -678,6 +717,16 @@ cmd_tracecom (menu_item_arg &args)
     cout << "trace com is " << trace_com << endl;
 }
 
+static void
+cmd_tracedump (menu_item_arg &args)
+{
+  cmd_arg_file *arg = dynamic_cast<cmd_arg_file *>(args.get_arg (0));
+  const char *filename = arg->present ? arg->filename.c_str () : nullptr;
+
+  if (trace_dump (filename))
+    cout << "link trace written" << endl;
+}
+
 static void
 cmd_sbreak (menu_item_arg &args)
 {
@@ -979,99 +1028,66 @@ main (int argc, char **argv)
 {
   dsu_link *link;
   Cpu *cur_cpu = nullptr;
-  const char *eth = nullptr;
-  const char *jtag = nullptr;
-  const char *remote = nullptr;
-  bool usb = false;
+  link_options link_opts;
   bool flag_reset = true;
   bool flag_probe = true;
+  bool flag_stats = false;
+  unsigned int serve_port = 0;
 
   //  List of commands (from command line) to execute.
   list<string> init_cmds;
 
   for (int i = 1; i < argc; i++)
-    if (strcmp (argv[i], "--eth") == 0)
-      {
-	i++;
-	if (i >= argc)
-	  {
-	    cerr << "missing argument after --eth" << endl;
-	    return 1;
-	  }
-	eth = argv[i];
-      }
-    else if (strcmp (argv[i], "--usb") == 0)
-      usb = true;
-    else if (strcmp (argv[i], "--jtag") == 0)
-      {
-	i++;
-	if (i >= argc)
-	  {
-	    cerr << "missing argument after --jtag" << endl;
-	    return 1;
-	  }
-	jtag = argv[i];
-#ifndef HAVE_LIBURJTAG
-	cerr << "-jtag not available (not compiled with urjtag)" << endl;
-	return 2;
-#endif
+    {
+      int res = parse_link_option (argc, argv, i, link_opts);
 
-      }
-    else if (strcmp (argv[i], "--remote") == 0)
-      {
-	i++;
-	if (i >= argc)
-	  {
-	    cerr << "missing argument after --remote" << endl;
-	    return 1;
-	  }
-	remote = argv[i];
-      }
-    else if (strcmp (argv[i], "-i") == 0)
-      {
-	i++;
-	if (i >= argc)
-	  {
-	    cerr << "missing command after -i" << endl;
-	    return 1;
-	  }
-	init_cmds.push_back (argv[i]);
-      }
-    else if (strcmp (argv[i], "--no-reset") == 0)
-      flag_reset = false;
-    else if (strcmp (argv[i], "--no-probe") == 0)
-      flag_probe = false;
-    else if (strcmp (argv[i], "--trace-com") == 0)
-      trace_com = true;
-    else if (strcmp (argv[i], "--no-forward") == 0)
-      flag_forward = false;
-    else
-      {
-	cerr << "unknown option '" << argv[i] << "'" << endl;
+      if (res < 0)
 	return 1;
-      }
+      if (res > 0)
+	continue;
 
-  if (((eth != nullptr)
-       + (usb ? 1 : 0)
-       + (jtag != nullptr)
-       + (remote != nullptr))
-      > 1)
-    {
-      cerr << "more than one interface selected" << endl;
-      return 1;
+      if (strcmp (argv[i], "-i") == 0)
+	{
+	  i++;
+	  if (i >= argc)
+	    {
+	      cerr << "missing command after -i" << endl;
+	      return 1;
+	    }
+	  init_cmds.push_back (argv[i]);
+	}
+      else if (strcmp (argv[i], "--no-reset") == 0)
+	flag_reset = false;
+      else if (strcmp (argv[i], "--no-probe") == 0)
+	flag_probe = false;
+      else if (strcmp (argv[i], "--stats") == 0)
+	flag_stats = true;
+      else if (strcmp (argv[i], "--serve") == 0)
+	{
+	  i++;
+	  if (i >= argc)
+	    {
+	      cerr << "missing port after --serve" << endl;
+	      return 1;
+	    }
+	  serve_port = atoi (argv[i]);
+	  //  The clients may run the cpus: nothing but the plug and play
+	  //  areas can be cached.
+	  link_opts.cache = false;
+	}
+      else if (strcmp (argv[i], "--no-forward") == 0)
+	flag_forward = false;
+      else
+	{
+	  cerr << "unknown option '" << argv[i] << "'" << endl;
+	  return 1;
+	}
     }
 
   //  Create the link to the board.
-  if (eth != nullptr)
-    link = create_eth_dsu_link (eth);
-#ifdef HAVE_LIBURJTAG
-  else if (jtag != nullptr)
-    link = new jtag_dsu_link (jtag);
-#endif
-  else if (remote != nullptr)
-    link = new remote_dsu_link (remote);
-  else
-    link = new usb_dsu_link;
+  link = create_link (link_opts);
+  if (link == nullptr)
+    return 1;
 
   //  Connect to the board.
   if (!link->open ())
@@ -1108,6 +1124,28 @@ main (int argc, char **argv)
 	   [](menu_item_arg &args) { cmd_devices (true); })
       },
       [](void) { cmd_devices (false); }));
+  main_menu->add
+    (new menu_item_submenu
+     ("linkstats", "display link statistics",
+      {
+	new menu_item_arg
+	  ("-reset", "clear link statistics", { },
+	   [](menu_item_arg &args) { reset_link_stats (board->get_link ()); })
+      },
+      [](void) { disp_link_stats (board->get_link ()); }));
+  main_menu->add
+    (new menu_item_submenu
+     ("bench", "benchmarks",
+      {
+	new menu_item_arg
+	  ("link", "measure link throughput (overwrites memory)",
+	   {
+	     new cmd_arg_expr ("addr", false, "start address"),
+	     new cmd_arg_expr ("length", true, "number of bytes")
+	   },
+	   [](menu_item_arg &args) { cmd_bench_link (args); })
+      },
+      [](void) { }));
   main_menu->add
     (new menu_item_arg
      ("quit", "quit monitor", { },
@@ -1156,6 +1194,11 @@ main (int argc, char **argv)
      ("tracecom", "trace communication with the board",
       { new cmd_arg_bool ("enable", true, "enable/disable com traces") },
       cmd_tracecom));
+  main_menu->add
+    (new menu_item_arg
+     ("tracedump", "write the link trace (see --trace)",
+      { new cmd_arg_file ("file", true, "pcap or pcapng file") },
+      cmd_tracedump));
 
   create_menu_devices (main_menu);
 
@@ -1176,8 +1219,18 @@ main (int argc, char **argv)
       main_menu->add
 	(new menu_item_arg
 	 ("load", "load an elf file",
-	  { new cmd_arg_file ("file", false, "filename to load") },
+	  { new cmd_arg_options
+	      ("--delta|--verify|--compress",
+	       { "--delta", "--verify", "--compress" },
+	       "write only the changed blocks, check the memory,"
+	       " send compressed data"),
+	    new cmd_arg_file ("file", false, "filename to load") },
 	  cmd_load));
+      main_menu->add
+	(new menu_item_arg
+	 ("verify", "check the memory against an elf file",
+	  { new cmd_arg_file ("file", false, "filename to check") },
+	  cmd_verify));
       main_menu->add
 	(new menu_item_arg
 	 ("loadsym", "load symbols from elf file",
@@ -1227,6 +1280,18 @@ main (int argc, char **argv)
   if (flag_reset)
     cmd_reset ();
 
+  if (serve_port != 0)
+    {
+      install_handler ();
+      serve_link (board, serve_port);
+      if (board_dsu != nullptr)
+	board_dsu->release ();
+      link->close ();
+      if (flag_stats)
+	disp_link_stats (link);
+      return 0;
+    }
+
   if (init_cmds.size () > 0)
     {
       for (auto c: init_cmds)
@@ -1239,6 +1304,9 @@ main (int argc, char **argv)
 	  cerr << "error: " << e.get_msg () << endl;
 	  return 1;
 	}
+      link->close ();
+      if (flag_stats)
+	disp_link_stats (link);
       return 0;
     }
 
@@ -1298,6 +1366,9 @@ main (int argc, char **argv)
 
   link->close ();
 
+  if (flag_stats)
+    disp_link_stats (link);
+
   write_history (NULL);
   return 0;
 }
@@ -66,4 +66,7 @@ id_to_irq (unsigned int id)
 
 word bar_to_base (word bar, word bus_base);
 
+//  Last address of the area decoded by BAR.
+word bar_to_last (word bar, word bus_base);
+
 #endif /* LEMON_H_ */
@@ -1,13 +1,28 @@
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
 #include <libusb-1.0/libusb.h>
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <poll.h>
 
 #include "links.h"
+#include "devices.h"
 #include "outputs.h"
+#include "trace.h"
 
 using namespace std;
 
@@ -50,6 +65,528 @@ dsu_link::write_word (word addr, word val)
     throw link_error (addr);
 }
 
+word
+plan_packet (const link_constraints &c, word addr, word len)
+{
+  //  Packets are multiple of words and of the alignment unit.
+  word unit = c.align > 4 ? c.align : 4;
+  word max_len = c.max_len & ~(unit - 1);
+
+  if (len > max_len)
+    len = max_len;
+  if (c.boundary != 0)
+    {
+      word room = c.boundary - (addr & (c.boundary - 1));
+
+      if (len > room)
+	len = room;
+    }
+  return len;
+}
+
+xfer_packer::xfer_packer (dsu_xfer *xfers, unsigned int n,
+			  const link_constraints &c)
+{
+  size_t tmp_len = 0;
+
+  //  First pass: find runs of contiguous transfers.
+  for (unsigned int i = 0; i < n; )
+    {
+      dsu_xfer &x = xfers[i];
+      unsigned int last = i + 1;
+      unsigned int nwords = x.nwords;
+
+      while (last < n
+	     && xfers[last].is_write == x.is_write
+	     && xfers[last].addr == x.addr + 4 * nwords
+	     && plan_packet (c, x.addr, 4 * (nwords + xfers[last].nwords))
+		== 4 * (nwords + xfers[last].nwords))
+	nwords += xfers[last++].nwords;
+
+      if (last != i + 1)
+	{
+	  run r = { i, last, tmp_len };
+	  runs.push_back (r);
+	  tmp_len += 4 * nwords;
+	}
+      i = last;
+    }
+  tmp.resize (tmp_len);
+
+  //  Second pass: create packets.
+  auto r = runs.begin ();
+  for (unsigned int i = 0; i < n; )
+    {
+      dsu_xfer &x = xfers[i];
+
+      if (r != runs.end () && r->first == i)
+	{
+	  //  Several transfers: gather/scatter through TMP.
+	  dsu_xfer p = { x.addr, 0, &tmp[r->off], x.is_write };
+	  for (unsigned int j = r->first; j < r->last; j++)
+	    {
+	      if (x.is_write)
+		memcpy (p.buf + 4 * p.nwords, xfers[j].buf,
+			4 * xfers[j].nwords);
+	      p.nwords += xfers[j].nwords;
+	    }
+	  packets.push_back (p);
+	  i = r->last;
+	  r++;
+	}
+      else
+	{
+	  //  Single transfer: split it in chunks.
+	  for (unsigned int off = 0; off < x.nwords; )
+	    {
+	      word addr = x.addr + 4 * off;
+	      unsigned int l = plan_packet (c, addr, 4 * (x.nwords - off)) / 4;
+	      dsu_xfer p = { addr, l, x.buf + 4 * off, x.is_write };
+
+	      packets.push_back (p);
+	      off += l;
+	    }
+	  i++;
+	}
+    }
+  this->xfers = xfers;
+}
+
+void
+xfer_packer::scatter (void)
+{
+  for (auto &r : runs)
+    {
+      if (xfers[r.first].is_write)
+	continue;
+
+      const unsigned char *p = &tmp[r.off];
+      for (unsigned int j = r.first; j < r.last; j++)
+	{
+	  memcpy (xfers[j].buf, p, 4 * xfers[j].nwords);
+	  p += 4 * xfers[j].nwords;
+	}
+    }
+}
+
+void
+latency_histogram::add (uint64_t us)
+{
+  unsigned int idx;
+
+  if (us < 16)
+    idx = us;
+  else
+    {
+      //  8 buckets for each power of 2.
+      int msb = 4;
+      while (us >> (msb + 1))
+	msb++;
+      idx = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+    }
+  buckets[idx]++;
+  count++;
+  total += us;
+  if (us > max)
+    max = us;
+}
+
+uint64_t
+latency_histogram::percentile (double p) const
+{
+  uint64_t lim = p * count;
+  uint64_t n = 0;
+
+  for (unsigned int idx = 0; idx < nbuckets; idx++)
+    {
+      n += buckets[idx];
+      if (n > lim || n == count)
+	{
+	  uint64_t high;
+
+	  if (idx < 16)
+	    high = idx;
+	  else
+	    {
+	      int shift = idx / 8 - 1;
+	      high = ((uint64_t)(8 + idx % 8 + 1) << shift) - 1;
+	    }
+	  return high < max ? high : max;
+	}
+    }
+  return max;
+}
+
+void
+link_stats::record (link_op op, unsigned int len, bool ok,
+		    chrono::steady_clock::time_point start)
+{
+  op_stats &s = ops[op];
+
+  s.latency.add (chrono::duration_cast<chrono::microseconds>
+		 (chrono::steady_clock::now () - start).count ());
+  s.bytes += len;
+  if (!ok)
+    s.errors++;
+}
+
+void
+disp_link_stats (dsu_link *link)
+{
+  static const char *const op_names[NBR_LINK_OPS] =
+    { "read", "write", "transact" };
+
+  for (; link != nullptr; link = link->get_next ())
+    {
+      const link_stats &st = link->stats;
+
+      cout << "link " << link->get_name () << ":" << endl;
+      printf ("  %-8s %9s %11s %6s %8s %8s %8s %8s %8s\n",
+	      "op", "count", "bytes", "errors",
+	      "avg(us)", "p50", "p90", "p99", "max");
+      for (int i = 0; i < NBR_LINK_OPS; i++)
+	{
+	  const link_stats::op_stats &s = st.ops[i];
+	  const latency_histogram &h = s.latency;
+
+	  if (h.count == 0)
+	    continue;
+	  printf ("  %-8s %9llu %11llu %6llu %8llu %8llu %8llu %8llu %8llu\n",
+		  op_names[i],
+		  (unsigned long long)h.count,
+		  (unsigned long long)s.bytes,
+		  (unsigned long long)s.errors,
+		  (unsigned long long)(h.total / h.count),
+		  (unsigned long long)h.percentile (0.5),
+		  (unsigned long long)h.percentile (0.9),
+		  (unsigned long long)h.percentile (0.99),
+		  (unsigned long long)h.max);
+	}
+      cout << "  retries: " << st.retries
+	   << ", resyncs: " << st.resyncs
+	   << ", timeouts: " << st.timeouts << endl;
+
+      //  The other links of a stripe, with the links below them, before
+      //  the first one.
+      for (unsigned int i = 1; link->get_branch (i) != nullptr; i++)
+	disp_link_stats (link->get_branch (i));
+    }
+}
+
+void
+reset_link_stats (dsu_link *link)
+{
+  for (; link != nullptr; link = link->get_next ())
+    {
+      link->stats = link_stats ();
+      for (unsigned int i = 1; link->get_branch (i) != nullptr; i++)
+	reset_link_stats (link->get_branch (i));
+    }
+}
+
+bool
+dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
+{
+  sync ();
+
+  auto start = chrono::steady_clock::now ();
+  bool ok = do_read (addr, nwords, res);
+
+  stats.record (OP_READ, nwords * 4, ok, start);
+  if (!ok)
+    trace_error ();
+  return ok;
+}
+
+bool
+dsu_link::write (word addr, unsigned int nwords, const unsigned char *buf)
+{
+  sync ();
+
+  auto start = chrono::steady_clock::now ();
+  bool ok = do_write (addr, nwords, buf);
+
+  stats.record (OP_WRITE, nwords * 4, ok, start);
+  if (!ok)
+    trace_error ();
+  return ok;
+}
+
+bool
+dsu_link::transact (dsu_xfer *xfers, unsigned int n)
+{
+  sync ();
+  return run_transact (xfers, n);
+}
+
+bool
+dsu_link::run_transact (dsu_xfer *xfers, unsigned int n)
+{
+  auto start = chrono::steady_clock::now ();
+  bool ok = do_transact (xfers, n);
+  unsigned int len = 0;
+
+  for (unsigned int i = 0; i < n; i++)
+    len += xfers[i].nwords * 4;
+  stats.record (OP_TRANSACT, len, ok, start);
+  if (!ok)
+    trace_error ();
+  return ok;
+}
+
+//  The asynchronous transfers are done by a thread, in order.  The eth and
+//  usb-async links pipeline the packets of each job.
+struct async_queue
+{
+  struct job
+  {
+    unsigned long ticket;
+    vector<dsu_xfer> xfers;
+  };
+
+  mutex lock;
+  condition_variable cond;
+  deque<job> jobs;
+  //  Last ticket given, and last ticket completed.
+  unsigned long last = 0;
+  unsigned long done = 0;
+  //  Tickets which failed, and not yet waited for.
+  set<unsigned long> failed;
+};
+
+unsigned long
+dsu_link::start (dsu_xfer *xfers, unsigned int n)
+{
+  if (async == nullptr)
+    {
+      async = new async_queue;
+      thread ([this](void)
+	{
+	  unique_lock<mutex> l (async->lock);
+
+	  while (1)
+	    {
+	      async->cond.wait (l, [this]() { return !async->jobs.empty (); });
+	      async_queue::job &j = async->jobs.front ();
+
+	      l.unlock ();
+	      bool ok = run_transact (j.xfers.data (), j.xfers.size ());
+	      l.lock ();
+
+	      if (!ok)
+		async->failed.insert (j.ticket);
+	      async->done = j.ticket;
+	      async->jobs.pop_front ();
+	      async->cond.notify_all ();
+	    }
+	}).detach ();
+    }
+
+  lock_guard<mutex> l (async->lock);
+  unsigned long ticket = ++async->last;
+
+  async->jobs.push_back ({ ticket, vector<dsu_xfer> (xfers, xfers + n) });
+  async->cond.notify_all ();
+  return ticket;
+}
+
+bool
+dsu_link::wait (unsigned long ticket)
+{
+  if (async == nullptr)
+    return true;
+
+  unique_lock<mutex> l (async->lock);
+
+  async->cond.wait (l, [this, ticket]() { return async->done >= ticket; });
+  return async->failed.erase (ticket) == 0;
+}
+
+void
+dsu_link::sync (void)
+{
+  if (async == nullptr)
+    return;
+
+  unique_lock<mutex> l (async->lock);
+
+  async->cond.wait (l, [this]() { return async->done == async->last; });
+}
+
+bool
+dsu_link::read_bytes (word addr, word len, unsigned char *buf)
+{
+  word unit = max (get_constraints ().align, 4U);
+  word first = addr & ~(unit - 1);
+  word end = (addr + len + unit - 1) & ~(unit - 1);
+
+  if (len == 0)
+    return true;
+
+  if (first == addr && end == addr + len)
+    {
+      dsu_xfer x = { addr, len / 4, buf, false };
+      return transact (&x, 1);
+    }
+
+  //  Read whole units and extract the bytes.
+  vector<unsigned char> tmp (end - first);
+  dsu_xfer x = { first, (end - first) / 4, tmp.data (), false };
+
+  if (!transact (&x, 1))
+    return false;
+  memcpy (buf, &tmp[addr - first], len);
+  return true;
+}
+
+bool
+dsu_link::write_bytes (word addr, word len, const unsigned char *buf)
+{
+  word unit = max (get_constraints ().align, 4U);
+  word end = addr + len;
+  //  Units with the first and the last bytes.
+  word head = addr & ~(unit - 1);
+  word tail = end & ~(unit - 1);
+  bool has_head = head != addr;
+  bool has_tail = tail != end && !(has_head && tail == head);
+  vector<unsigned char> edges (2 * unit);
+  vector<dsu_xfer> xfers;
+
+  if (len == 0)
+    return true;
+
+  //  Read the partial units...
+  if (has_head)
+    xfers.push_back ({ head, unit / 4, &edges[0], false });
+  if (has_tail)
+    xfers.push_back ({ tail, unit / 4, &edges[unit], false });
+  if (!xfers.empty () && !transact (xfers.data (), xfers.size ()))
+    return false;
+  xfers.clear ();
+
+  //  ... merge the new bytes and write everything at once.
+  word mid = addr;
+  word mid_end = has_tail ? tail : end;
+  if (has_head)
+    {
+      mid = head + unit;
+      memcpy (&edges[addr - head], buf, min (mid, end) - addr);
+      xfers.push_back ({ head, unit / 4, &edges[0], true });
+    }
+  if (mid_end > mid)
+    xfers.push_back ({ mid, (mid_end - mid) / 4,
+		       const_cast<unsigned char *>(buf + (mid - addr)), true });
+  if (has_tail)
+    {
+      memcpy (&edges[unit], buf + (tail - addr), end - tail);
+      xfers.push_back ({ tail, unit / 4, &edges[unit], true });
+    }
+  return transact (xfers.data (), xfers.size ());
+}
+
+bool
+dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  xfer_packer pk (xfers, n, get_constraints ());
+
+  for (auto &p : pk.packets)
+    {
+      bool ok;
+
+      if (p.is_write)
+	ok = do_write (p.addr, p.nwords, p.buf);
+      else
+	ok = do_read (p.addr, p.nwords, p.buf);
+      if (!ok)
+	return false;
+    }
+  pk.scatter ();
+  return true;
+}
+
+void
+dsu_batch::read_word (word addr, word *res)
+{
+  entry e;
+
+  e.xfer.addr = addr;
+  e.xfer.nwords = 1;
+  e.xfer.buf = nullptr;
+  e.xfer.is_write = false;
+  e.res = res;
+  entries.push_back (e);
+}
+
+void
+dsu_batch::write_word (word addr, word val)
+{
+  entry e;
+
+  e.xfer.addr = addr;
+  e.xfer.nwords = 1;
+  e.xfer.buf = nullptr;
+  e.xfer.is_write = true;
+  pack_be32 (e.data, val);
+  e.res = nullptr;
+  entries.push_back (e);
+}
+
+void
+dsu_batch::read (word addr, unsigned int nwords, unsigned char *res)
+{
+  entry e;
+
+  e.xfer.addr = addr;
+  e.xfer.nwords = nwords;
+  e.xfer.buf = res;
+  e.xfer.is_write = false;
+  e.res = nullptr;
+  entries.push_back (e);
+}
+
+void
+dsu_batch::write (word addr, unsigned int nwords, const unsigned char *buf)
+{
+  entry e;
+
+  e.xfer.addr = addr;
+  e.xfer.nwords = nwords;
+  //  Not modified by a write.
+  e.xfer.buf = const_cast<unsigned char *>(buf);
+  e.xfer.is_write = true;
+  e.res = nullptr;
+  entries.push_back (e);
+}
+
+void
+dsu_batch::submit (void)
+{
+  vector<dsu_xfer> xfers;
+
+  if (entries.empty ())
+    return;
+
+  //  Word accesses use the embedded buffer.  Entries don't move anymore.
+  for (auto &e : entries)
+    {
+      if (e.xfer.buf == nullptr)
+	e.xfer.buf = e.data;
+      xfers.push_back (e.xfer);
+    }
+
+  if (!link->transact (xfers.data (), xfers.size ()))
+    {
+      word addr = entries.front ().xfer.addr;
+      entries.clear ();
+      throw link_error (addr);
+    }
+
+  for (auto &e : entries)
+    if (e.res != nullptr)
+      *e.res = unpack_be32 (e.data);
+  entries.clear ();
+}
+
 bool
 usb_dsu_link::open (void)
 {
@@ -83,6 +620,8 @@ usb_dsu_link::open (void)
   max_len = max_size - 8;
   cout << "max_size: " << max_size << ", speed: " << speed << ", max_len: "
        << max_len << endl;
+  if (trace_id < 0)
+    trace_id = trace_register (TRACE_DSU, get_name ());
   return true;
 }
 
@@ -127,7 +666,7 @@ usb_dsu_link::trace (const char *pfx, const unsigned char *buf, int len)
 }
 
 bool
-usb_dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
+usb_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
 {
   int r;
   unsigned char tx_data[8];
@@ -138,20 +677,29 @@ usb_dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
   pack_be32 (&tx_data[4], len);
   if (trace_com)
     trace ("R>", tx_data, 8);
+  if (trace_id >= 0)
+    trace_packet (trace_id, false, tx_data, 8);
   r = libusb_bulk_transfer
     (devh, LIBUSB_ENDPOINT_OUT | 1, tx_data, 8, &tfr, 10);
+  if (r == LIBUSB_ERROR_TIMEOUT)
+    stats.timeouts++;
   if (r != 0 || tfr != 8)
     return false;
   r = libusb_bulk_transfer (devh, LIBUSB_ENDPOINT_IN | 1, res, len, &tfr, 10);
   if (trace_com)
     trace ("R>", res, len);
+  if (trace_id >= 0 && r == 0)
+    trace_packet (trace_id, true, res, tfr);
+  if (r == LIBUSB_ERROR_TIMEOUT)
+    stats.timeouts++;
   if (r != 0 || tfr != len)
     return false;
   return true;
 }
 
 bool
-usb_dsu_link::write (word addr, unsigned int nwords, const unsigned char *buf)
+usb_dsu_link::do_write (word addr, unsigned int nwords,
+			const unsigned char *buf)
 {
   int r;
   unsigned char tx_data[512];
@@ -164,33 +712,343 @@ usb_dsu_link::write (word addr, unsigned int nwords, const unsigned char *buf)
 
   if (trace_com)
     trace ("W>", tx_data, len + 8);
+  if (trace_id >= 0)
+    trace_packet (trace_id, false, tx_data, len + 8);
 
   r = libusb_bulk_transfer
     (devh, LIBUSB_ENDPOINT_OUT | 1, tx_data, len + 8, &tfr, 10);
+  if (r == LIBUSB_ERROR_TIMEOUT)
+    stats.timeouts++;
   if (r != 0 || tfr != len + 8)
     return false;
   return true;
 }
 
+//  Number of commands in flight and timeout (in ms) of each transfer.
+static const unsigned int usb_async_depth = 16;
+static const unsigned int usb_async_timeout = 1000;
+
+class usb_async_dsu_link : public usb_dsu_link
+{
+ public:
+  bool open (void);
+  void close (void);
+  const char *get_name (void) { return "usb-async"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
+ private:
+  struct slot
+  {
+    usb_async_dsu_link *link;
+    //  Command (and data for writes), sent on the OUT endpoint.
+    struct libusb_transfer *cmd = nullptr;
+    unsigned char *cmd_buf = nullptr;
+    //  Read data, received on the IN endpoint directly into the caller
+    //  buffer.
+    struct libusb_transfer *data = nullptr;
+    //  Number of transfers of this slot not yet completed.
+    unsigned int pending = 0;
+  };
+
+  static void LIBUSB_CALL complete (struct libusb_transfer *t);
+  bool submit (slot &s, const dsu_xfer &x);
+  void wait (void);
+  void cancel (void);
+
+  slot slots[usb_async_depth];
+  //  Number of transfers submitted and not yet completed.
+  unsigned int inflight = 0;
+  bool failed;
+};
+
+bool
+usb_async_dsu_link::open (void)
+{
+  if (!usb_dsu_link::open ())
+    return false;
+
+  for (auto &s : slots)
+    {
+      s.link = this;
+      s.cmd = libusb_alloc_transfer (0);
+      s.data = libusb_alloc_transfer (0);
+      s.cmd_buf = new unsigned char[max_len + 8];
+      if (s.cmd == nullptr || s.data == nullptr)
+	{
+	  cerr << "cannot allocate usb transfers" << endl;
+	  return false;
+	}
+    }
+  return true;
+}
+
+void
+usb_async_dsu_link::close (void)
+{
+  for (auto &s : slots)
+    {
+      libusb_free_transfer (s.cmd);
+      libusb_free_transfer (s.data);
+      delete[] s.cmd_buf;
+      s.cmd = s.data = nullptr;
+      s.cmd_buf = nullptr;
+    }
+  usb_dsu_link::close ();
+}
+
+void LIBUSB_CALL
+usb_async_dsu_link::complete (struct libusb_transfer *t)
+{
+  slot *s = (slot *)t->user_data;
+  usb_async_dsu_link *link = s->link;
+
+  if (t->status == LIBUSB_TRANSFER_TIMED_OUT)
+    link->stats.timeouts++;
+  if (t->status != LIBUSB_TRANSFER_COMPLETED
+      || t->actual_length != t->length)
+    link->failed = true;
+  else if (t == s->data)
+    {
+      if (trace_com)
+	link->trace ("R<", t->buffer, t->actual_length);
+      if (link->trace_id >= 0)
+	trace_packet (link->trace_id, true, t->buffer, t->actual_length);
+    }
+  s->pending--;
+  link->inflight--;
+}
+
+//  Handle events until at least one transfer has completed.
+void
+usb_async_dsu_link::wait (void)
+{
+  unsigned int cur = inflight;
+
+  while (inflight == cur)
+    {
+      struct timeval tv = { 0, 100000 };
+      int r = libusb_handle_events_timeout_completed (NULL, &tv, NULL);
+      if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+	{
+	  cerr << "libusb_handle_events error " << r << endl;
+	  failed = true;
+	  break;
+	}
+    }
+}
+
+//  Cancel all the transfers in flight and wait until they are reaped.
+void
+usb_async_dsu_link::cancel (void)
+{
+  for (auto &s : slots)
+    if (s.pending != 0)
+      {
+	libusb_cancel_transfer (s.data);
+	libusb_cancel_transfer (s.cmd);
+      }
+  while (inflight != 0)
+    {
+      struct timeval tv = { 0, 100000 };
+      if (libusb_handle_events_timeout_completed (NULL, &tv, NULL) < 0)
+	break;
+    }
+}
+
+bool
+usb_async_dsu_link::submit (slot &s, const dsu_xfer &x)
+{
+  unsigned int len = x.nwords << 2;
+  unsigned int cmd_len = 8;
+
+  pack_be32 (&s.cmd_buf[0], x.addr);
+  if (x.is_write)
+    {
+      //  The command and the data must be in the same packet, so the data
+      //  are copied.
+      pack_be32 (&s.cmd_buf[4], len | 0x80000000);
+      memcpy (s.cmd_buf + 8, x.buf, len);
+      cmd_len += len;
+    }
+  else
+    pack_be32 (&s.cmd_buf[4], len);
+
+  if (trace_com)
+    trace (x.is_write ? "W>" : "R>", s.cmd_buf, cmd_len);
+  if (trace_id >= 0)
+    trace_packet (trace_id, false, s.cmd_buf, cmd_len);
+
+  if (!x.is_write)
+    {
+      libusb_fill_bulk_transfer (s.data, devh, LIBUSB_ENDPOINT_IN | 1,
+				 x.buf, len, complete, &s, usb_async_timeout);
+      if (libusb_submit_transfer (s.data) != 0)
+	return false;
+      s.pending++;
+      inflight++;
+    }
+
+  libusb_fill_bulk_transfer (s.cmd, devh, LIBUSB_ENDPOINT_OUT | 1,
+			     s.cmd_buf, cmd_len, complete, &s,
+			     usb_async_timeout);
+  if (libusb_submit_transfer (s.cmd) != 0)
+    return false;
+  s.pending++;
+  inflight++;
+  return true;
+}
+
+bool
+usb_async_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  xfer_packer packer (xfers, n, get_constraints ());
+  unsigned int idx = 0;
+
+  failed = false;
+  for (auto &p : packer.packets)
+    {
+      slot &s = slots[idx];
+      idx = (idx + 1) % usb_async_depth;
+
+      //  Slots are reused in order, wait until this one is free.
+      while (s.pending != 0 && !failed)
+	wait ();
+      if (failed || !submit (s, p))
+	{
+	  cancel ();
+	  return false;
+	}
+    }
+
+  while (inflight != 0 && !failed)
+    wait ();
+  if (failed)
+    {
+      cancel ();
+      return false;
+    }
+
+  packer.scatter ();
+  return true;
+}
+
+bool
+usb_async_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  dsu_xfer x = { addr, nwords, res, false };
+  return do_transact (&x, 1);
+}
+
+bool
+usb_async_dsu_link::do_write (word addr, unsigned int nwords,
+			      const unsigned char *buf)
+{
+  dsu_xfer x = { addr, nwords, (unsigned char *)buf, true };
+  return do_transact (&x, 1);
+}
+
+dsu_link *
+create_usb_async_dsu_link (void)
+{
+  return new usb_async_dsu_link;
+}
+
 class eth_dsu_link : public dsu_link
 {
  public:
-  eth_dsu_link (const char *ipaddr) : ipaddr (ipaddr), seq (0) {};
+  eth_dsu_link (const char *ipaddr) :
+    ipaddr (ipaddr), max_len (200), window (edcl_window), seq (0),
+    synced (false) {};
   bool open (void);
-  bool read (word addr, unsigned int nwords, unsigned char *res);
-  bool write (word addr, unsigned int nwords, const unsigned char *buf);
   void close (void) { }
-  //  Maximum data payload for worst case.
-  unsigned get_max_len (void) { return 200; }
- private:
-  void write_header (unsigned char *pkt, unsigned int len, word addr, int rw);
+  unsigned get_max_len (void) { return max_len; }
+  const char *get_name (void) { return "eth"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
+
+  //  An EDCL request and its state.
+  struct edcl_op
+  {
+    //  Packet to send: address, data length in bytes, direction and data.
+    word addr;
+    unsigned int len;
+    int rw;
+    unsigned char *buf;
+    //  Sequence number used for the last transmission.
+    unsigned int seq;
+    //  Set once the request has been sent, and once the reply has been
+    //  received.
+    bool sent;
+    bool done;
+  };
+
+  //  Set DEST and create SOCK, which is polled for the replies.
+  virtual bool open_socket (void);
+  //  Send the N requests of BATCH (at most edcl_batch), with one system
+  //  call if possible.
+  virtual bool send_ops (edcl_op *const *batch, unsigned int n);
+  //  Receive up to N replies (at most edcl_batch) in RX_PKTS, and set their
+  //  lengths in LENS.  Return the number of replies, or -1 on error.
+  virtual int recv_replies (unsigned int n, unsigned int *lens);
+  void write_header (unsigned char *pkt, unsigned int len, word addr, int rw,
+		     unsigned int seq);
   void trace_edcl (const char *pfx, const unsigned char *buf, int len);
+
   const char *ipaddr;
   struct sockaddr_in dest;
-  unsigned int seq;
   int sock;
+  //  Datagrams being received.
+  vector<unsigned char> rx_pkts;
+ private:
+  //  Find the GRETH with our IP address and set MAX_LEN according to its
+  //  EDCL buffer size.
+  void probe_edcl (void);
+
+  //  Execute OPS, keeping up to WINDOW requests in flight.
+  bool run (edcl_op *ops, unsigned int n);
+  bool conflicts (const edcl_op *ops, unsigned int head, unsigned int i);
+
+  //  Maximum data payload.  Start with the worst case.
+  unsigned int max_len;
+  //  Maximum number of requests in flight: edcl_window, limited by the
+  //  EDCL buffer.
+  unsigned int window;
+  //  Next sequence number.
+  unsigned int seq;
+  //  True when SEQ is known to match the one expected by the EDCL.
+  bool synced;
+  //  Sequence number following the last acknowledged one (if ACKED_VALID):
+  //  the EDCL expects at least that number.
+  unsigned int acked = 0;
+  bool acked_valid = false;
+  //  Datagrams being sent.
+  vector<unsigned char> tx_pkts;
 };
 
+//  The sequence number is a 14 bit field.
+static const unsigned int edcl_seq_mask = 0x3fff;
+
+//  The length is a 10 bit field.
+static const unsigned int edcl_max_len = 0x3ff & ~3;
+
+//  Size of the Ethernet, IP, UDP and EDCL headers.
+static const unsigned int edcl_hdr_len = 14 + 20 + 8 + 10;
+
+//  Room for an EDCL datagram.
+static const unsigned int edcl_pkt_len = 1536;
+
+//  Maximum number of datagrams per system call.
+static const unsigned int edcl_batch = 64;
+
+unsigned int edcl_window = 4;
+unsigned int edcl_rto = 50;
+unsigned int edcl_retries = 20;
+bool edcl_mmsg = true;
+
 dsu_link *
 create_eth_dsu_link (const char *ipaddr)
 {
@@ -198,7 +1056,7 @@ create_eth_dsu_link (const char *ipaddr)
 }
 
 bool
-eth_dsu_link::open (void)
+eth_dsu_link::open_socket (void)
 {
   struct in_addr addr;
 
@@ -216,17 +1074,126 @@ eth_dsu_link::open (void)
   //  Bind it to any port.
   //  As EDCL replies with SPORT = DPORT, datagrams will be sent to the same
   //  port too.
+  //  BSD systems have a length field.
+#ifdef SIN6_LEN
   dest.sin_len = sizeof (dest);
+#endif
   dest.sin_family = AF_INET;
   dest.sin_port = htons (1025);
   dest.sin_addr = addr;
+  return true;
+}
+
+bool
+eth_dsu_link::open (void)
+{
+  if (!open_socket ())
+    return false;
+  if (trace_id < 0)
+    trace_id = trace_register (TRACE_EDCL, get_name (),
+			       ntohl (dest.sin_addr.s_addr));
+
+  tx_pkts.resize (edcl_batch * edcl_pkt_len);
+  rx_pkts.resize (edcl_batch * edcl_pkt_len);
+
+  //  The window must be smaller than half of the sequence space to
+  //  distinguish stale replies.
+  if (window == 0)
+    window = 1;
+  else if (window > (edcl_seq_mask + 1) / 2)
+    window = (edcl_seq_mask + 1) / 2;
+
+  probe_edcl ();
 
   return true;
 }
 
+void
+eth_dsu_link::probe_edcl (void)
+{
+  //  AHB slaves plug&play records.
+  const word ahb_pnp = 0xfffff800;
+  unsigned char pnp[64 * 32];
+  word ip = ntohl (dest.sin_addr.s_addr);
+
+  if (!read (ahb_pnp, sizeof (pnp) / 4, pnp))
+    return;
+
+  for (int i = 0; i < 64; i++)
+    {
+      word id = unpack_be32 (pnp + 32 * i);
+      if (id_to_vid (id) != VENDOR_GAISLER
+	  || id_to_did (id) != DEVICE_APBCTRL)
+	continue;
+
+      word apb = bar_to_base (unpack_be32 (pnp + 32 * i + 16), 0xfff00000);
+      unsigned char apb_pnp[16 * 8];
+      if (apb == bad_base
+	  || !read (apb + 0xff000, sizeof (apb_pnp) / 4, apb_pnp))
+	continue;
+
+      for (int j = 0; j < 16; j++)
+	{
+	  word aid = unpack_be32 (apb_pnp + 8 * j);
+	  if (id_to_vid (aid) != VENDOR_GAISLER
+	      || id_to_did (aid) != DEVICE_GRETH)
+	    continue;
+
+	  word base = bar_to_base (unpack_be32 (apb_pnp + 8 * j + 4), apb);
+	  unsigned char regs[8 * 4];
+	  if (!read (base, sizeof (regs) / 4, regs))
+	    continue;
+
+	  //  Control register: EDCL available and buffer size.
+	  word ctrl = unpack_be32 (regs + 0x00);
+	  if (!(ctrl >> 31) || unpack_be32 (regs + 0x1c) != ip)
+	    continue;
+
+	  unsigned int bufsz = 1024 << ((ctrl >> 28) & 7);
+	  unsigned int mtu = 1500;
+#ifdef IP_MTU
+	  {
+	    //  The path MTU is only known for a connected socket.
+	    int fd = ::socket (PF_INET, SOCK_DGRAM, 0);
+	    int val;
+	    socklen_t len = sizeof (val);
+
+	    if (fd >= 0)
+	      {
+		if (::connect (fd, (struct sockaddr *)&dest, sizeof (dest)) == 0
+		    && ::getsockopt (fd, IPPROTO_IP, IP_MTU, &val, &len) == 0)
+		  mtu = val;
+		::close (fd);
+	      }
+	  }
+#endif
+
+	  //  The buffer holds both the received and the transmitted frame.
+	  unsigned int len = edcl_max_len;
+	  if (len > mtu - (edcl_hdr_len - 14))
+	    len = mtu - (edcl_hdr_len - 14);
+	  if (len > bufsz / 2 - edcl_hdr_len)
+	    len = bufsz / 2 - edcl_hdr_len;
+	  max_len = len & ~3;
+
+	  //  Don't send more frames than the buffer can hold.
+	  unsigned int nframes = bufsz / (2 * (max_len + edcl_hdr_len));
+	  if (nframes == 0)
+	    nframes = 1;
+	  if (window > nframes)
+	    window = nframes;
+
+	  cout << "edcl: buf size: " << (bufsz >> 10) << " KB, mtu: " << mtu
+	       << ", max_len: " << max_len << ", window: " << window
+	       << endl;
+	  return;
+	}
+    }
+}
+
 void
 eth_dsu_link::write_header (unsigned char *pkt, unsigned int len,
-			    word addr, int rw)
+			    word addr, int rw, unsigned int seq)
 {
   //  Offset
   pkt[0] = 0;
@@ -266,102 +1233,685 @@ eth_dsu_link::trace_edcl (const char *pfx, const unsigned char *buf, int len)
 }
 
 bool
-eth_dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
+eth_dsu_link::send_ops (edcl_op *const *batch, unsigned int n)
 {
-  int r;
-  unsigned char tx_data[10];
-  unsigned char rx_data[1536];
-  unsigned int len = nwords << 2;
-  unsigned int app;
+  unsigned int lens[edcl_batch];
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      const edcl_op &op = *batch[i];
+      unsigned char *pkt = &tx_pkts[i * edcl_pkt_len];
+
+      lens[i] = 10;
+      write_header (pkt, op.len, op.addr, op.rw, op.seq);
+      if (op.rw)
+	{
+	  memcpy (pkt + 10, op.buf, op.len);
+	  lens[i] += op.len;
+	}
+      if (trace_com)
+	trace_edcl (op.rw ? "W>" : "R>", pkt, lens[i]);
+      if (trace_id >= 0)
+	trace_packet (trace_id, false, pkt, lens[i]);
+    }
+
+#ifdef MSG_WAITFORONE
+  //  Not worth it for a single datagram.
+  if (edcl_mmsg && n > 1)
+    {
+      struct mmsghdr msgs[edcl_batch];
+      struct iovec iovs[edcl_batch];
+
+      memset (msgs, 0, n * sizeof (msgs[0]));
+      for (unsigned int i = 0; i < n; i++)
+	{
+	  iovs[i].iov_base = &tx_pkts[i * edcl_pkt_len];
+	  iovs[i].iov_len = lens[i];
+	  msgs[i].msg_hdr.msg_name = &dest;
+	  msgs[i].msg_hdr.msg_namelen = sizeof (dest);
+	  msgs[i].msg_hdr.msg_iov = &iovs[i];
+	  msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+      //  sendmmsg may send only a part of the datagrams.
+      for (unsigned int i = 0; i < n; )
+	{
+	  int r = ::sendmmsg (sock, msgs + i, n - i, 0);
+	  if (r < 0)
+	    {
+	      perror ("send");
+	      return false;
+	    }
+	  i += r;
+	}
+      return true;
+    }
+#endif
+
+  for (unsigned int i = 0; i < n; i++)
+    if (::sendto (sock, &tx_pkts[i * edcl_pkt_len], lens[i], 0,
+		  (struct sockaddr *)&dest, sizeof (dest)) < 0)
+      {
+	perror ("send");
+	return false;
+      }
+  return true;
+}
+
+int
+eth_dsu_link::recv_replies (unsigned int n, unsigned int *lens)
+{
+#ifdef MSG_WAITFORONE
+  if (edcl_mmsg && n > 1)
+    {
+      struct mmsghdr msgs[edcl_batch];
+      struct iovec iovs[edcl_batch];
+
+      memset (msgs, 0, n * sizeof (msgs[0]));
+      for (unsigned int i = 0; i < n; i++)
+	{
+	  iovs[i].iov_base = &rx_pkts[i * edcl_pkt_len];
+	  iovs[i].iov_len = edcl_pkt_len;
+	  msgs[i].msg_hdr.msg_iov = &iovs[i];
+	  msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+      int r = ::recvmmsg (sock, msgs, n, MSG_DONTWAIT, nullptr);
+      if (r < 0 && errno == EAGAIN)
+	return 0;
+      for (int i = 0; i < r; i++)
+	lens[i] = msgs[i].msg_len;
+      return r;
+    }
+#endif
+
+  int r = ::recv (sock, &rx_pkts[0], edcl_pkt_len, 0);
+  if (r < 0)
+    return -1;
+  lens[0] = r;
+  return 1;
+}
+
+//  True if OPS[I] accesses bytes of one of the requests [HEAD, I) not yet
+//  completed, and one of them is a write.
+bool
+eth_dsu_link::conflicts (const edcl_op *ops, unsigned int head,
+			 unsigned int i)
+{
+  const edcl_op &op = ops[i];
+
+  for (unsigned int j = head; j < i; j++)
+    if (!ops[j].done
+	&& (op.rw || ops[j].rw)
+	&& op.addr < ops[j].addr + ops[j].len
+	&& ops[j].addr < op.addr + op.len)
+      return true;
+  return false;
+}
+
+bool
+eth_dsu_link::run (edcl_op *ops, unsigned int n)
+{
+  //  First op not yet completed.
+  unsigned int head = 0;
+  //  Next op to be sent.
+  unsigned int next = 0;
+  //  Number of consecutive timeouts/resyncs without progress.
+  unsigned int retries = 0;
+  //  Requests to send, and lengths of the received replies.
+  edcl_op *batch[edcl_batch];
+  unsigned int nbatch = 0;
+  unsigned int lens[edcl_batch];
   struct pollfd fds;
+  chrono::steady_clock::time_point deadline;
 
   fds.fd = sock;
   fds.events = POLLIN;
 
-  while (1)
+  for (unsigned int i = 0; i < n; i++)
+    {
+      ops[i].sent = false;
+      ops[i].done = false;
+    }
+
+  while (head < n)
+    {
+      //  Fill the window.  Requests are numbered consecutively, as the
+      //  EDCL only executes the request with the sequence number it
+      //  expects.  Until the sequence number is known to be right, only
+      //  one request is in flight so that no request can be executed
+      //  before the previous ones.
+      unsigned int limit = synced ? window : 1;
+      while (next < n && next - head < limit)
+	{
+	  edcl_op &op = ops[next];
+
+	  //  A request whose reply is lost is sent again, and then executed
+	  //  after the following ones.  So a request must not be in flight
+	  //  with a previous one that accesses the same bytes (unless both
+	  //  are reads).
+	  if (!op.done && conflicts (ops, head, next))
+	    break;
+
+	  if (!op.done)
+	    {
+	      op.seq = seq;
+	      seq = (seq + 1) & edcl_seq_mask;
+	      batch[nbatch++] = &op;
+	      if (nbatch == edcl_batch)
+		{
+		  if (!send_ops (batch, nbatch))
+		    return false;
+		  nbatch = 0;
+		}
+	      if (op.sent)
+		stats.retries++;
+	      op.sent = true;
+	    }
+	  if (next == head)
+	    deadline = chrono::steady_clock::now ()
+	      + chrono::milliseconds (edcl_rto);
+	  next++;
+	}
+      if (nbatch != 0 && !send_ops (batch, nbatch))
+	return false;
+      nbatch = 0;
+
+      int timeout = chrono::duration_cast<chrono::milliseconds>
+	(deadline - chrono::steady_clock::now ()).count ();
+      int r = poll (&fds, 1, timeout > 0 ? timeout : 0);
+      if (r < 0)
+	{
+	  perror ("poll");
+	  return false;
+	}
+      if (r == 0)
+	{
+	  //  Timeout: retransmit the oldest request with the same sequence
+	  //  number.  If the request was executed but its reply was lost,
+	  //  the EDCL will ask for a resync.
+	  //  OTOH, that won't work for IO with side effects.
+	  stats.timeouts++;
+	  if (++retries > edcl_retries)
+	    {
+	      cerr << "edcl: no reply for address " << hex8 (ops[head].addr)
+		   << endl;
+	      return false;
+	    }
+	  synced = false;
+	  seq = ops[head].seq;
+	  next = head;
+	  continue;
+	}
+
+      //  Reap all the replies already received (at most one per request
+      //  in flight).
+      unsigned int nrx = next - head;
+      if (nrx == 0)
+	nrx = 1;
+      else if (nrx > edcl_batch)
+	nrx = edcl_batch;
+      int nreplies = recv_replies (nrx, lens);
+      if (nreplies < 0)
+	return false;
+
+      for (int k = 0; k < nreplies && head < n; k++)
+	{
+	  const unsigned char *pkt = &rx_pkts[k * edcl_pkt_len];
+	  unsigned int len = lens[k];
+
+	  if (trace_com)
+	    trace_edcl ("<", pkt, len);
+	  if (trace_id >= 0)
+	    trace_packet (trace_id, true, pkt, len);
+	  if (len < 10)
+	    continue;
+
+	  word app = unpack_be32 (pkt + 2);
+	  unsigned int rseq = app >> 18;
+
+	  if (app & (1 << 17))
+	    {
+	      //  NAK: the EDCL expects RSEQ.  If the oldest request in
+	      //  flight already has that number, the NAK is for a request
+	      //  sent before it (and that will be sent again).
+	      if (head < next && ops[head].seq == rseq)
+		continue;
+	      //  A NAK for a number before the last acknowledged one was
+	      //  delayed.  Following it would renumber the requests with
+	      //  numbers whose replies may still come.
+	      unsigned int behind = (acked - rseq) & edcl_seq_mask;
+	      if (acked_valid && behind != 0
+		  && behind < (edcl_seq_mask + 1) / 2)
+		continue;
+	      stats.resyncs++;
+	      if (++retries > edcl_retries)
+		{
+		  cerr << "edcl: cannot resync sequence number" << endl;
+		  return false;
+		}
+	      synced = false;
+	      seq = rseq;
+	      next = head;
+	      continue;
+	    }
+
+	  //  Find the request with this sequence number (and address, as
+	  //  the number may have been given to another request after a
+	  //  resync while the reply was delayed).  Other replies are for
+	  //  requests sent before a resync.
+	  word raddr = unpack_be32 (pkt + 6);
+	  unsigned int i;
+	  for (i = head; i < next; i++)
+	    if (!ops[i].done && ops[i].seq == rseq && ops[i].addr == raddr)
+	      break;
+	  if (i == next)
+	    continue;
+
+	  edcl_op &op = ops[i];
+	  if (!op.rw)
+	    {
+	      if (((app >> 7) & 0x3ff) != op.len || len < 10 + op.len)
+		return false;
+	      memcpy (op.buf, pkt + 10, op.len);
+	    }
+	  op.done = true;
+	  if (!acked_valid
+	      || ((rseq + 1 - acked) & edcl_seq_mask) < (edcl_seq_mask + 1) / 2)
+	    acked = (rseq + 1) & edcl_seq_mask;
+	  acked_valid = true;
+
+	  //  Progress.
+	  if (i == head)
+	    {
+	      while (head < n && ops[head].done)
+		head++;
+	      //  After a resync, the requests completed before may take the
+	      //  head beyond the requests sent again.
+	      if (next < head)
+		next = head;
+	      synced = true;
+	      retries = 0;
+	      deadline = chrono::steady_clock::now ()
+		+ chrono::milliseconds (edcl_rto);
+	    }
+	}
+    }
+  return true;
+}
+
+bool
+eth_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  xfer_packer pk (xfers, n, get_constraints ());
+  vector<edcl_op> ops (pk.packets.size ());
+
+  for (unsigned int i = 0; i < ops.size (); i++)
+    {
+      dsu_xfer &p = pk.packets[i];
+
+      ops[i].addr = p.addr;
+      ops[i].len = p.nwords << 2;
+      ops[i].rw = p.is_write;
+      ops[i].buf = p.buf;
+    }
+  if (!run (ops.data (), ops.size ()))
+    return false;
+  pk.scatter ();
+  return true;
+}
+
+bool
+eth_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  dsu_xfer x = { addr, nwords, res, false };
+
+  return do_transact (&x, 1);
+}
+
+bool
+eth_dsu_link::do_write (word addr, unsigned int nwords,
+			const unsigned char *buf)
+{
+  dsu_xfer x = { addr, nwords, const_cast<unsigned char *>(buf), true };
+
+  return do_transact (&x, 1);
+}
+
+#ifdef __linux__
+
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+//  EDCL over raw Ethernet frames, bypassing the IP stack (and ARP): the
+//  Ethernet, IP and UDP headers are built here, and the frames are
+//  exchanged through the TX and RX rings of an AF_PACKET socket, so that a
+//  whole batch is sent with one system call and the replies are read
+//  without any.
+class eth_raw_dsu_link : public eth_dsu_link
+{
+ public:
+  eth_raw_dsu_link (const char *spec) : eth_dsu_link (nullptr), spec (spec)
+  {
+    sock = -1;
+  }
+  void close (void);
+  const char *get_name (void) { return "eth-raw"; }
+ protected:
+  bool open_socket (void);
+  bool send_ops (edcl_op *const *batch, unsigned int n);
+  int recv_replies (unsigned int n, unsigned int *lens);
+ private:
+  //  Geometry of each ring.
+  static const unsigned int ring_block = 64 << 10;
+  static const unsigned int ring_nblocks = 4;
+  static const unsigned int ring_frame = 2048;
+  static const unsigned int ring_nframes =
+    ring_nblocks * (ring_block / ring_frame);
+
+  //  Size of the Ethernet, IP and UDP headers, and minimum frame length.
+  static const unsigned int frame_hdr_len = 14 + 20 + 8;
+  static const unsigned int frame_min_len = 60;
+
+  //  Frame I of RING.
+  struct tpacket2_hdr *get_frame (unsigned char *ring, unsigned int i)
+  {
+    return (struct tpacket2_hdr *)(ring + i * ring_frame);
+  }
+
+  //  Build the Ethernet, IP and UDP headers of frame F, for an EDCL
+  //  packet of LEN bytes.
+  void write_frame_header (unsigned char *f, unsigned int len);
+
+  //  IFACE,MAC,IP of the board.
+  const char *spec;
+  unsigned char board_mac[6];
+  unsigned char mac[6];
+  word src_ip;
+  //  UDP port of the replies.  A UDP socket is bound to it, so that the
+  //  IP stack doesn't answer them with ICMP errors.
+  unsigned int port;
+  int port_sock = -1;
+  //  The RX ring, followed by the TX ring.
+  unsigned char *rings = nullptr;
+  unsigned int rx_cur = 0;
+  unsigned int tx_cur = 0;
+  unsigned int ip_id = 0;
+};
+
+static void
+pack_be16 (unsigned char *data, unsigned int val)
+{
+  data[0] = val >> 8;
+  data[1] = val >> 0;
+}
+
+bool
+eth_raw_dsu_link::open_socket (void)
+{
+  const char *c1 = strchr (spec, ',');
+  const char *c2 = c1 ? strchr (c1 + 1, ',') : nullptr;
+  unsigned int m[6];
+  char extra;
+  struct in_addr addr;
+
+  if (c2 == nullptr
+      || sscanf (string (c1 + 1, c2).c_str (), "%x:%x:%x:%x:%x:%x%c",
+		 &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &extra) != 6
+      || !::inet_aton (c2 + 1, &addr))
+    {
+      cerr << "eth-raw: bad argument '" << spec
+	   << "' (expected IFACE,MAC,IP)" << endl;
+      return false;
+    }
+  string iface (spec, c1);
+  for (int i = 0; i < 6; i++)
+    board_mac[i] = m[i];
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons (1025);
+  dest.sin_addr = addr;
+
+  unsigned int ifindex = if_nametoindex (iface.c_str ());
+  if (ifindex == 0)
+    {
+      cerr << iface << ": no such interface" << endl;
+      return false;
+    }
+
+  sock = ::socket (AF_PACKET, SOCK_RAW, htons (ETH_P_IP));
+  if (sock < 0)
+    {
+      perror ("cannot create packet socket");
+      return false;
+    }
+
+  //  Our addresses.  The board replies to whatever source IP is used, so
+  //  the interface doesn't need one.
+  struct ifreq ifr;
+  memset (&ifr, 0, sizeof (ifr));
+  strncpy (ifr.ifr_name, iface.c_str (), IFNAMSIZ - 1);
+  if (ioctl (sock, SIOCGIFHWADDR, &ifr) < 0)
+    {
+      perror ("cannot get the interface address");
+      close ();
+      return false;
+    }
+  memcpy (mac, ifr.ifr_hwaddr.sa_data, 6);
+  src_ip = 0;
+  if (ioctl (sock, SIOCGIFADDR, &ifr) == 0)
+    src_ip = ntohl (((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr);
+
+  //  Create and map the rings.
+  int version = TPACKET_V2;
+  struct tpacket_req req;
+  req.tp_block_size = ring_block;
+  req.tp_block_nr = ring_nblocks;
+  req.tp_frame_size = ring_frame;
+  req.tp_frame_nr = ring_nframes;
+  if (setsockopt (sock, SOL_PACKET, PACKET_VERSION,
+		  &version, sizeof (version)) < 0
+      || setsockopt (sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof (req)) < 0
+      || setsockopt (sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof (req)) < 0)
+    {
+      perror ("cannot create the packet rings");
+      close ();
+      return false;
+    }
+  void *map = mmap (nullptr, 2 * ring_block * ring_nblocks,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+  if (map == MAP_FAILED)
+    {
+      perror ("cannot map the packet rings");
+      close ();
+      return false;
+    }
+  rings = (unsigned char *)map;
+  rx_cur = 0;
+  tx_cur = 0;
+
+  struct sockaddr_ll sll;
+  memset (&sll, 0, sizeof (sll));
+  sll.sll_family = AF_PACKET;
+  sll.sll_protocol = htons (ETH_P_IP);
+  sll.sll_ifindex = ifindex;
+  if (::bind (sock, (struct sockaddr *)&sll, sizeof (sll)) < 0)
+    {
+      perror ("cannot bind packet socket");
+      close ();
+      return false;
+    }
+
+  //  Reserve a port for the replies.
+  struct sockaddr_in local;
+  socklen_t len = sizeof (local);
+  memset (&local, 0, sizeof (local));
+  local.sin_family = AF_INET;
+  port_sock = ::socket (PF_INET, SOCK_DGRAM, 0);
+  if (port_sock < 0
+      || ::bind (port_sock, (struct sockaddr *)&local, sizeof (local)) < 0
+      || ::getsockname (port_sock, (struct sockaddr *)&local, &len) < 0)
+    {
+      perror ("cannot reserve a UDP port");
+      close ();
+      return false;
+    }
+  port = ntohs (local.sin_port);
+  return true;
+}
+
+void
+eth_raw_dsu_link::close (void)
+{
+  if (rings != nullptr)
+    munmap (rings, 2 * ring_block * ring_nblocks);
+  rings = nullptr;
+  if (sock >= 0)
+    ::close (sock);
+  sock = -1;
+  if (port_sock >= 0)
+    ::close (port_sock);
+  port_sock = -1;
+}
+
+void
+eth_raw_dsu_link::write_frame_header (unsigned char *f, unsigned int len)
+{
+  //  Ethernet.
+  memcpy (f, board_mac, 6);
+  memcpy (f + 6, mac, 6);
+  pack_be16 (f + 12, ETH_P_IP);
+
+  //  IP: no options, don't fragment, no checksum for UDP.
+  unsigned char *ip = f + 14;
+  ip[0] = 0x45;
+  ip[1] = 0;
+  pack_be16 (ip + 2, 20 + 8 + len);
+  pack_be16 (ip + 4, ip_id++ & 0xffff);
+  pack_be16 (ip + 6, 0x4000);
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  pack_be16 (ip + 10, 0);
+  pack_be32 (ip + 12, src_ip);
+  memcpy (ip + 16, &dest.sin_addr, 4);
+
+  word sum = 0;
+  for (int i = 0; i < 20; i += 2)
+    sum += unpack_be16 (ip + i);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  pack_be16 (ip + 10, ~sum & 0xffff);
+
+  //  UDP.
+  unsigned char *udp = ip + 20;
+  pack_be16 (udp, port);
+  pack_be16 (udp + 2, 1025);
+  pack_be16 (udp + 4, 8 + len);
+  pack_be16 (udp + 6, 0);
+}
+
+bool
+eth_raw_dsu_link::send_ops (edcl_op *const *batch, unsigned int n)
+{
+  unsigned char *tx_ring = rings + ring_block * ring_nblocks;
+
+  for (unsigned int i = 0; i < n; i++)
     {
-      write_header (tx_data, len, addr, 0);
+      const edcl_op &op = *batch[i];
+      struct tpacket2_hdr *h = get_frame (tx_ring, tx_cur);
 
-      while (1)
+      //  The frames are released by the blocking send below.
+      if (h->tp_status != TP_STATUS_AVAILABLE)
 	{
-	  if (trace_com)
-	    trace_edcl ("R>", tx_data, sizeof (tx_data));
-	  r = ::sendto (sock, tx_data, sizeof (tx_data), 0,
-			(struct sockaddr *)&dest, sizeof (dest));
-	  if (r < 0)
-	    {
-	      perror ("send");
-	      return false;
-	    }
+	  cerr << "eth-raw: TX ring full" << endl;
+	  return false;
+	}
 
-	  //  TODO: there is no timeout/retry.
-	  //  OTOH, that won't work for IO with side effects.
-	  r = poll (&fds, 1, 50);
-	  if (r == 1)
-	    break;
+      //  The packet is built directly in the ring.
+      unsigned char *f =
+	(unsigned char *)h + TPACKET_ALIGN (sizeof (struct tpacket2_hdr));
+      unsigned char *pkt = f + frame_hdr_len;
+      unsigned int len = 10;
+
+      write_header (pkt, op.len, op.addr, op.rw, op.seq);
+      if (op.rw)
+	{
+	  memcpy (pkt + 10, op.buf, op.len);
+	  len += op.len;
 	}
-      r = recv (sock, rx_data, sizeof (rx_data), 0);
-      if (r < 0)
-	return false;
       if (trace_com)
-	trace_edcl ("R<", rx_data, r);
-      if (r < 6)
-	return false;
-      app = unpack_be32 (rx_data + 2);
-      if (app & (1 << 17))
-	seq = app >> 18;
-      else
-	break;
+	trace_edcl (op.rw ? "W>" : "R>", pkt, len);
+      if (trace_id >= 0)
+	trace_packet (trace_id, false, pkt, len);
+      write_frame_header (f, len);
+
+      unsigned int flen = frame_hdr_len + len;
+      if (flen < frame_min_len)
+	{
+	  memset (f + flen, 0, frame_min_len - flen);
+	  flen = frame_min_len;
+	}
+      h->tp_len = flen;
+      h->tp_status = TP_STATUS_SEND_REQUEST;
+      tx_cur = (tx_cur + 1) % ring_nframes;
+    }
+
+  //  Send all the frames, and wait until they are out of the ring.
+  if (::send (sock, nullptr, 0, 0) < 0)
+    {
+      perror ("send");
+      return false;
     }
-  seq++;
-  if (((app >> 7) & 0x3ff) != len)
-    return false;
-  memcpy (res, rx_data + 10, len);
   return true;
 }
 
-bool
-eth_dsu_link::write (word addr, unsigned int nwords, const unsigned char *buf)
+int
+eth_raw_dsu_link::recv_replies (unsigned int n, unsigned int *lens)
 {
-  int r;
-  unsigned char pkt[1536];
-  unsigned int len = nwords << 2;
-  unsigned int app;
+  unsigned int nreplies = 0;
 
-  //  Set offset
-  while (1)
+  while (nreplies < n)
     {
-      write_header (pkt, len, addr, 1);
-      memcpy (pkt + 10, buf, len);
+      struct tpacket2_hdr *h = get_frame (rings, rx_cur);
 
-      if (trace_com)
-	trace_edcl ("W>", pkt, len + 10);
-      r = ::sendto (sock, pkt, len + 10, 0,
-		    (struct sockaddr *)&dest, sizeof (dest));
-      if (r < 0)
-	return false;
-
-      //  TODO: there is no timeout/retry.
-      //  OTOH, that won't work for IO with side effects.
-      r = recv (sock, pkt, sizeof (pkt), 0);
-      if (r < 0)
-	return false;
+      if (!(h->tp_status & TP_STATUS_USER))
+	break;
 
-      if (trace_com)
-	trace_edcl ("W<", pkt, r);
+      //  Keep the UDP datagrams from the board to our port.  The others
+      //  (including our requests, which are also seen here) are dropped.
+      const unsigned char *f = (const unsigned char *)h + h->tp_mac;
+      unsigned int flen = h->tp_snaplen;
+      if (flen >= frame_hdr_len
+	  && unpack_be16 (f + 12) == ETH_P_IP
+	  && f[14] == 0x45
+	  && f[23] == IPPROTO_UDP
+	  && memcmp (f + 26, &dest.sin_addr, 4) == 0
+	  && unpack_be16 (f + 36) == port)
+	{
+	  unsigned int len = unpack_be16 (f + 38) - 8;
+
+	  if (len > flen - frame_hdr_len)
+	    len = flen - frame_hdr_len;
+	  if (len > edcl_pkt_len)
+	    len = edcl_pkt_len;
+	  memcpy (&rx_pkts[nreplies * edcl_pkt_len], f + frame_hdr_len, len);
+	  lens[nreplies++] = len;
+	}
 
-      if (r < 6)
-	return false;
-      app = unpack_be32 (pkt + 2);
-      if (app & (1 << 17))
-	seq = app >> 18;
-      else
-	break;
+      h->tp_status = TP_STATUS_KERNEL;
+      rx_cur = (rx_cur + 1) % ring_nframes;
     }
-  seq++;
-  return true;
+  return nreplies;
+}
+
+dsu_link *
+create_eth_raw_dsu_link (const char *spec)
+{
+  return new eth_raw_dsu_link (spec);
 }
 
+#endif /* __linux__ */
+
 bool
 remote_dsu_link::open (void)
 {
@@ -399,7 +1949,9 @@ remote_dsu_link::open (void)
     }
   //  Connect.
   memset (&dest, 0, sizeof dest);
+#ifdef SIN6_LEN
   dest.sin_len = sizeof (dest);
+#endif
   dest.sin_family = AF_INET;
   dest.sin_port = htons (port);
   dest.sin_addr = addr;
@@ -410,6 +1962,42 @@ remote_dsu_link::open (void)
       ::close (sock);
       return false;
     }
+  if (trace_id < 0)
+    trace_id = trace_register (TRACE_RSP, get_name ());
+
+  //  Negotiate the packet size and the no-ack mode.
+  if (!command ("qSupported"))
+    {
+      cerr << "remote link: no reply to qSupported" << endl;
+      return false;
+    }
+  bool can_no_ack = false;
+  string features (reply.begin (), reply.end ());
+  size_t pos = 0;
+  while (pos < features.size ())
+    {
+      size_t end = features.find (';', pos);
+      if (end == string::npos)
+	end = features.size ();
+      string f = features.substr (pos, end - pos);
+      if (f.compare (0, 11, "PacketSize=") == 0)
+	{
+	  packet_size = strtoul (f.c_str () + 11, nullptr, 16);
+	  //  Read replies are hex-encoded, and so are M writes.
+	  if (packet_size > 64)
+	    max_len = ((packet_size - 32) / 2) & ~3U;
+	}
+      else if (f == "QStartNoAckMode+")
+	can_no_ack = true;
+      pos = end + 1;
+    }
+  if (can_no_ack && command ("QStartNoAckMode")
+      && reply.size () == 2 && reply[0] == 'O' && reply[1] == 'K')
+    no_ack = true;
+
+  cout << "remote: packet size: " << packet_size
+       << ", no-ack: " << (no_ack ? "yes" : "no")
+       << ", max_len: " << max_len << endl;
   return true;
 }
 
@@ -449,147 +2037,241 @@ read_hex2 (unsigned char *p)
   return res;
 }
 
+//  Get the next character from the stub, or -1 in case of error.
 int
-remote_dsu_link::send_recv (unsigned char *pkt, int len)
+remote_dsu_link::get_char (void)
+{
+  if (rpos == rlen)
+    {
+      int res = recv (sock, rbuf, sizeof (rbuf), 0);
+      if (res < 1)
+	return -1;
+      if (trace_com)
+	trace_ascii ("<", rbuf, res);
+      if (trace_id >= 0)
+	trace_packet (trace_id, true, rbuf, res);
+      rpos = 0;
+      rlen = res;
+    }
+  return rbuf[rpos++];
+}
+
+//  Send packet DATA (without the framing), and wait for its ack unless in
+//  no-ack mode.
+bool
+remote_dsu_link::send_packet (const unsigned char *data, unsigned int len)
 {
-  unsigned char csum;
-  int res;
-  int off;
+  unsigned char csum = 0;
 
-  pkt[len] = '#';
+  tx.resize (len + 4);
+  tx[0] = '$';
+  for (unsigned int i = 0; i < len; i++)
+    {
+      tx[i + 1] = data[i];
+      csum += data[i];
+    }
+  tx[len + 1] = '#';
+  put_hex (&tx[len + 2], csum, 1);
 
-  csum = 0;
-  for (int i = 1; i < len; i++)
-    csum += pkt[i];
-  put_hex (pkt + len + 1, csum, 1);
-  len += 3;
-  if (trace_com)
-    trace_ascii (">", pkt, len);
-  if (send (sock, pkt, len, 0) != len)
-    return 0;
+  while (1)
+    {
+      if (trace_com)
+	trace_ascii (">", tx.data (), tx.size ());
+      if (trace_id >= 0)
+	trace_packet (trace_id, false, tx.data (), tx.size ());
+      for (size_t off = 0; off < tx.size (); )
+	{
+	  int res = send (sock, tx.data () + off, tx.size () - off, 0);
+	  if (res < 1)
+	    return false;
+	  off += res;
+	}
 
-  //  Wait for ack.
-  res = recv (sock, pkt, 1, 0);
-  if (trace_com)
-    trace_ascii ("<", pkt, res);
-  if (res != 1 || pkt[0] != '+')
-    return 0;
+      if (no_ack)
+	return true;
 
-  //  Wait for answer (2 characters after '$').
-  enum { S_dollar, S_body, S_c0, S_c1 } state = S_dollar;
+      //  Wait for ack, retransmit on nack.
+      int c = get_char ();
+      if (c == '+')
+	return true;
+      if (c != '-')
+	return false;
+      stats.retries++;
+    }
+}
 
-  off = 0;
-  csum = 0;
-  unsigned char ecsum;
+//  Receive a packet, and put its decoded body in REPLY.
+bool
+remote_dsu_link::recv_packet (void)
+{
   while (1)
     {
-      unsigned char buf[1024];
-      int res;
+      unsigned char csum = 0;
+      int c;
 
-      res = recv (sock, buf, sizeof (buf), 0);
-      if (trace_com)
-	trace_ascii ("<", buf, res);
-      if (res < 1)
-	return 0;
-      for (int i = 0; i < res; i++)
+      //  Skip until the start of the packet.
+      do
 	{
-	  unsigned char c = buf[i];
-	  switch (state)
+	  c = get_char ();
+	  if (c < 0)
+	    return false;
+	}
+      while (c != '$');
+
+      reply.clear ();
+      while (1)
+	{
+	  c = get_char ();
+	  if (c < 0)
+	    return false;
+	  if (c == '#')
+	    break;
+	  csum += c;
+	  if (c == '}')
 	    {
-	    case S_dollar:
-	      if (c != '$')
-		return 0;
-	      state = S_body;
-	      break;
-	    case S_body:
-	      if (c == '#')
-		state = S_c0;
-	      else
+	      //  Escaped character.
+	      c = get_char ();
+	      if (c < 0)
+		return false;
+	      csum += c;
+	      reply.push_back (c ^ 0x20);
+	    }
+	  else if (c == '*')
+	    {
+	      //  Run-length encoding: repeat the previous character.
+	      c = get_char ();
+	      if (c < 0 || reply.empty ())
+		return false;
+	      //  At least 3 repeats.
+	      if (c < 32)
 		{
-		  csum += c;
-		  pkt[off++] = c;
+		  cerr << "remote link: bad run-length count" << endl;
+		  return false;
 		}
-	      break;
-	    case S_c0:
-	    case S_c1:
-	      {
-		unsigned char d = read_hex1 (c);
-		if (d > 15)
-		  return 0;
-		if (state == S_c0)
-		  {
-		    ecsum = d << 4;
-		    state = S_c1;
-		  }
-		else
-		  {
-		    ecsum |= d;
-
-		    unsigned char ack = (ecsum == csum) ? '+' : '-';
-		    if (trace_com)
-		      trace_ascii (">", &ack, 1);
-		    if (send (sock, &ack, 1, 0) != 1)
-		      return 0;
-		    if (ecsum != csum)
-		      {
-			off = 0;
-			csum = 0;
-			state = S_dollar;
-		      }
-		    else
-		      return off;
-		  }
-		break;
-	      }
+	      csum += c;
+	      unsigned char prev = reply.back ();
+	      reply.insert (reply.end (), c - 29, prev);
 	    }
+	  else
+	    reply.push_back (c);
+	}
+
+      unsigned int ecsum = 0;
+      for (int i = 0; i < 2; i++)
+	{
+	  c = get_char ();
+	  if (c < 0 || read_hex1 (c) > 15)
+	    return false;
+	  ecsum = (ecsum << 4) | read_hex1 (c);
+	}
+
+      //  Without acks, a corrupted reply cannot be sent again.
+      if (no_ack)
+	{
+	  if (ecsum != csum)
+	    cerr << "remote link: bad checksum" << endl;
+	  return ecsum == csum;
 	}
+
+      unsigned char ack = (ecsum == csum) ? '+' : '-';
+      if (trace_com)
+	trace_ascii (">", &ack, 1);
+      if (trace_id >= 0)
+	trace_packet (trace_id, false, &ack, 1);
+      if (send (sock, &ack, 1, 0) != 1)
+	return false;
+      if (ecsum == csum)
+	return true;
     }
 }
 
+//  Send a command and receive its reply.
 bool
-remote_dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
+remote_dsu_link::command (const unsigned char *data, unsigned int len)
 {
-  unsigned char pkt[1024];
-  unsigned char *p = pkt;
-  int len;
+  return send_packet (data, len) && recv_packet ();
+}
 
-  if (8 * nwords > sizeof (pkt) - 20)
-    return false;
+bool
+remote_dsu_link::command (const char *str)
+{
+  return command ((const unsigned char *)str, strlen (str));
+}
+
+bool
+remote_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  unsigned char pkt[32];
+  unsigned char *p = pkt;
 
-  *p++ = '$';
   *p++ = 'm';
   p = put_hex (p, addr, 4);
   *p++ = ',';
   p = put_hex (p, 4 * nwords, 2);
-  len = send_recv (pkt, p - pkt);
-  if (pkt[0] == 'E' || len != 8 * nwords)
+  if (!command (pkt, p - pkt))
+    return false;
+  if (reply.size () != 8 * nwords)
     return false;
   for (int i = 0; i < 4 * nwords; i++)
-    res[i] = read_hex2 (pkt + 2 * i);
+    {
+      unsigned int b = read_hex2 (&reply[2 * i]);
+      if (b > 255)
+	return false;
+      res[i] = b;
+    }
   return true;
 }
 
 bool
-remote_dsu_link::write (word addr, unsigned int nwords,
-			const unsigned char *buf)
+remote_dsu_link::do_write (word addr, unsigned int nwords,
+			   const unsigned char *buf)
 {
-  unsigned char pkt[1024];
-  unsigned char *p = pkt;
-  int len;
+  unsigned int len = 4 * nwords;
 
-  if (8 * nwords > sizeof (pkt) - 16)
-    return false;
+  tx_body.clear ();
+  tx_body.push_back (use_x ? 'X' : 'M');
+  {
+    unsigned char hdr[32];
+    unsigned char *p = hdr;
+    p = put_hex (p, addr, 4);
+    *p++ = ',';
+    p = put_hex (p, len, 2);
+    *p++ = ':';
+    tx_body.insert (tx_body.end (), hdr, p);
+  }
 
-  *p++ = '$';
-  *p++ = 'M';
-  p = put_hex (p, addr, 4);
-  *p++ = ',';
-  p = put_hex (p, 4 * nwords, 2);
-  *p++ = ':';
-  for (int i = 0; i < nwords * 4; i++)
-    p = put_hex (p, buf[i], 2);
-  len = send_recv (pkt, p - pkt);
-  if (len != 2 || pkt[0] != 'O' || pkt[1] != 'K')
+  if (use_x)
+    {
+      //  Binary data, with '#', '$', '}' and '*' escaped.
+      for (unsigned int i = 0; i < len; i++)
+	{
+	  unsigned char c = buf[i];
+	  if (c == '#' || c == '$' || c == '}' || c == '*')
+	    {
+	      tx_body.push_back ('}');
+	      c ^= 0x20;
+	    }
+	  tx_body.push_back (c);
+	}
+    }
+  else
+    {
+      for (unsigned int i = 0; i < len; i++)
+	{
+	  tx_body.push_back (xdigits[buf[i] >> 4]);
+	  tx_body.push_back (xdigits[buf[i] & 0x0f]);
+	}
+    }
+
+  if (!command (tx_body.data (), tx_body.size ()))
+    return false;
+  if (use_x && reply.empty ())
+    {
+      //  X packet not supported, use M packets.
+      use_x = false;
+      return do_write (addr, nwords, buf);
+    }
+  if (reply.size () != 2 || reply[0] != 'O' || reply[1] != 'K')
     return false;
   return true;
 }
@@ -607,6 +2289,10 @@ extern "C" {
 #include <urjtag/tap_register.h>
 };
 
+//  Bits of a byte, LSB first, in the one char per bit format of urjtag
+//  registers.
+static char jtag_bits[256][8];
+
 bool
 jtag_dsu_link::open (void)
 {
@@ -673,124 +2359,364 @@ jtag_dsu_link::open (void)
       cerr << "cannot create instruction: " << urj_error_describe () << endl;
       return false;
     }
+
+  for (int i = 0; i < 256; i++)
+    for (int j = 0; j < 8; j++)
+      jtag_bits[i][j] = (i >> j) & 1;
+  if (trace_id < 0)
+    trace_id = trace_register (TRACE_DSU, get_name ());
   return true;
 }
 
-bool
-jtag_dsu_link::set_cmd (word addr, int w)
+static void
+jtag_put_word (char *d, word w)
 {
-  /* Write CMD register.  */
-  part->active_instruction = user1;
-  {
-    char *d = user1->data_register->in->data;
-
-    //  AHB address.
-    for (int i = 0; i < 32; i++)
-      d[i] = (addr >> i) & 1;
-    //  Size = 10 (word)
-    d[32] = 0;
-    d[33] = 1;
-    // W = 0
-    d[34] = w;
-  }
+  for (int i = 0; i < 4; i++)
+    memcpy (d + 8 * i, jtag_bits[(w >> (8 * i)) & 0xff], 8);
+}
 
-  if (urj_tap_chain_shift_instructions (chain) != URJ_STATUS_OK)
-    {
-      cerr << "JTAG: cannot shift IR: " << urj_error_describe () << endl;
-      return false;
-    }
-  if (urj_tap_chain_shift_data_registers (chain, 1) != URJ_STATUS_OK)
-    {
-      cerr << "JTAG: cannot shift DR: " << urj_error_describe () << endl;
-      return false;
-    }
+static word
+jtag_get_word (const char *d)
+{
+  word w = 0;
 
-  /* Select DATA register.  */
-  part->active_instruction = user2;
-  if (urj_tap_chain_shift_instructions (chain) != URJ_STATUS_OK)
-    {
-      cerr << "JTAG: cannot shift IR: " << urj_error_describe () << endl;
-      return false;
-    }
+  for (int i = 31; i >= 0; i--)
+    w = (w << 1) | (d[i] & 1);
+  return w;
+}
 
+//  Queue a shift of instruction INSN in our part (and of the current
+//  instruction of the other parts).
+bool
+jtag_dsu_link::defer_ir (urj_part_instruction_t *insn)
+{
+  urj_parts_t *ps = chain->parts;
+
+  part->active_instruction = insn;
+  urj_tap_capture_ir (chain);
+  for (int i = 0; i < ps->len; i++)
+    if (urj_tap_defer_shift_register
+	(chain, ps->parts[i]->active_instruction->value, NULL,
+	 i + 1 == ps->len ? URJ_CHAIN_EXIT_IDLE : URJ_CHAIN_EXIT_SHIFT)
+	!= URJ_STATUS_OK)
+      {
+	cerr << "JTAG: cannot shift IR: " << urj_error_describe () << endl;
+	return false;
+      }
   return true;
 }
 
+//  Queue a shift of IN in the data register of our part.  If OUT is not
+//  null, the output must then be retrieved (in order) with
+//  urj_tap_shift_register_output.
 bool
-jtag_dsu_link::read (word addr, unsigned int nwords, unsigned char *res)
+jtag_dsu_link::defer_dr (urj_tap_register_t *in, urj_tap_register_t *out)
 {
-  if (trace_com)
-    cerr << "jtag read @" << hex8 (addr) << " " << hex2 (nwords) << endl;
-  if (!set_cmd (addr, 0))
-    return false;
+  urj_parts_t *ps = chain->parts;
 
-  if (trace_com)
-    cerr << "R<: " << urj_tap_register_get_string (user1->data_register->out)
-	 << endl;
-
-  for (unsigned int i = 0; i < nwords; i++)
+  urj_tap_capture_dr (chain);
+  for (int i = 0; i < ps->len; i++)
     {
-      {
-	char *d = user2->data_register->in->data;
-	//  SEQ = 1.
-	d[32] = 1;
-      }
+      urj_part_t *p = ps->parts[i];
+      int tap_exit =
+	i + 1 == ps->len ? URJ_CHAIN_EXIT_IDLE : URJ_CHAIN_EXIT_SHIFT;
+      int r;
 
-      if (urj_tap_chain_shift_data_registers (chain, 1) != URJ_STATUS_OK)
+      if (p == part)
+	r = urj_tap_defer_shift_register (chain, in, out, tap_exit);
+      else
+	r = urj_tap_defer_shift_register
+	  (chain, p->active_instruction->data_register->in, NULL, tap_exit);
+      if (r != URJ_STATUS_OK)
 	{
 	  cerr << "JTAG: cannot shift DR: " << urj_error_describe () << endl;
 	  return false;
 	}
-
-      if (trace_com)
-	cerr << "R<: "
-	     << urj_tap_register_get_string (user2->data_register->out);
-
-      char *d = user2->data_register->out->data;
-      word w = 0;
-      for (int j = 0; j < 32; j++)
-	w |= (d[j] & 1) << j;
-      if (trace_com)
-	cerr << ": " << hex8 (w) << endl;
-      pack_be32 (res, w);
-      res += 4;
     }
   return true;
 }
 
 bool
-jtag_dsu_link::write (word addr, unsigned int nwords,
-		      const unsigned char *buf)
+jtag_dsu_link::defer_cmd (word addr, int w)
 {
-  if (trace_com)
-    cerr << "jtag write @" << hex8 (addr) << " " << hex2 (nwords) << endl;
-  if (!set_cmd (addr, 1))
-    return false;
+  char *d = user1->data_register->in->data;
+
+  //  AHB address.
+  jtag_put_word (d, addr);
+  //  Size = 10 (word)
+  d[32] = 0;
+  d[33] = 1;
+  // W = 0
+  d[34] = w;
+
+  /* Write CMD register, then select DATA register.  */
+  return defer_ir (user1)
+    && defer_dr (user1->data_register->in, NULL)
+    && defer_ir (user2);
+}
 
-  for (unsigned int i = 0; i < nwords; i++)
+bool
+jtag_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  xfer_packer packer (xfers, n, get_constraints ());
+  urj_tap_register_t *din = user2->data_register->in;
+  urj_tap_register_t *dout = user2->data_register->out;
+
+  if (chain->parts == nullptr)
     {
-      char *d = user2->data_register->in->data;
-      {
-	word w = unpack_be32 (buf);
-	buf += 4;
-
-	if (trace_com)
-	  cerr << "J>: " << hex8 (w);
-	for (int j = 0; j < 32; j++)
-	  d[j] = (w >> j) & 1;
-	//  SEQ = 1.
-	d[32] = 1;
-      }
+      cerr << "JTAG: no chain" << endl;
+      return false;
+    }
+
+  //  Queue all the shifts, so that the cable is flushed only once.
+  for (auto &p : packer.packets)
+    {
+      const unsigned char *buf = p.buf;
+
+      //  The packets don't cross a 1kB boundary (see get_constraints).
       if (trace_com)
-	cerr << " " << urj_tap_register_get_string (user2->data_register->in)
-	     << endl;
-      if (urj_tap_chain_shift_data_registers (chain, 1) != URJ_STATUS_OK)
+	cerr << "jtag " << (p.is_write ? "write" : "read")
+	     << " @" << hex8 (p.addr) << " " << hex2 (p.nwords) << endl;
+      if (trace_id >= 0)
+	trace_dsu_cmd (trace_id, p.addr, p.nwords, p.is_write, p.buf);
+      if (!defer_cmd (p.addr, p.is_write))
 	{
-	  cerr << "JTAG: cannot shift DR: " << urj_error_describe () << endl;
+	  urj_tap_chain_flush (chain);
 	  return false;
 	}
+
+      //  SEQ = 1.
+      din->data[32] = 1;
+      for (unsigned int i = 0; i < p.nwords; i++)
+	{
+	  if (p.is_write)
+	    {
+	      word w = unpack_be32 (buf);
+	      buf += 4;
+	      if (trace_com)
+		cerr << "J>: " << hex8 (w) << endl;
+	      jtag_put_word (din->data, w);
+	      if (!defer_dr (din, NULL))
+		{
+		  urj_tap_chain_flush (chain);
+		  return false;
+		}
+	    }
+	  else
+	    {
+	      jtag_put_word (din->data, 0);
+	      if (!defer_dr (din, dout))
+		{
+		  urj_tap_chain_flush (chain);
+		  return false;
+		}
+	    }
+	}
     }
+
+  //  Retrieve the read data, in the same order.
+  int tap_exit = part == chain->parts->parts[chain->parts->len - 1]
+    ? URJ_CHAIN_EXIT_IDLE : URJ_CHAIN_EXIT_SHIFT;
+  for (auto &p : packer.packets)
+    if (!p.is_write)
+      {
+	for (unsigned int i = 0; i < p.nwords; i++)
+	  {
+	    if (urj_tap_shift_register_output (chain, din, dout, tap_exit)
+		!= URJ_STATUS_OK)
+	      {
+		cerr << "JTAG: cannot shift DR: " << urj_error_describe ()
+		     << endl;
+		urj_tap_chain_flush (chain);
+		return false;
+	      }
+	    word w = jtag_get_word (dout->data);
+	    if (trace_com)
+	      cerr << "R<: " << hex8 (w) << endl;
+	    pack_be32 (p.buf + 4 * i, w);
+	  }
+	if (trace_id >= 0)
+	  trace_packet (trace_id, true, p.buf, p.nwords * 4);
+      }
+  //  Execute the shifts queued after the last read (there is no status).
+  urj_tap_chain_flush (chain);
+
+  packer.scatter ();
   return true;
 }
 
+bool
+jtag_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  dsu_xfer x = { addr, nwords, res, false };
+  return do_transact (&x, 1);
+}
+
+bool
+jtag_dsu_link::do_write (word addr, unsigned int nwords,
+			 const unsigned char *buf)
+{
+  dsu_xfer x = { addr, nwords, (unsigned char *)buf, true };
+  return do_transact (&x, 1);
+}
+
 #endif /* HAVE_LIBURJTAG */
+
+int
+parse_link_option (int argc, char **argv, int &i, link_options &opts)
+{
+  const char *opt = argv[i];
+
+  if (strcmp (opt, "--usb") == 0)
+    opts.links.push_back (make_pair (LINK_USB, nullptr));
+  else if (strcmp (opt, "--usb-async") == 0)
+    opts.links.push_back (make_pair (LINK_USB_ASYNC, nullptr));
+  else if (strcmp (opt, "--sim") == 0)
+    opts.links.push_back (make_pair (LINK_SIM, nullptr));
+  else if (strcmp (opt, "--no-cache") == 0)
+    opts.cache = false;
+  else if (strcmp (opt, "--trace-com") == 0)
+    trace_com = true;
+  else if (strcmp (opt, "--replay-timing") == 0)
+    opts.replay_timing = true;
+  else if (strcmp (opt, "--eth-no-mmsg") == 0)
+    edcl_mmsg = false;
+  else if (strcmp (opt, "--eth") == 0
+	   || strcmp (opt, "--eth-raw") == 0
+	   || strcmp (opt, "--jtag") == 0
+	   || strcmp (opt, "--remote") == 0
+	   || strcmp (opt, "--record") == 0
+	   || strcmp (opt, "--trace") == 0
+	   || strcmp (opt, "--trace-slots") == 0
+	   || strcmp (opt, "--replay") == 0
+	   || strcmp (opt, "--eth-window") == 0
+	   || strcmp (opt, "--eth-rto") == 0
+	   || strcmp (opt, "--eth-retries") == 0
+	   || strcmp (opt, "--sim-latency") == 0
+	   || strcmp (opt, "--sim-mtu") == 0)
+    {
+      i++;
+      if (i >= argc)
+	{
+	  cerr << "missing argument after " << opt << endl;
+	  return -1;
+	}
+      const char *arg = argv[i];
+      unsigned int val = atoi (arg);
+
+      if (strcmp (opt, "--eth") == 0)
+	opts.links.push_back (make_pair (LINK_ETH, arg));
+      else if (strcmp (opt, "--eth-raw") == 0)
+	{
+	  opts.links.push_back (make_pair (LINK_ETH_RAW, arg));
+#ifndef __linux__
+	  cerr << "--eth-raw not available (Linux only)" << endl;
+	  return -1;
+#endif
+	}
+      else if (strcmp (opt, "--jtag") == 0)
+	{
+	  opts.links.push_back (make_pair (LINK_JTAG, arg));
+#ifndef HAVE_LIBURJTAG
+	  cerr << "-jtag not available (not compiled with urjtag)" << endl;
+	  return -1;
+#endif
+	}
+      else if (strcmp (opt, "--remote") == 0)
+	opts.links.push_back (make_pair (LINK_REMOTE, arg));
+      else if (strcmp (opt, "--record") == 0)
+	opts.record = arg;
+      else if (strcmp (opt, "--trace") == 0)
+	opts.trace = arg;
+      else if (strcmp (opt, "--trace-slots") == 0)
+	trace_slots = val;
+      else if (strcmp (opt, "--replay") == 0)
+	opts.links.push_back (make_pair (LINK_REPLAY, arg));
+      else if (strcmp (opt, "--eth-window") == 0)
+	edcl_window = val;
+      else if (strcmp (opt, "--eth-rto") == 0)
+	edcl_rto = val;
+      else if (strcmp (opt, "--eth-retries") == 0)
+	edcl_retries = val;
+      else if (strcmp (opt, "--sim-latency") == 0)
+	sim_latency = val;
+      else
+	sim_mtu = val;
+    }
+  else
+    return 0;
+  return 1;
+}
+
+dsu_link *
+create_link (const link_options &opts)
+{
+  vector<dsu_link *> links;
+  dsu_link *link;
+
+  //  Each of them is a different board.
+  if (opts.links.size () > 1)
+    for (auto &l : opts.links)
+      if (l.first == LINK_SIM || l.first == LINK_REPLAY)
+	{
+	  cerr << "--sim and --replay cannot be used with other interfaces"
+	       << endl;
+	  return nullptr;
+	}
+
+  //  Before the links are opened, as they register then.
+  if (opts.trace != nullptr)
+    trace_init (opts.trace);
+
+  for (auto &l : opts.links)
+    {
+      switch (l.first)
+	{
+	case LINK_USB:
+	  link = new usb_dsu_link;
+	  break;
+	case LINK_USB_ASYNC:
+	  link = create_usb_async_dsu_link ();
+	  break;
+	case LINK_ETH:
+	  link = create_eth_dsu_link (l.second);
+	  break;
+#ifdef __linux__
+	case LINK_ETH_RAW:
+	  link = create_eth_raw_dsu_link (l.second);
+	  break;
+#endif
+#ifdef HAVE_LIBURJTAG
+	case LINK_JTAG:
+	  link = new jtag_dsu_link (l.second);
+	  break;
+#endif
+	case LINK_REMOTE:
+	  link = new remote_dsu_link (l.second);
+	  break;
+	case LINK_SIM:
+	  link = create_sim_dsu_link ();
+	  break;
+	case LINK_REPLAY:
+	  link = create_replay_dsu_link (l.second, opts.replay_timing);
+	  break;
+	default:
+	  abort ();
+	}
+      links.push_back (link);
+    }
+
+  if (links.empty ())
+    link = new usb_dsu_link;
+  else if (links.size () == 1)
+    link = links[0];
+  else
+    link = create_stripe_dsu_link (links);
+
+  //  Record below the cache, so that a replay can be used to measure it.
+  if (opts.record != nullptr)
+    link = create_record_dsu_link (link, opts.record);
+  if (opts.cache)
+    link = create_cache_dsu_link (link);
+  return link;
+}
@@ -1,6 +1,11 @@
 #ifndef LINKS_H_
 #define LINKS_H_
 
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 #include "lemon.h"
 
 extern bool trace_com;
@@ -13,6 +18,85 @@ class link_error
   word addr;
 };
 
+//  One element of a transaction list: a read (or a write if IS_WRITE) of
+//  NWORDS words at ADDR.  BUF receives (or provides) the data, in target
+//  byte order.
+struct dsu_xfer
+{
+  word addr;
+  unsigned int nwords;
+  unsigned char *buf;
+  bool is_write;
+};
+
+//  Operations of a link, for the statistics.
+enum link_op
+{
+  OP_READ,
+  OP_WRITE,
+  OP_TRANSACT,
+  NBR_LINK_OPS
+};
+
+//  Log-linear histogram of latencies (in us): 8 buckets per power of 2.
+class latency_histogram
+{
+ public:
+  void add (uint64_t us);
+
+  //  Upper bound of the latencies of fraction P (from 0 to 1) of the
+  //  operations.
+  uint64_t percentile (double p) const;
+
+  uint64_t count = 0;
+  uint64_t total = 0;
+  uint64_t max = 0;
+ private:
+  static const unsigned int nbuckets = 62 * 8;
+  uint64_t buckets[nbuckets] = { };
+};
+
+struct link_stats
+{
+  struct op_stats
+  {
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    latency_histogram latency;
+  };
+
+  //  Record an operation started at START.
+  void record (link_op op, unsigned int len, bool ok,
+	       std::chrono::steady_clock::time_point start);
+
+  op_stats ops[NBR_LINK_OPS];
+
+  //  Retransmitted packets, sequence number resyncs and timeouts.  Updated
+  //  by the links that have them.
+  uint64_t retries = 0;
+  uint64_t resyncs = 0;
+  uint64_t timeouts = 0;
+};
+
+//  Queue of the asynchronous transfers of a link (see dsu_link::start).
+struct async_queue;
+
+//  Constraints of a link on its packets.
+struct link_constraints
+{
+  //  Maximum number of data bytes per packet.
+  unsigned int max_len;
+  //  A packet must not cross a multiple of BOUNDARY bytes (0 if none).
+  word boundary;
+  //  Packets transfer units of ALIGN bytes, at multiples of ALIGN: smaller
+  //  writes need a read-modify-write.
+  unsigned int align;
+};
+
+//  Length of the first packet of a transfer of LEN bytes at ADDR, following
+//  constraints C.
+word plan_packet (const link_constraints &c, word addr, word len);
+
 class dsu_link
 {
 public:
@@ -24,12 +108,11 @@ public:
 
   //  Read NWORDS words at ADDR and put them to RES.
   //  Return True for success.
-  virtual bool read (word addr, unsigned int nwords, unsigned char *res) = 0;
+  bool read (word addr, unsigned int nwords, unsigned char *res);
 
   //  Write NWORDS words at ADDR from BUF.
   //  Return True for success.
-  virtual bool write (word addr, unsigned int nwords,
-		      const unsigned char *buf) = 0;
+  bool write (word addr, unsigned int nwords, const unsigned char *buf);
 
   //  Read one word, represented in host endianess.
   //  Throw link_error in case of failure.
@@ -39,8 +122,153 @@ public:
   //  Throw link_error in case of failure.
   void write_word (word addr, word val);
 
+  //  Execute the N transfers of XFERS, in order.
+  //  Return True for success.
+  bool transact (dsu_xfer *xfers, unsigned int n);
+
+  //  Start the N transfers of XFERS in the background, after all the
+  //  transfers already started.  XFERS is copied, but the buffers must
+  //  stay valid until completion.  Return a ticket for wait.
+  //  The synchronous calls (read, write and transact) first wait for all
+  //  the started transfers, so that the transfers are always done in
+  //  order.  The other calls must not be used until sync.
+  unsigned long start (dsu_xfer *xfers, unsigned int n);
+
+  //  Wait for the completion of the transfers of TICKET (and of all the
+  //  ones started before).  Return True if those of TICKET succeeded.
+  bool wait (unsigned long ticket);
+
+  //  Wait for the completion of all the started transfers.
+  void sync (void);
+
+  //  Read LEN bytes at ADDR (not necessarily aligned) to BUF.
+  //  Return True for success.
+  bool read_bytes (word addr, word len, unsigned char *buf);
+
+  //  Write LEN bytes at ADDR (not necessarily aligned) from BUF.  The
+  //  partial words at the ends are read first and merged.
+  //  Return True for success.
+  bool write_bytes (word addr, word len, const unsigned char *buf);
+
   //  Maximum number of data bytes per packet.
   virtual unsigned get_max_len (void) = 0;
+
+  //  Constraints on the packets.  By default, get_max_len bytes of words.
+  virtual link_constraints get_constraints (void)
+  {
+    return { get_max_len (), 0, 4 };
+  }
+
+  //  Discard any data cached from the target, which may have changed it
+  //  (because the cpus ran).
+  virtual void invalidate (void) { }
+
+  //  Declare [FIRST, LAST] as an I/O area, whose reads have side effects
+  //  and must not be cached.
+  virtual void add_io_range (word first, word last) { }
+
+  //  Name of the link, for the statistics.
+  virtual const char *get_name (void) = 0;
+
+  //  For a link built over another link, return the latter.
+  virtual dsu_link *get_next (void) { return nullptr; }
+
+  //  For a link built over several links, return the I-th of them (the
+  //  first one is get_next), or null.
+  virtual dsu_link *get_branch (unsigned int i)
+  {
+    return i == 0 ? get_next () : nullptr;
+  }
+
+  link_stats stats;
+ protected:
+  //  Id of the link in the binary trace (see trace.h), or -1 if not traced.
+  int trace_id = -1;
+
+  //  Execute transfers and update the statistics (without waiting for
+  //  the started transfers).
+  bool run_transact (dsu_xfer *xfers, unsigned int n);
+
+  //  Implementation of read, write and transact, which also update the
+  //  statistics.
+  virtual bool do_read (word addr, unsigned int nwords,
+			unsigned char *res) = 0;
+  virtual bool do_write (word addr, unsigned int nwords,
+			 const unsigned char *buf) = 0;
+
+  //  The default implementation merges contiguous transfers of the same
+  //  direction (following get_constraints) and issues them with do_read and
+  //  do_write.
+  virtual bool do_transact (dsu_xfer *xfers, unsigned int n);
+ private:
+  async_queue *async = nullptr;
+};
+
+//  Display the statistics of LINK and of the links below it (all of them,
+//  for a stripe).
+void disp_link_stats (dsu_link *link);
+
+//  Clear the statistics of LINK and of the links below it.
+void reset_link_stats (dsu_link *link);
+
+//  Convert a transaction list into packets following constraints C:
+//  contiguous transfers of the same direction are merged (through an
+//  internal buffer) and large transfers are split (see plan_packet).
+class xfer_packer
+{
+ public:
+  xfer_packer (dsu_xfer *xfers, unsigned int n, const link_constraints &c);
+
+  //  Once the packets have been executed, copy the data of merged reads
+  //  back to the original transfers.
+  void scatter (void);
+
+  std::vector<dsu_xfer> packets;
+ private:
+  //  Transfers [FIRST, LAST) merged at offset OFF of TMP.
+  struct run
+  {
+    unsigned int first;
+    unsigned int last;
+    size_t off;
+  };
+
+  dsu_xfer *xfers;
+  std::vector<run> runs;
+  std::vector<unsigned char> tmp;
+};
+
+//  Helper to build and submit a transaction list.
+class dsu_batch
+{
+ public:
+  dsu_batch (dsu_link *link) : link (link) {}
+
+  //  Queue a read of one word.  *RES is set (in host endianness) by submit.
+  void read_word (word addr, word *res);
+
+  //  Queue a write of one word (in host endianness).
+  void write_word (word addr, word val);
+
+  //  Queue a read (resp. write) of NWORDS words.  The buffer must be
+  //  valid until submit.
+  void read (word addr, unsigned int nwords, unsigned char *res);
+  void write (word addr, unsigned int nwords, const unsigned char *buf);
+
+  //  Execute all queued transfers and clear the list.
+  //  Throw link_error in case of failure.
+  void submit (void);
+ private:
+  struct entry
+  {
+    dsu_xfer xfer;
+    //  For word accesses: the data and where to store the result.
+    unsigned char data[4];
+    word *res;
+  };
+
+  dsu_link *link;
+  std::vector<entry> entries;
 };
 
 struct libusb_device_handle;
@@ -50,31 +278,95 @@ class usb_dsu_link : public dsu_link
 public:
   bool open (void);
   void close (void);
-  bool read (word addr, unsigned int nwords, unsigned char *res);
-  bool write (word addr, unsigned int nwords, const unsigned char *buf);
   unsigned get_max_len (void) { return max_len; }
- private:
+  const char *get_name (void) { return "usb"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
   void trace (const char *pfx, const unsigned char *buf, int len);
   unsigned int max_len;
   struct libusb_device_handle *devh = nullptr;
 };
 
+//  Wrap LINK with a cache of the target memory.
+dsu_link *create_cache_dsu_link (dsu_link *link);
+
+//  Wrap LINK so that all its transfers are recorded to FILENAME.
+dsu_link *create_record_dsu_link (dsu_link *link, const char *filename);
+
+//  Stripe the large memory transfers over LINKS, by measured bandwidth.
+//  Other transfers use the first link, which is the primary one.
+dsu_link *create_stripe_dsu_link (const std::vector<dsu_link *> &links);
+
+//  Serve the transfers recorded in FILENAME, without hardware.  If TIMING
+//  is true, also emulate the recorded duration of the transfers.
+dsu_link *create_replay_dsu_link (const char *filename, bool timing);
+
+//  Same protocol as usb_dsu_link, but using the asynchronous libusb API so
+//  that several commands are in flight.
+dsu_link *create_usb_async_dsu_link (void);
+
 dsu_link *create_eth_dsu_link (const char *ipaddr);
 
+//  EDCL through raw Ethernet frames on an interface (Linux only).  SPEC is
+//  IFACE,MAC,IP where MAC and IP are the addresses of the board.
+dsu_link *create_eth_raw_dsu_link (const char *spec);
+
+//  EDCL settings: number of requests in flight, retransmission timeout (in
+//  ms) and number of retransmissions before failure.
+extern unsigned int edcl_window;
+extern unsigned int edcl_rto;
+extern unsigned int edcl_retries;
+
+//  Send and receive the EDCL datagrams by batches (with sendmmsg and
+//  recvmmsg), where available.
+extern bool edcl_mmsg;
+
+//  A simulated board (see sim.h), for tests without hardware.
+dsu_link *create_sim_dsu_link (void);
+
+//  Simulated link settings: latency of each packet (in us) and maximum
+//  number of data bytes per packet.
+extern unsigned int sim_latency;
+extern unsigned int sim_mtu;
+
 class remote_dsu_link : public dsu_link
 {
  public:
   remote_dsu_link (const char *daddr) : daddr (daddr) {};
   bool open (void);
-  bool read (word addr, unsigned int nwords, unsigned char *res);
-  bool write (word addr, unsigned int nwords, const unsigned char *buf);
   void close (void) { }
-  unsigned get_max_len (void) { return 250; }
+  unsigned get_max_len (void) { return max_len; }
+  const char *get_name (void) { return "remote"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
  private:
-  int send_recv (unsigned char *pkt, int len);
+  int get_char (void);
+  bool send_packet (const unsigned char *data, unsigned int len);
+  bool recv_packet (void);
+  bool command (const unsigned char *data, unsigned int len);
+  bool command (const char *str);
 
   const char *daddr;
   int sock;
+
+  //  Maximum packet size of the stub (from qSupported).
+  unsigned int packet_size = 0;
+  unsigned int max_len = 250;
+  bool no_ack = false;
+  //  Use binary X packets for writes, until the stub rejects them.
+  bool use_x = true;
+
+  //  Receive buffer.
+  unsigned char rbuf[4096];
+  unsigned int rpos = 0;
+  unsigned int rlen = 0;
+
+  //  Packet to send, body of the write command and body of the last reply.
+  std::vector<unsigned char> tx;
+  std::vector<unsigned char> tx_body;
+  std::vector<unsigned char> reply;
 };
 
 #ifdef HAVE_LIBURJTAG
@@ -82,18 +374,28 @@ class remote_dsu_link : public dsu_link
 typedef struct URJ_CHAIN urj_chain_t;
 typedef struct URJ_PART_INSTRUCTION urj_part_instruction_t;
 typedef struct URJ_PART urj_part_t;
+typedef struct URJ_TAP_REGISTER urj_tap_register_t;
 
 class jtag_dsu_link : public dsu_link
 {
  public:
   jtag_dsu_link (const char *cable) : cable (cable) {};
   bool open (void);
-  bool read (word addr, unsigned int nwords, unsigned char *res);
-  bool write (word addr, unsigned int nwords, const unsigned char *buf);
   void close (void) { }
-  unsigned get_max_len (void) { return 1024; /* 1kB but no boundary cross. */ }
+  unsigned get_max_len (void) { return 1024; }
+  //  The address auto-increment doesn't cross a 1kB boundary.
+  link_constraints get_constraints (void) { return { 1024, 0x400, 4 }; }
+  const char *get_name (void) { return "jtag"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
  private:
-  bool set_cmd (word addr, int w);
+  //  Queue IR and DR shifts.  They are executed when the cable is flushed.
+  //  Return false (with a message) if a shift cannot be queued.
+  bool defer_ir (urj_part_instruction_t *insn);
+  bool defer_dr (urj_tap_register_t *in, urj_tap_register_t *out);
+  bool defer_cmd (word addr, int w);
 
   const char *cable;
   urj_chain_t *chain;
@@ -104,4 +406,39 @@ class jtag_dsu_link : public dsu_link
 
 #endif /* HAVE_LIBURJTAG */
 
+//  Kinds of interface to the board.
+enum link_kind
+{
+  LINK_USB,
+  LINK_USB_ASYNC,
+  LINK_ETH,
+  LINK_ETH_RAW,
+  LINK_JTAG,
+  LINK_REMOTE,
+  LINK_SIM,
+  LINK_REPLAY
+};
+
+//  Selection of the link, from the command line.
+struct link_options
+{
+  //  Interfaces (with their argument), in the command line order.  When
+  //  there are several of them, transfers are striped and the first one
+  //  is the primary link.
+  std::vector<std::pair<link_kind, const char *>> links;
+  const char *record = nullptr;
+  //  File of the binary trace of the link traffic (see trace.h).
+  const char *trace = nullptr;
+  bool cache = true;
+  bool replay_timing = false;
+};
+
+//  If ARGV[I] is a link option, record it in OPTS (and skip its argument).
+//  Return 1 if it was a link option, 0 if not and -1 in case of error.
+int parse_link_option (int argc, char **argv, int &i, link_options &opts);
+
+//  Create the link selected by OPTS (USB by default).  Return nullptr in
+//  case of error.
+dsu_link *create_link (const link_options &opts);
+
 #endif /* LINKS_H_ */
@@ -1,12 +1,21 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <iostream>
-#include <fstream>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "loader.h"
 #include "lemon.h"
 #include "outputs.h"
+#include "lz4.h"
 
 using namespace std;
 
@@ -82,6 +91,32 @@ struct elf32_shdr
 #define STT_OBJECT	1
 #define STT_FUNC	2
 
+struct elf32_external_phdr
+{
+  unsigned char p_type[4];
+  unsigned char p_offset[4];
+  unsigned char p_vaddr[4];
+  unsigned char p_paddr[4];
+  unsigned char p_filesz[4];
+  unsigned char p_memsz[4];
+  unsigned char p_flags[4];
+  unsigned char p_align[4];
+};
+
+struct elf32_phdr
+{
+  Elf32_Word p_type;
+  Elf32_Off p_offset;
+  Elf32_Addr p_vaddr;
+  Elf32_Addr p_paddr;
+  Elf32_Word p_filesz;
+  Elf32_Word p_memsz;
+  Elf32_Word p_flags;
+  Elf32_Word p_align;
+};
+
+#define PT_LOAD 1
+
 struct elf32_external_sym
 {
   unsigned char st_name[4];
@@ -92,79 +127,127 @@ struct elf32_external_sym
   unsigned char st_shndx[2];
 };
 
+//  An ELF file, mapped in memory: the headers, sections and symbols are
+//  used in place, without copies.
 class elf_file
 {
 public:
   elf_file (const char *filename);
+  ~elf_file (void);
   bool check_elf (void);
   void read_shdr (elf32_shdr &shdr, unsigned int s);
-  unsigned char *read_section (const elf32_shdr &shdr);
-  unsigned int get_shstrndx (void) { return unpack_be16 (ehdr.e_shstrndx); }
-  unsigned int get_shnum (void) { return unpack_be16 (ehdr.e_shnum); }
-  word get_entry (void) { return unpack_be32 (ehdr.e_entry); }
+  void read_phdr (elf32_phdr &phdr, unsigned int p);
+  //  Content of section SHDR, in the mapping (or nullptr if it is not
+  //  within the file).
+  const unsigned char *get_section (const elf32_shdr &shdr);
+  unsigned int get_shstrndx (void) { return unpack_be16 (ehdr->e_shstrndx); }
+  unsigned int get_shnum (void) { return unpack_be16 (ehdr->e_shnum); }
+  unsigned int get_phnum (void) { return unpack_be16 (ehdr->e_phnum); }
+  //  LEN bytes at offset OFF of the file, in the mapping (or nullptr if they
+  //  are not within the file).
+  const unsigned char *get_data (Elf32_Off off, word len);
+  word get_entry (void) { return unpack_be32 (ehdr->e_entry); }
+  const char *get_filename (void) { return filename; }
+  //  LEN bytes at DATA (in the mapping) are no longer needed: drop their
+  //  pages from memory.  They are read again from the file if used.
+  void release (const unsigned char *data, size_t len);
 private:
   const char *filename;
-  ifstream file;
-  elf32_external_ehdr ehdr;
+  //  The whole file, or nullptr if it could not be mapped.
+  const unsigned char *map = nullptr;
+  size_t size = 0;
+  const elf32_external_ehdr *ehdr;
   Elf32_Off shoff;
+  Elf32_Off phoff;
 };
 
 elf_file::elf_file (const char *filename) :
-  filename (filename), file (filename, ios::in | ios::binary)
+  filename (filename)
+{
+  int fd = open (filename, O_RDONLY);
+  struct stat st;
+
+  if (fd < 0)
+    return;
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    {
+      void *m = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (m != MAP_FAILED)
+	{
+	  map = (const unsigned char *)m;
+	  size = st.st_size;
+	}
+    }
+  close (fd);
+}
+
+elf_file::~elf_file (void)
 {
+  if (map != nullptr)
+    munmap ((void *)map, size);
 }
 
 bool
 elf_file::check_elf (void)
 {
-  if (!file.is_open ())
+  if (map == nullptr)
     {
       cerr << filename << ": unable to open" << endl;
       return false;
     }
 
-  file.read ((char *)&ehdr, sizeof (ehdr));
-  if (ehdr.e_ident[0] != 0x7f
-      || ehdr.e_ident[1] != 'E'
-      || ehdr.e_ident[2] != 'L'
-      || ehdr.e_ident[3] != 'F')
+  ehdr = (const elf32_external_ehdr *)map;
+  if (size < sizeof (*ehdr)
+      || ehdr->e_ident[0] != 0x7f
+      || ehdr->e_ident[1] != 'E'
+      || ehdr->e_ident[2] != 'L'
+      || ehdr->e_ident[3] != 'F')
     {
       cerr << filename << ": not an ELF file" << endl;
       return false;
     }
-  if (ehdr.e_ident[EI_CLASS] != ELFCLASS32
-      || ehdr.e_ident[EI_DATA] != ELFDATA2MSB
-      || ehdr.e_ident[EI_VERSION] != EV_CURRENT)
+  if (ehdr->e_ident[EI_CLASS] != ELFCLASS32
+      || ehdr->e_ident[EI_DATA] != ELFDATA2MSB
+      || ehdr->e_ident[EI_VERSION] != EV_CURRENT)
     {
       cerr << filename << ": not ELF32 big-endian" << endl;
       return false;
     }
 
-  if (unpack_be16 (ehdr.e_machine) != EM_SPARC)
+  if (unpack_be16 (ehdr->e_machine) != EM_SPARC)
     {
       cerr << filename << ": not a SPARC binary" << endl;
       return false;
     }
-  if (unpack_be16 (ehdr.e_shentsize) != sizeof (elf32_external_shdr))
+  shoff = unpack_be32 (ehdr->e_shoff);
+  if (unpack_be16 (ehdr->e_shentsize) != sizeof (elf32_external_shdr)
+      || shoff > size
+      || (size - shoff) / sizeof (elf32_external_shdr) < get_shnum ())
+    {
+      cerr << filename << ": bad ehdr value" << endl;
+      return false;
+    }
+  phoff = unpack_be32 (ehdr->e_phoff);
+  if (get_phnum () != 0
+      && (unpack_be16 (ehdr->e_phentsize) != sizeof (elf32_external_phdr)
+	  || phoff > size
+	  || (size - phoff) / sizeof (elf32_external_phdr) < get_phnum ()))
     {
       cerr << filename << ": bad ehdr value" << endl;
       return false;
     }
-
-  shoff = unpack_be32 (ehdr.e_shoff);
   return true;
 }
 
 void
 elf_file::read_shdr (elf32_shdr &shdr, unsigned int s)
 {
-  elf32_external_shdr raw;
-
   if (s >= get_shnum ())
     throw "bad sh index";
 
-  file.seekg (shoff + s * sizeof (elf32_external_shdr));
-  file.read ((char *)&raw, sizeof (elf32_external_shdr));
+  const elf32_external_shdr &raw =
+    ((const elf32_external_shdr *)(map + shoff))[s];
 
   shdr.sh_name = unpack_be32 (raw.sh_name);
   shdr.sh_type = unpack_be32 (raw.sh_type);
@@ -178,15 +261,49 @@ elf_file::read_shdr (elf32_shdr &shdr, unsigned int s)
   shdr.sh_entsize = unpack_be32 (raw.sh_entsize);
 }
 
-unsigned char *
-elf_file::read_section (const elf32_shdr &shdr)
+void
+elf_file::read_phdr (elf32_phdr &phdr, unsigned int p)
+{
+  if (p >= get_phnum ())
+    throw "bad ph index";
+
+  const elf32_external_phdr &raw =
+    ((const elf32_external_phdr *)(map + phoff))[p];
+
+  phdr.p_type = unpack_be32 (raw.p_type);
+  phdr.p_offset = unpack_be32 (raw.p_offset);
+  phdr.p_vaddr = unpack_be32 (raw.p_vaddr);
+  phdr.p_paddr = unpack_be32 (raw.p_paddr);
+  phdr.p_filesz = unpack_be32 (raw.p_filesz);
+  phdr.p_memsz = unpack_be32 (raw.p_memsz);
+  phdr.p_flags = unpack_be32 (raw.p_flags);
+  phdr.p_align = unpack_be32 (raw.p_align);
+}
+
+const unsigned char *
+elf_file::get_data (Elf32_Off off, word len)
 {
-  unsigned char *res = new unsigned char[shdr.sh_size];
+  if (off > size || size - off < len)
+    return nullptr;
+  return map + off;
+}
 
-  file.seekg (shdr.sh_offset);
-  file.read ((char *)res, shdr.sh_size);
+const unsigned char *
+elf_file::get_section (const elf32_shdr &shdr)
+{
+  return get_data (shdr.sh_offset, shdr.sh_size);
+}
 
-  return res;
+void
+elf_file::release (const unsigned char *data, size_t len)
+{
+  uintptr_t page = sysconf (_SC_PAGESIZE);
+  uintptr_t beg = ((uintptr_t)data + page - 1) & ~(page - 1);
+  uintptr_t end = ((uintptr_t)data + len) & ~(page - 1);
+
+  //  Only the pages entirely within the range.
+  if (beg < end)
+    madvise ((void *)beg, end - beg, MADV_DONTNEED);
 }
 
 static std::map<word, string> symbols_map;
@@ -202,72 +319,659 @@ void
 load_bin (dsu_link *link,
 	  word addr, const unsigned char *buf, word len)
 {
-  int chunk_size = link->get_max_len ();
-  unsigned off;
+  //  Written at once, so that the link can pipeline the packets.  The
+  //  partial words at the ends are merged with the target memory.
+  if (!link->write_bytes (addr, len, buf))
+    cerr << "write error" << endl;
+}
+
+//  Bytes of the file to write at ADDR.
+struct load_range
+{
+  word addr;
+  const unsigned char *data;
+  word len;
+};
+
+//  A run of bytes, contiguous in the target memory: its ranges are in
+//  address order and follow each other.
+typedef vector<load_range> load_run;
+
+//  Number of bytes of RUN.
+static word
+run_len (const load_run &run)
+{
+  word len = 0;
 
-  //  Write by chunk
-  for (off = 0; off + chunk_size <= len; off += chunk_size)
+  for (auto &r : run)
+    len += r.len;
+  return len;
+}
+
+//  Merge RANGES (sorted by address) into maximal runs.  Where ranges
+//  overlap, the bytes of the first one are kept.  Consecutive ranges that
+//  also follow each other in the file are joined.
+static vector<load_run>
+merge_ranges (const vector<load_range> &ranges)
+{
+  vector<load_run> runs;
+  unsigned long long end = 0;
+
+  for (load_range r : ranges)
     {
-      if (!link->write (addr + off, chunk_size / 4, buf + off))
+      if (runs.empty () || r.addr > end)
 	{
-	  cerr << "write error" << endl;
-	  break;
+	  runs.push_back (load_run (1, r));
+	  end = (unsigned long long)r.addr + r.len;
+	  continue;
 	}
+      if (end - r.addr >= r.len)
+	continue;
+      word skip = end - r.addr;
+      r.addr += skip;
+      r.data += skip;
+      r.len -= skip;
+      end += r.len;
+
+      load_range &last = runs.back ().back ();
+      if (last.data + last.len == r.data)
+	last.len += r.len;
+      else
+	runs.back ().push_back (r);
+    }
+  return runs;
+}
+
+//  Uploads of runs, started in the background directly from the mapping of
+//  the file.  At most max_uploads chunks are in flight: the pages of the
+//  older ones are given back once written, so that the resident size does
+//  not grow with the file.
+class image_loader
+{
+public:
+  image_loader (dsu_link *link, elf_file &file) : link (link), file (file)
+  { }
+  //  Write the LEN bytes at offset OFF of RUN to the target, compressed if
+  //  set_compress was called, else as write_raw.
+  void write (const load_run &run, word off, word len);
+  //  Write the LEN bytes at offset OFF of RUN to the target uncompressed, by
+  //  full chunks: only the partial words at the ends are merged with the
+  //  target memory, synchronously.
+  void write_raw (const load_run &run, word off, word len);
+  //  From now on, send the data compressed, to a decompressor run by the
+  //  cpus of A_DSU (put at SCRATCH, with its buffers).  Return false in
+  //  case of error.
+  bool set_compress (dsu *a_dsu, word scratch);
+  //  Wait for the uploads.  Return false if one of them failed.
+  bool finish (void);
+  //  Number of bytes written to the memory, and sent over the link.
+  word written = 0;
+  word sent = 0;
+private:
+  static const word chunk_len = 0x10000;
+  static const unsigned int max_uploads = 16;
+  struct upload
+  {
+    unsigned long ticket;
+    const unsigned char *data;
+    word len;
+    //  Chunks across two ranges are copied.
+    vector<unsigned char> copy;
+  };
+  void wait_oldest (void);
+  dsu_link *link;
+  elf_file &file;
+  std::deque<upload> uploads;
+  bool ok = true;
+
+  //  Size of the blocks compressed.
+  static const word compress_len = 0x10000;
+  void write_compressed (const load_run &run, word off, word len);
+  bool wait_decompress (void);
+  //  For compressed writes: the decompressor, and two buffers for the
+  //  compressed blocks: one is uploaded while the other is decompressed.
+  dsu *comp_dsu = nullptr;
+  word comp_prg;
+  word comp_addr[2];
+  vector<unsigned char> comp_data[2];
+  unsigned int comp_idx = 0;
+  bool comp_running = false;
+};
+
+//  LEN bytes at offset OFF of RUN: in the mapping if they are within a
+//  single range, else copied to COPY.
+static const unsigned char *
+run_bytes (const load_run &run, word off, word len,
+	   vector<unsigned char> &copy)
+{
+  unsigned int i = 0;
+
+  while (off >= run[i].len)
+    off -= run[i++].len;
+  if (len <= run[i].len - off)
+    return run[i].data + off;
+
+  copy.resize (len);
+  for (word done = 0; done < len; off = 0, i++)
+    {
+      word n = min (run[i].len - off, len - done);
+
+      memcpy (&copy[done], run[i].data + off, n);
+      done += n;
     }
+  return copy.data ();
+}
 
-  if (off != len)
+void
+image_loader::write (const load_run &run, word off, word len)
+{
+  if (comp_dsu == nullptr)
+    write_raw (run, off, len);
+  else
+    for (word pos = 0; pos < len; pos += compress_len)
+      write_compressed (run, off + pos, min (compress_len, len - pos));
+}
+
+void
+image_loader::write_raw (const load_run &run, word off, word len)
+{
+  word addr = run.front ().addr + off;
+  word head = min ((4 - (addr & 3)) & 3, len);
+  word tail = (len - head) & 3;
+  vector<unsigned char> buf;
+
+  //  The partial words may be shared with a block being decompressed.
+  if ((head != 0 || tail != 0) && !wait_decompress ())
+    ok = false;
+
+  written += len;
+  sent += len;
+  if (head != 0
+      && !link->write_bytes (addr, head, run_bytes (run, off, head, buf)))
+    ok = false;
+  for (word pos = head; pos < len - tail; pos += chunk_len)
     {
-      int r = len - off;
-      unsigned char pad[2048];
+      word n = min (chunk_len, len - tail - pos);
+
+      if (uploads.size () >= max_uploads)
+	wait_oldest ();
+      uploads.push_back (upload ());
 
-      memset (pad, 0, sizeof (pad));
-      memcpy (pad, buf + off, r);
-      if (!link->write (addr + off, (r + 3) / 4, pad))
-	cerr << "write error" << endl;
+      upload &u = uploads.back ();
+      u.data = run_bytes (run, off + pos, n, u.copy);
+      u.len = n;
+
+      dsu_xfer x = { addr + pos, n / 4,
+		     const_cast<unsigned char *>(u.data), true };
+      u.ticket = link->start (&x, 1);
     }
+  if (tail != 0
+      && !link->write_bytes (addr + len - tail, tail,
+			     run_bytes (run, off + len - tail, tail, buf)))
+    ok = false;
 }
 
 void
-load_elf (dsu *a_dsu, const char *filename, bool content)
+image_loader::wait_oldest (void)
 {
-  elf_file file (filename);
+  upload &u = uploads.front ();
 
-  if (!file.check_elf ())
-    return;
+  if (!link->wait (u.ticket))
+    ok = false;
+  if (u.copy.empty ())
+    file.release (u.data, u.len);
+  uploads.pop_front ();
+}
+
+bool
+image_loader::finish (void)
+{
+  while (!uploads.empty ())
+    wait_oldest ();
+  if (!wait_decompress ())
+    ok = false;
+  return ok;
+}
+
+static const unsigned char crc_prg[] = {
+#include "crc_prg.h"
+};
+
+static const unsigned char lz4_prg[] = {
+#include "lz4_prg.h"
+};
+
+bool
+image_loader::set_compress (dsu *a_dsu, word scratch)
+{
+  word buf_len = (lz4_bound (compress_len) + 7) & ~7;
+
+  comp_prg = scratch;
+  comp_addr[0] = scratch + ((sizeof (lz4_prg) + 7) & ~7);
+  comp_addr[1] = comp_addr[0] + buf_len;
+  if (!link->write_bytes (comp_prg, sizeof (lz4_prg), lz4_prg))
+    return false;
+  for (auto cpu : a_dsu->get_cpus ())
+    cpu->cache_flush (true);
+  comp_dsu = a_dsu;
+  return true;
+}
+
+//  Wait until the previous block is decompressed.
+bool
+image_loader::wait_decompress (void)
+{
+  if (!comp_running)
+    return true;
+  comp_running = false;
+  return comp_dsu->call_wait ();
+}
+
+//  Compress the LEN bytes at offset OFF of RUN, upload them while the
+//  previous block is decompressed, then start their decompression.  All
+//  the bytes are written by the cpus, so the partial words need no care.
+//  A block that doesn't compress is written as it is.
+void
+image_loader::write_compressed (const load_run &run, word off, word len)
+{
+  vector<unsigned char> copy;
+  const unsigned char *src = run_bytes (run, off, len, copy);
+  vector<unsigned char> &data = comp_data[comp_idx];
+
+  data.resize (lz4_bound (len) + 3);
+  word clen = lz4_compress (src, len, data.data ());
+  if (clen >= len)
+    {
+      write_raw (run, off, len);
+      return;
+    }
+  word nwords = (clen + 3) / 4;
+  fill (data.begin () + clen, data.begin () + nwords * 4, 0);
+  if (copy.empty ())
+    file.release (src, len);
+
+  dsu_xfer x = { comp_addr[comp_idx], nwords, data.data (), true };
+  unsigned long ticket = link->start (&x, 1);
+  written += len;
+  sent += nwords * 4;
 
+  if (!wait_decompress () || !link->wait (ticket))
+    {
+      ok = false;
+      return;
+    }
+  comp_dsu->set_entry (comp_prg);
+  for (auto cpu : comp_dsu->get_cpus ())
+    {
+      cpu->set_gpr (REG_SPARC_O0, comp_addr[comp_idx]);
+      cpu->set_gpr (REG_SPARC_O1, clen);
+      cpu->set_gpr (REG_SPARC_O2, run.front ().addr + off);
+    }
+  comp_dsu->call_start ();
+  comp_running = true;
+  comp_idx ^= 1;
+}
+
+//  Size of the blocks compared by load --delta (and by verify to locate
+//  errors).
+static const word delta_block = 1024;
+
+//  CRC-32 (as zlib) of the LEN bytes at BUF, continuing CRC (0 to start).
+static word
+crc32 (word crc, const unsigned char *buf, word len)
+{
+  static word table[256];
+
+  if (table[1] == 0)
+    for (word i = 0; i < 256; i++)
+      {
+	word c = i;
+
+	for (int k = 0; k < 8; k++)
+	  c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+	table[i] = c;
+      }
+
+  crc = ~crc;
+  for (word i = 0; i < len; i++)
+    crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+//  CRC-32 of the LEN bytes at offset OFF of RUN.
+static word
+run_crc (const load_run &run, word off, word len)
+{
+  word crc = 0;
+
+  for (auto &r : run)
+    {
+      if (off >= r.len)
+	{
+	  off -= r.len;
+	  continue;
+	}
+      word n = min (r.len - off, len);
+      crc = crc32 (crc, r.data + off, n);
+      len -= n;
+      off = 0;
+      if (len == 0)
+	break;
+    }
+  return crc;
+}
+
+//  Compute with the target cpu the CRC of each block of BLOCK bytes of the
+//  LEN bytes at ADDR (all multiples of 4), into CRCS.  The program and its
+//  data are put at SCRATCH.  Return false in case of error.
+static bool
+target_crcs (dsu *a_dsu, word scratch, word addr, word len, word block,
+	     vector<word> &crcs)
+{
+  dsu_link *link = a_dsu->get_link ();
+  word table = scratch + ((sizeof (crc_prg) + 7) & ~7);
+  word res = table + 1024;
+  unsigned int n = (len + block - 1) / block;
+
+  if (!link->write_bytes (scratch, sizeof (crc_prg), crc_prg))
+    return false;
+  a_dsu->set_entry (scratch);
+  for (auto cpu : a_dsu->get_cpus ())
+    {
+      cpu->cache_flush (true);
+      cpu->cache_flush (false);
+      cpu->set_gpr (REG_SPARC_O0, addr);
+      cpu->set_gpr (REG_SPARC_O1, len);
+      cpu->set_gpr (REG_SPARC_O2, block);
+      cpu->set_gpr (REG_SPARC_O3, res);
+      cpu->set_gpr (REG_SPARC_O4, table);
+    }
+  if (!a_dsu->call ())
+    return false;
+
+  vector<unsigned char> buf (n * 4);
+  if (!link->read (res, n, buf.data ()))
+    return false;
+  crcs.resize (n);
+  for (unsigned int i = 0; i < n; i++)
+    crcs[i] = unpack_be32 (&buf[i * 4]);
+  return true;
+}
+
+//  Write the blocks of RUN (of LEN bytes) whose CRC differs from CRCS, the
+//  CRCs of the target memory (of the whole words of RUN).  Add the number
+//  of blocks written to NCHANGED.
+static void
+load_delta (image_loader &loader, const load_run &run, word len,
+	    const vector<word> &crcs, unsigned int &nchanged)
+{
+  word addr = run.front ().addr;
+  word head = min ((4 - (addr & 3)) & 3, len);
+  word tail = (len - head) & 3;
+  word body = len - head - tail;
+
+  //  The partial words are always written, uncompressed as there are only
+  //  a few bytes.
+  if (head != 0)
+    loader.write_raw (run, 0, head);
+  if (tail != 0)
+    loader.write_raw (run, len - tail, tail);
+
+  //  Consecutive changed blocks are written at once.
+  word first = 0;
+  word n = 0;
+  for (unsigned int i = 0; i < crcs.size (); i++)
+    {
+      word off = head + i * delta_block;
+      word blen = min (delta_block, body - i * delta_block);
+
+      if (run_crc (run, off, blen) != crcs[i])
+	{
+	  if (n == 0)
+	    first = off;
+	  n += blen;
+	  nchanged++;
+	}
+      else if (n != 0)
+	{
+	  loader.write (run, first, n);
+	  n = 0;
+	}
+    }
+  if (n != 0)
+    loader.write (run, first, n);
+}
+
+//  Read the content of FILE, merged in RUNS.  Set IMAGE_END to the end of
+//  the memory used by the image, and SYMTAB_IDX to the index of the symbol
+//  table (0 if none).  List the sections if DISP.  Return false in case of
+//  error.
+static bool
+read_image (elf_file &file, bool disp, vector<load_run> &runs,
+	    word &image_end, unsigned int &symtab_idx)
+{
   //  Read section strings
   elf32_shdr shstrsh;
   file.read_shdr (shstrsh, file.get_shstrndx ());
-  unsigned char *shstr = file.read_section (shstrsh);
-  dsu_link *link = content ? a_dsu->get_link () : nullptr;
+  const char *shstr = (const char *)file.get_section (shstrsh);
+  if (shstr == nullptr || shstrsh.sh_size == 0
+      || shstr[shstrsh.sh_size - 1] != 0)
+    {
+      cerr << file.get_filename () << ": bad section names" << endl;
+      return false;
+    }
+  //  Bytes to load, from the sections.
+  vector<load_range> ranges;
 
-  unsigned int symtab_idx = 0;
+  image_end = 0;
+  symtab_idx = 0;
   for (int i = 0; i < file.get_shnum (); i++)
     {
       elf32_shdr shdr;
       file.read_shdr (shdr, i);
 
-      if (content
-	  && (shdr.sh_flags & SHF_ALLOC) != 0
+      if ((shdr.sh_flags & SHF_ALLOC) != 0)
+	image_end = max (image_end, shdr.sh_addr + shdr.sh_size);
+      if ((shdr.sh_flags & SHF_ALLOC) != 0
 	  && shdr.sh_type != SHT_NOBITS)
 	{
 	  Elf32_Word addr = shdr.sh_addr;
+	  const unsigned char *data = file.get_section (shdr);
 
-	  cout << "section: " << shstr + shdr.sh_name;
-	  cout << " at " << hex8 << addr;
-	  cout << ", size: " << hex8 << shdr.sh_size << endl;
-
-	  unsigned char *buf = file.read_section (shdr);
-
-	  load_bin (link, addr, buf, shdr.sh_size);
+	  if (disp)
+	    {
+	      cout << "section: "
+		   << (shdr.sh_name < shstrsh.sh_size
+		       ? shstr + shdr.sh_name : "?");
+	      cout << " at " << hex8 << addr;
+	      cout << ", size: " << hex8 << shdr.sh_size << endl;
+	    }
 
-	  delete [] buf;
+	  if (data == nullptr)
+	    {
+	      cerr << "section not within the file" << endl;
+	      continue;
+	    }
+	  ranges.push_back ({ addr, data, shdr.sh_size });
 	}
       else if (shdr.sh_type == SHT_SYMTAB)
 	symtab_idx = i;
     }
 
-  //  Load symbols.
+  //  Also load the segments: they cover the padding between the sections,
+  //  so that the runs are longer.  As the sections, at their virtual
+  //  address.  A segment is clipped to the sections it contains, as it may
+  //  also include the ELF headers, below the first section.
+  vector<load_range> segments;
+  for (unsigned int i = 0; i < file.get_phnum (); i++)
+    {
+      elf32_phdr phdr;
+      file.read_phdr (phdr, i);
+
+      if (phdr.p_type != PT_LOAD)
+	continue;
+      image_end = max (image_end, phdr.p_vaddr + phdr.p_memsz);
+      if (phdr.p_filesz == 0)
+	continue;
+
+      const unsigned char *data = file.get_data (phdr.p_offset, phdr.p_filesz);
+      if (data == nullptr)
+	{
+	  cerr << "segment not within the file" << endl;
+	  continue;
+	}
+
+      unsigned long long seg_end
+	= (unsigned long long)phdr.p_vaddr + phdr.p_filesz;
+      unsigned long long lo = seg_end;
+      unsigned long long hi = 0;
+      for (auto &r : ranges)
+	if (r.addr >= phdr.p_vaddr
+	    && (unsigned long long)r.addr + r.len <= seg_end)
+	  {
+	    lo = min (lo, (unsigned long long)r.addr);
+	    hi = max (hi, (unsigned long long)r.addr + r.len);
+	  }
+      if (lo < hi)
+	segments.push_back ({ (word)lo, data + (lo - phdr.p_vaddr),
+			      (word)(hi - lo) });
+    }
+  //  The sections are kept for those outside of the segments.
+  ranges.insert (ranges.end (), segments.begin (), segments.end ());
+
+  //  Upload maximal runs, so that only their last chunk is partial.
+  stable_sort (ranges.begin (), ranges.end (),
+	       [] (const load_range &a, const load_range &b)
+	       { return a.addr < b.addr; });
+  runs = merge_ranges (ranges);
+  return true;
+}
+
+//  Check RUNS against the target memory: the whole words with CRCs
+//  computed by the target cpu (with the program at SCRATCH), the partial
+//  words by reading them.  Report the result.
+static void
+verify_runs (dsu *a_dsu, const vector<load_run> &runs, word scratch)
+{
+  dsu_link *link = a_dsu->get_link ();
+  bool ok = true;
+
+  for (auto &run : runs)
+    {
+      word addr = run.front ().addr;
+      word len = run_len (run);
+      word head = min ((4 - (addr & 3)) & 3, len);
+      word tail = (len - head) & 3;
+      word body = len - head - tail;
+      vector<word> crcs;
+      unsigned char buf[4];
+      vector<unsigned char> copy;
+
+      //  One CRC for the run, then one per block to locate the error.
+      if (body != 0
+	  && (!target_crcs (a_dsu, scratch, addr + head, body, body, crcs)
+	      || crcs[0] != run_crc (run, head, body)))
+	{
+	  if (!target_crcs (a_dsu, scratch, addr + head, body, delta_block,
+			    crcs))
+	    {
+	      cerr << "verify: cannot compute the crcs" << endl;
+	      return;
+	    }
+	  for (unsigned int i = 0; i < crcs.size (); i++)
+	    {
+	      word off = head + i * delta_block;
+	      word blen = min (delta_block, body - i * delta_block);
+
+	      if (crcs[i] != run_crc (run, off, blen))
+		{
+		  cout << "verify: mismatch in the block at "
+		       << hex8 (addr + off) << endl;
+		  ok = false;
+		  break;
+		}
+	    }
+	}
+      if (head != 0
+	  && (!link->read_bytes (addr, head, buf)
+	      || memcmp (buf, run_bytes (run, 0, head, copy), head) != 0))
+	{
+	  cout << "verify: mismatch at " << hex8 (addr) << endl;
+	  ok = false;
+	}
+      if (tail != 0
+	  && (!link->read_bytes (addr + len - tail, tail, buf)
+	      || memcmp (buf, run_bytes (run, len - tail, tail, copy),
+			 tail) != 0))
+	{
+	  cout << "verify: mismatch at " << hex8 (addr + len - tail) << endl;
+	  ok = false;
+	}
+    }
+  cout << (ok ? "verify: ok" : "verify: failed") << endl;
+}
+
+void
+load_elf (dsu *a_dsu, const char *filename, bool content, unsigned int flags)
+{
+  elf_file file (filename);
+  vector<load_run> runs;
+  word image_end;
+  unsigned int symtab_idx;
+
+  if (!file.check_elf ()
+      || !read_image (file, content, runs, image_end, symtab_idx))
+    return;
+
+  //  Helper programs are put after the image.
+  word scratch = (image_end + 7) & ~7;
+
+  //  For --delta, the CRCs of the target memory, computed before any
+  //  write, with the program put after the image.
+  vector<vector<word>> crcs (runs.size ());
+  unsigned int nblocks = 0;
+  if (content && (flags & LOAD_DELTA))
+    {
+      for (unsigned int i = 0; i < runs.size (); i++)
+	{
+	  word addr = runs[i].front ().addr;
+	  word len = run_len (runs[i]);
+	  word head = min ((4 - (addr & 3)) & 3, len);
+	  word body = (len - head) & ~3;
+
+	  if (body != 0
+	      && !target_crcs (a_dsu, scratch, addr + head, body, delta_block,
+			       crcs[i]))
+	    {
+	      cerr << "cannot compute the crcs, loading everything" << endl;
+	      flags &= ~LOAD_DELTA;
+	      break;
+	    }
+	  nblocks += crcs[i].size ();
+	}
+    }
+
+  image_loader loader (content ? a_dsu->get_link () : nullptr, file);
+  if (content && (flags & LOAD_COMPRESS)
+      && !loader.set_compress (a_dsu, scratch))
+    cerr << "cannot load the decompressor, loading uncompressed" << endl;
+  unsigned int nchanged = 0;
+  for (unsigned int i = 0; content && i < runs.size (); i++)
+    {
+      word len = run_len (runs[i]);
+
+      cout << "load: at " << hex8 << runs[i].front ().addr;
+      cout << ", size: " << hex8 << len << endl;
+      if (flags & LOAD_DELTA)
+	load_delta (loader, runs[i], len, crcs[i], nchanged);
+      else
+	loader.write (runs[i], 0, len);
+    }
+  if (content && (flags & LOAD_DELTA))
+    cout << "delta: " << dec (nchanged) << " of " << dec (nblocks)
+	 << " blocks changed" << endl;
+
+  //  Load symbols (while the sections are written).
   if (symtab_idx != 0)
     {
       elf32_shdr symtab_shdr;
@@ -276,36 +980,46 @@ load_elf (dsu *a_dsu, const char *filename, bool content)
       elf32_shdr strtab_shdr;
       file.read_shdr (strtab_shdr, symtab_shdr.sh_link);
 
-      unsigned char *syms = file.read_section (symtab_shdr);
-      unsigned char *strs = file.read_section (strtab_shdr);
+      const unsigned char *syms = file.get_section (symtab_shdr);
+      const char *strs = (const char *)file.get_section (strtab_shdr);
 
       symbols_vec.clear();
       symbols_map.clear();
 
-      for (int i = 0;
-	   i < symtab_shdr.sh_size;
+      for (word i = 0;
+	   syms != nullptr && strs != nullptr
+	     && i + sizeof (elf32_external_sym) <= symtab_shdr.sh_size;
 	   i += sizeof (elf32_external_sym))
 	{
-	  elf32_external_sym *s = (elf32_external_sym *)&syms[i];
+	  const elf32_external_sym *s = (const elf32_external_sym *)&syms[i];
 	  word val = unpack_be32 (s->st_value);
-	  char *name = (char *)strs + unpack_be32 (s->st_name);
+	  word off = unpack_be32 (s->st_name);
 	  unsigned int stt = s->st_info[0] & 0x0f;
 
+	  //  The name must be within the string table.
+	  if (off >= strtab_shdr.sh_size
+	      || memchr (strs + off, 0, strtab_shdr.sh_size - off) == nullptr)
+	    continue;
 	  if ((stt == STT_OBJECT || stt == STT_FUNC || stt == STT_NOTYPE)
-	      && *name != 0)
-	    symbols_map.insert (std::pair<word, string>(val, name));
+	      && strs[off] != 0)
+	    symbols_map.insert (std::pair<word, string>(val, strs + off));
 	}
 
-      delete [] syms;
-      delete [] strs;
-
       cout << dec (symbols_map.size()) << " symbols" << endl;
 
       for (auto &s: symbols_map)
 	symbols_vec.push_back (std::pair<word, string&>(s.first, s.second));
       sort (symbols_vec.begin (), symbols_vec.end (), sym_compare);
     }
-  delete [] shstr;
+  //  The mapping is used until the uploads are done.
+  if (!loader.finish ())
+    cerr << "write error" << endl;
+  if (content && (flags & LOAD_COMPRESS))
+    cout << "compress: " << dec (loader.sent) << " bytes sent for "
+	 << dec (loader.written) << endl;
+
+  if (content && (flags & LOAD_VERIFY))
+    verify_runs (a_dsu, runs, scratch);
 
   if (content)
     {
@@ -315,6 +1029,24 @@ load_elf (dsu *a_dsu, const char *filename, bool content)
     }
 }
 
+void
+verify_elf (dsu *a_dsu, const char *filename)
+{
+  elf_file file (filename);
+  vector<load_run> runs;
+  word image_end;
+  unsigned int symtab_idx;
+
+  if (!file.check_elf ()
+      || !read_image (file, false, runs, image_end, symtab_idx))
+    return;
+
+  verify_runs (a_dsu, runs, (image_end + 7) & ~7);
+
+  //  As after a load.
+  a_dsu->set_entry (file.get_entry ());
+}
+
 string
 symbolize (word addr)
 {
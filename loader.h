@@ -3,9 +3,28 @@
 
 #include "dsu.h"
 
+//  Options of load_elf.
+enum load_flags
+{
+  //  Only write the blocks that differ from the target memory (compared
+  //  with CRCs computed by the target cpu).
+  LOAD_DELTA = 1 << 0,
+  //  Check the memory after the load (see verify_elf).
+  LOAD_VERIFY = 1 << 1,
+  //  Send the data compressed, to a decompressor run by the target cpu.
+  LOAD_COMPRESS = 1 << 2
+};
+
 //  If CONTENT is true, load both contents and symbols.
 //  If CONTENT is false, load just symbols.
-void load_elf (dsu *a_dsu, const char *filename, bool content);
+//  FLAGS is a set of load_flags.
+void load_elf (dsu *a_dsu, const char *filename, bool content,
+	       unsigned int flags = 0);
+
+//  Check that the memory matches the content of FILENAME, with CRCs
+//  computed by the target cpu.  The cpus are left at the entry point, and
+//  the memory after the image is used.
+void verify_elf (dsu *a_dsu, const char *filename);
 
 void load_bin (dsu &a_dsu, word addr, const unsigned char *buf, word len);
 
@@ -0,0 +1,97 @@
+#include <cstring>
+#include <vector>
+
+#include "lz4.h"
+
+using namespace std;
+
+//  Matches are at least 4 bytes long, at most 64 KB back.
+static const unsigned int min_match = 4;
+static const unsigned int max_offset = 0xffff;
+//  As required by the format, the last 5 bytes are literals and the last
+//  match starts at least 12 bytes before the end.
+static const unsigned int last_literals = 5;
+static const unsigned int match_limit = 12;
+
+static const unsigned int hash_bits = 12;
+
+static unsigned int
+read32 (const unsigned char *p)
+{
+  unsigned int v;
+
+  memcpy (&v, p, 4);
+  return v;
+}
+
+//  Write the length LEN beyond 15 (the value in the token).
+static unsigned char *
+write_len (unsigned char *op, unsigned int len)
+{
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+//  Write a sequence: the LIT literals at SRC, then (unless LAST) a match of
+//  MLEN bytes at OFFSET back.
+static unsigned char *
+write_seq (unsigned char *op, const unsigned char *src, unsigned int lit,
+	   bool last, unsigned int offset, unsigned int mlen)
+{
+  unsigned char *token = op++;
+
+  *token = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15)
+    op = write_len (op, lit);
+  memcpy (op, src, lit);
+  op += lit;
+  if (last)
+    return op;
+
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  mlen -= min_match;
+  *token |= mlen < 15 ? mlen : 15;
+  if (mlen >= 15)
+    op = write_len (op, mlen);
+  return op;
+}
+
+unsigned int
+lz4_compress (const unsigned char *src, unsigned int len, unsigned char *dst)
+{
+  //  Last position seen (plus one) for each hash of 4 bytes.
+  vector<unsigned int> table (1 << hash_bits, 0);
+  unsigned char *op = dst;
+  unsigned int anchor = 0;
+  unsigned int pos = 0;
+
+  //  Greedy parsing.
+  while (len > match_limit && pos < len - match_limit)
+    {
+      unsigned int seq = read32 (src + pos);
+      unsigned int h = (seq * 2654435761u) >> (32 - hash_bits);
+      unsigned int ref = table[h];
+
+      table[h] = pos + 1;
+      if (ref == 0 || pos - (ref - 1) > max_offset
+	  || read32 (src + ref - 1) != seq)
+	{
+	  pos++;
+	  continue;
+	}
+      ref--;
+
+      unsigned int mlen = min_match;
+      while (pos + mlen < len - last_literals
+	     && src[ref + mlen] == src[pos + mlen])
+	mlen++;
+      op = write_seq (op, src + anchor, pos - anchor, false, pos - ref, mlen);
+      pos += mlen;
+      anchor = pos;
+    }
+  op = write_seq (op, src + anchor, len - anchor, true, 0, 0);
+  return op - dst;
+}
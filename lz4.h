@@ -0,0 +1,19 @@
+#ifndef LZ4_H_
+#define LZ4_H_
+
+//  LZ4 block compression (the format of LZ4_compress_default), used to
+//  send images to a decompressor run by the target (see lz4_prg.S).
+
+//  Maximum size of the compression of LEN bytes.
+inline unsigned int
+lz4_bound (unsigned int len)
+{
+  return len + len / 255 + 16;
+}
+
+//  Compress the LEN bytes at SRC into DST (of at least lz4_bound (LEN)
+//  bytes).  Return the size of the compressed data.
+unsigned int lz4_compress (const unsigned char *src, unsigned int len,
+			   unsigned char *dst);
+
+#endif /* LZ4_H_ */
@@ -0,0 +1,27 @@
+ 0xc0, 0xa0, 0x02, 0x20, 0x92, 0x02, 0x00, 0x09,
+ 0xc2, 0x0a, 0x00, 0x00, 0x90, 0x02, 0x20, 0x01,
+ 0x85, 0x30, 0x60, 0x04, 0x80, 0xa0, 0xa0, 0x0f,
+ 0x12, 0x80, 0x00, 0x07, 0x01, 0x00, 0x00, 0x00,
+ 0xc6, 0x0a, 0x00, 0x00, 0x90, 0x02, 0x20, 0x01,
+ 0x80, 0xa0, 0xe0, 0xff, 0x02, 0xbf, 0xff, 0xfd,
+ 0x84, 0x00, 0x80, 0x03, 0x80, 0xa0, 0xa0, 0x00,
+ 0x02, 0x80, 0x00, 0x08, 0x01, 0x00, 0x00, 0x00,
+ 0xc6, 0x0a, 0x00, 0x00, 0x90, 0x02, 0x20, 0x01,
+ 0xc6, 0x2a, 0x80, 0x00, 0x84, 0xa0, 0xa0, 0x01,
+ 0x12, 0xbf, 0xff, 0xfc, 0x94, 0x02, 0xa0, 0x01,
+ 0x80, 0xa2, 0x00, 0x09, 0x1a, 0x80, 0x00, 0x1a,
+ 0x01, 0x00, 0x00, 0x00, 0xc6, 0x0a, 0x00, 0x00,
+ 0xc8, 0x0a, 0x20, 0x01, 0x89, 0x29, 0x20, 0x08,
+ 0x86, 0x10, 0xc0, 0x04, 0x90, 0x02, 0x20, 0x02,
+ 0x86, 0x22, 0x80, 0x03, 0x84, 0x08, 0x60, 0x0f,
+ 0x80, 0xa0, 0xa0, 0x0f, 0x12, 0x80, 0x00, 0x07,
+ 0x01, 0x00, 0x00, 0x00, 0xc8, 0x0a, 0x00, 0x00,
+ 0x90, 0x02, 0x20, 0x01, 0x80, 0xa1, 0x20, 0xff,
+ 0x02, 0xbf, 0xff, 0xfd, 0x84, 0x00, 0x80, 0x04,
+ 0x84, 0x00, 0xa0, 0x04, 0xc8, 0x08, 0xc0, 0x00,
+ 0x86, 0x00, 0xe0, 0x01, 0xc8, 0x2a, 0x80, 0x00,
+ 0x84, 0xa0, 0xa0, 0x01, 0x12, 0xbf, 0xff, 0xfc,
+ 0x94, 0x02, 0xa0, 0x01, 0x10, 0xbf, 0xff, 0xd3,
+ 0x01, 0x00, 0x00, 0x00, 0xc0, 0xa0, 0x02, 0x00,
+ 0x90, 0x10, 0x20, 0x00, 0x91, 0xd0, 0x20, 0x01,
+ 0x10, 0xbf, 0xff, 0xfe, 0x01, 0x00, 0x00, 0x00
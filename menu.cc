@@ -111,6 +111,38 @@ cmd_arg_bool::parse (string &p)
   return true;
 }
 
+bool
+cmd_arg_options::parse (string &p)
+{
+  set.clear ();
+  while (1)
+    {
+      p = skip_blanks (p);
+      if (p.compare (0, 2, "--") != 0)
+	return true;
+
+      string s = extract_str (p);
+      bool found = false;
+      for (auto n : names)
+	if (s == n)
+	  found = true;
+      if (!found)
+	return false;
+      set.push_back (s);
+    }
+}
+
+bool
+cmd_arg_options::is_set (const char *opt)
+{
+  if (!present)
+    return false;
+  for (auto &s : set)
+    if (s == opt)
+      return true;
+  return false;
+}
+
 bool
 cmd_arg_expr::parse (string &p)
 {
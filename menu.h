@@ -88,6 +88,23 @@ public:
   std::string filename;
 };
 
+//  Options (words starting with "--") among NAMES, before the other
+//  arguments.
+class cmd_arg_options : public cmd_arg
+{
+public:
+  cmd_arg_options (const char *name, std::vector<const char *> names,
+		   const char *help) :
+    cmd_arg (name, true, help), names (names) {}
+  virtual bool parse (std::string &p);
+
+  //  True if option OPT was given.
+  bool is_set (const char *opt);
+private:
+  std::vector<const char *> names;
+  std::vector<std::string> set;
+};
+
 class menu_item
 {
 public:
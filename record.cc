@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "links.h"
+#include "outputs.h"
+
+using namespace std;
+
+//  Format of a recording (all the numbers are big-endian words):
+//
+//  header: "LMREC" 0 0 version(1 byte), max packet length of the link.
+//  then one entry per transfer:
+//    flags (REC_WRITE, REC_FAILED), addr, nwords,
+//    delay since the start of the previous operation (in us),
+//    duration of the transfer (in us),
+//    data (nwords words) for writes and successful reads.
+//
+//  The duration of an operation with several transfers is shared between
+//  them, proportionally to their length.
+
+static const unsigned char rec_magic[8] = { 'L', 'M', 'R', 'E', 'C', 0, 0, 1 };
+static const unsigned int rec_hdr_len = 8 + 4;
+static const unsigned int rec_entry_len = 5 * 4;
+
+enum rec_flags
+{
+  REC_WRITE = 1,
+  REC_FAILED = 2
+};
+
+//  A dsu_link that logs all the transfers to (and from) the link below it.
+class record_dsu_link : public dsu_link
+{
+ public:
+  record_dsu_link (dsu_link *link, const char *filename) :
+    link (link), filename (filename) {}
+  bool open (void);
+  void close (void);
+  unsigned get_max_len (void) { return link->get_max_len (); }
+  link_constraints get_constraints (void)
+  {
+    return link->get_constraints ();
+  }
+  const char *get_name (void) { return "record"; }
+  dsu_link *get_next (void) { return link; }
+  void invalidate (void) { link->invalidate (); }
+  void add_io_range (word first, word last)
+  {
+    link->add_io_range (first, last);
+  }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
+ private:
+  void log (const dsu_xfer *xfers, unsigned int n, bool ok,
+	    chrono::steady_clock::time_point start);
+
+  dsu_link *link;
+  const char *filename;
+  ofstream file;
+  chrono::steady_clock::time_point last;
+};
+
+bool
+record_dsu_link::open (void)
+{
+  if (!link->open ())
+    return false;
+
+  file.open (filename, ios::out | ios::binary | ios::trunc);
+  if (!file.is_open ())
+    {
+      cerr << filename << ": unable to create" << endl;
+      link->close ();
+      return false;
+    }
+
+  unsigned char hdr[rec_hdr_len];
+  memcpy (hdr, rec_magic, sizeof (rec_magic));
+  pack_be32 (hdr + 8, link->get_max_len ());
+  file.write ((const char *)hdr, rec_hdr_len);
+  last = chrono::steady_clock::now ();
+  return true;
+}
+
+void
+record_dsu_link::close (void)
+{
+  link->close ();
+  file.close ();
+}
+
+void
+record_dsu_link::log (const dsu_xfer *xfers, unsigned int n, bool ok,
+		      chrono::steady_clock::time_point start)
+{
+  auto end = chrono::steady_clock::now ();
+  word delay = chrono::duration_cast<chrono::microseconds>
+    (start - last).count ();
+  word dur = chrono::duration_cast<chrono::microseconds>
+    (end - start).count ();
+  uint64_t total = 0;
+
+  last = start;
+  for (unsigned int i = 0; i < n; i++)
+    total += xfers[i].nwords;
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      const dsu_xfer &x = xfers[i];
+      unsigned char e[rec_entry_len];
+      word flags = (x.is_write ? REC_WRITE : 0) | (ok ? 0 : REC_FAILED);
+
+      pack_be32 (e + 0, flags);
+      pack_be32 (e + 4, x.addr);
+      pack_be32 (e + 8, x.nwords);
+      pack_be32 (e + 12, i == 0 ? delay : 0);
+      pack_be32 (e + 16, total ? dur * x.nwords / total : dur / n);
+      file.write ((const char *)e, rec_entry_len);
+      if (x.is_write || ok)
+	file.write ((const char *)x.buf, x.nwords * 4);
+    }
+}
+
+bool
+record_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  auto start = chrono::steady_clock::now ();
+  dsu_xfer x = { addr, nwords, res, false };
+  bool ok = link->read (addr, nwords, res);
+
+  log (&x, 1, ok, start);
+  return ok;
+}
+
+bool
+record_dsu_link::do_write (word addr, unsigned int nwords,
+			   const unsigned char *buf)
+{
+  auto start = chrono::steady_clock::now ();
+  dsu_xfer x = { addr, nwords, const_cast<unsigned char *>(buf), true };
+  bool ok = link->write (addr, nwords, buf);
+
+  log (&x, 1, ok, start);
+  return ok;
+}
+
+bool
+record_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  auto start = chrono::steady_clock::now ();
+  bool ok = link->transact (xfers, n);
+
+  log (xfers, n, ok, start);
+  return ok;
+}
+
+dsu_link *
+create_record_dsu_link (dsu_link *link, const char *filename)
+{
+  return new record_dsu_link (link, filename);
+}
+
+//  A dsu_link that serves the transfers of a recording.
+//
+//  The requests don't have to be the same as the recorded ones (the layers
+//  above may batch or cache differently).  Recorded transfers are consumed
+//  in order: each word read is taken from the first recorded read of that
+//  word after the last consumed transfer (so that polled registers change
+//  as they did), then from the words written during the replay, and
+//  finally from the last recorded read.
+class replay_dsu_link : public dsu_link
+{
+ public:
+  replay_dsu_link (const char *filename, bool timing) :
+    filename (filename), timing (timing) {}
+  bool open (void);
+  void close (void) { }
+  unsigned get_max_len (void) { return max_len; }
+  const char *get_name (void) { return "replay"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+ private:
+  struct entry
+  {
+    word flags;
+    word addr;
+    word nwords;
+    word dur;
+    //  Offset of the data in DATA.
+    size_t off;
+  };
+
+  //  Number of entries searched for the recorded write of a write.
+  static const unsigned int write_window = 64;
+
+  //  Emulate the recorded duration US.
+  void wait (double us);
+
+  const char *filename;
+  bool timing;
+  unsigned int max_len = 0;
+  vector<entry> entries;
+  vector<unsigned char> data;
+  //  Successful reads of each word (indexes in ENTRIES, in order).
+  unordered_map<word, vector<unsigned int>> reads;
+  //  Words written during the replay (in target byte order).
+  unordered_map<word, word> written;
+  //  Next entry to consume.
+  unsigned int cur = 0;
+};
+
+bool
+replay_dsu_link::open (void)
+{
+  ifstream file (filename, ios::in | ios::binary);
+  unsigned char hdr[rec_hdr_len];
+
+  if (!file.is_open ())
+    {
+      cerr << filename << ": unable to open" << endl;
+      return false;
+    }
+  if (!file.read ((char *)hdr, rec_hdr_len)
+      || memcmp (hdr, rec_magic, sizeof (rec_magic)) != 0)
+    {
+      cerr << filename << ": not a lemon recording" << endl;
+      return false;
+    }
+  max_len = unpack_be32 (hdr + 8);
+
+  unsigned char e[rec_entry_len];
+  while (file.read ((char *)e, rec_entry_len))
+    {
+      entry ent;
+
+      ent.flags = unpack_be32 (e + 0);
+      ent.addr = unpack_be32 (e + 4);
+      ent.nwords = unpack_be32 (e + 8);
+      ent.dur = unpack_be32 (e + 16);
+      ent.off = data.size ();
+      if ((ent.flags & REC_WRITE) || !(ent.flags & REC_FAILED))
+	{
+	  data.resize (ent.off + ent.nwords * 4);
+	  if (!file.read ((char *)&data[ent.off], ent.nwords * 4))
+	    {
+	      cerr << filename << ": truncated recording" << endl;
+	      return false;
+	    }
+	}
+      if (!(ent.flags & (REC_WRITE | REC_FAILED)))
+	for (word i = 0; i < ent.nwords; i++)
+	  reads[ent.addr + 4 * i].push_back (entries.size ());
+      entries.push_back (ent);
+    }
+  if (!file.eof ())
+    {
+      cerr << filename << ": read error" << endl;
+      return false;
+    }
+  cur = 0;
+  written.clear ();
+  return true;
+}
+
+void
+replay_dsu_link::wait (double us)
+{
+  if (!timing || us < 1)
+    return;
+
+  //  Busy wait, as sleeps are not precise enough for short transfers.
+  auto end = chrono::steady_clock::now ()
+    + chrono::microseconds ((uint64_t)us);
+  while (chrono::steady_clock::now () < end)
+    ;
+}
+
+bool
+replay_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  unsigned int first = entries.size ();
+  double us = 0;
+
+  for (word i = 0; i < nwords; i++)
+    {
+      word a = addr + 4 * i;
+      auto r = reads.find (a);
+      unsigned int j = entries.size ();
+      const vector<unsigned int> *v = nullptr;
+
+      if (r != reads.end ())
+	{
+	  v = &r->second;
+	  auto it = lower_bound (v->begin (), v->end (), cur);
+	  if (it != v->end ())
+	    j = *it;
+	}
+
+      if (j < entries.size ())
+	{
+	  first = min (first, j);
+	  us += (double)entries[j].dur / entries[j].nwords;
+	}
+      else
+	{
+	  auto w = written.find (a);
+	  if (w != written.end ())
+	    {
+	      memcpy (res + 4 * i, &w->second, 4);
+	      continue;
+	    }
+	  if (v == nullptr)
+	    {
+	      cerr << "replay: no recorded data at " << hex8 (a) << endl;
+	      return false;
+	    }
+	  j = v->back ();
+	}
+
+      const entry &ent = entries[j];
+      memcpy (res + 4 * i, &data[ent.off + (a - ent.addr)], 4);
+    }
+
+  if (first < entries.size ())
+    cur = first + 1;
+  wait (us);
+  return true;
+}
+
+bool
+replay_dsu_link::do_write (word addr, unsigned int nwords,
+			   const unsigned char *buf)
+{
+  for (word i = 0; i < nwords; i++)
+    {
+      word w;
+
+      memcpy (&w, buf + 4 * i, 4);
+      written[addr + 4 * i] = w;
+    }
+
+  //  Consume the recorded write, if it is close.
+  for (unsigned int j = cur;
+       j < entries.size () && j < cur + write_window; j++)
+    {
+      const entry &ent = entries[j];
+
+      if ((ent.flags & REC_WRITE)
+	  && addr >= ent.addr && addr < ent.addr + ent.nwords * 4)
+	{
+	  cur = j + 1;
+	  wait ((double)ent.dur * nwords / ent.nwords);
+	  break;
+	}
+    }
+  return true;
+}
+
+dsu_link *
+create_replay_dsu_link (const char *filename, bool timing)
+{
+  return new replay_dsu_link (filename, timing);
+}
@@ -0,0 +1,534 @@
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "serve.h"
+#include "outputs.h"
+#include "osdep.h"
+
+using namespace std;
+
+//  The server speaks the subset of the gdb remote protocol used by
+//  remote_dsu_link: qSupported, QStartNoAckMode, m, M and X packets.
+
+//  Packet size announced to the clients.
+static const unsigned int serve_packet_size = 0x4020;
+
+//  Largest transfer of a request (in bytes).
+static const unsigned int serve_max_len = 0x10000;
+
+//  The requests of a client are not read while more than this is waiting to
+//  be sent to it.
+static const size_t serve_max_out = 0x40000;
+
+struct serve_client
+{
+  int sock;
+  //  Set when the connection is lost.
+  bool closed = false;
+  bool no_ack = false;
+  //  Characters received and not yet decoded.
+  string in;
+  //  Last reply sent, for retransmission.
+  string last;
+  //  Characters not yet sent (the socket is non-blocking).
+  string out;
+};
+
+//  A request of a client.  Requests are answered in order.
+struct serve_req
+{
+  serve_client *client;
+  //  Reply for the requests which don't access the board.
+  string reply;
+  bool start_no_ack = false;
+  //  Memory request: bytes requested and words transferred.
+  bool is_mem = false;
+  bool is_write = false;
+  bool is_pnp = false;
+  word addr = 0;
+  unsigned int len = 0;
+  word waddr = 0;
+  unsigned int nwords = 0;
+  vector<unsigned char> data;
+  //  True if served by the board (and not from the cache).
+  bool pending = false;
+  bool failed = false;
+};
+
+class link_server
+{
+ public:
+  link_server (soc *board);
+  bool listen (unsigned int port);
+  void run (void);
+ private:
+  void accept_client (void);
+  //  Receive from C, return false if it is disconnected.
+  bool receive (serve_client *c);
+  //  Decode the complete packets received from C.
+  void decode (serve_client *c);
+  void handle (serve_client *c, const string &pkt);
+  void send_reply (serve_client *c, const string &body);
+  //  Queue S for C and send what the socket accepts.
+  void queue (serve_client *c, const string &s);
+  //  Send the queued characters of C.
+  void flush (serve_client *c);
+  //  Execute all the requests as one transaction and send the replies.
+  void execute (void);
+  bool is_pnp (word addr, unsigned int len);
+
+  dsu_link *link;
+  int lsock = -1;
+  vector<serve_client *> clients;
+  vector<serve_req> reqs;
+  //  Plug and play areas, which are read-only, and their cached words (in
+  //  target byte order).
+  vector<pair<word, word>> pnp_ranges;
+  unordered_map<word, word> pnp_cache;
+
+  unsigned long nreqs = 0;
+  unsigned long nbatches = 0;
+  unsigned long ncached = 0;
+};
+
+link_server::link_server (soc *board) : link (board->get_link ())
+{
+  for (auto b : board->get_buses ())
+    pnp_ranges.push_back (make_pair (b->base + 0xff000, b->base + 0xfffff));
+}
+
+bool
+link_server::is_pnp (word addr, unsigned int len)
+{
+  word last = addr + len - 1;
+
+  for (auto &r : pnp_ranges)
+    if (addr >= r.first && last <= r.second && last >= addr)
+      return true;
+  return false;
+}
+
+bool
+link_server::listen (unsigned int port)
+{
+  struct sockaddr_in sa;
+  int one = 1;
+
+  lsock = ::socket (PF_INET, SOCK_STREAM, 0);
+  if (lsock < 0)
+    {
+      perror ("cannot create socket");
+      return false;
+    }
+  setsockopt (lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+  //  Only local clients.
+  memset (&sa, 0, sizeof sa);
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (port);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if (::bind (lsock, (struct sockaddr *) &sa, sizeof (sa)) < 0
+      || ::listen (lsock, 8) < 0)
+    {
+      perror ("cannot listen");
+      ::close (lsock);
+      return false;
+    }
+  return true;
+}
+
+void
+link_server::accept_client (void)
+{
+  int s = ::accept (lsock, nullptr, nullptr);
+
+  if (s < 0)
+    {
+      perror ("accept");
+      return;
+    }
+  //  A client which stops reading must not block the others.
+  fcntl (s, F_SETFL, fcntl (s, F_GETFL) | O_NONBLOCK);
+
+  serve_client *c = new serve_client;
+  c->sock = s;
+  clients.push_back (c);
+  cout << "serve: new client (" << clients.size () << " connected)" << endl;
+}
+
+bool
+link_server::receive (serve_client *c)
+{
+  char buf[4096];
+  int res = recv (c->sock, buf, sizeof (buf), 0);
+
+  if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return true;
+  if (res < 1)
+    return false;
+  c->in.append (buf, res);
+  return true;
+}
+
+void
+link_server::decode (serve_client *c)
+{
+  size_t pos = 0;
+
+  while (pos < c->in.size ())
+    {
+      char ch = c->in[pos];
+
+      if (ch == '-')
+	{
+	  //  Nack: send the last reply again.
+	  if (!c->last.empty ())
+	    queue (c, c->last);
+	  pos++;
+	  continue;
+	}
+      if (ch != '$')
+	{
+	  //  Acks and interrupts are ignored.
+	  pos++;
+	  continue;
+	}
+
+      size_t end = c->in.find ('#', pos);
+      if (end == string::npos || end + 2 >= c->in.size ())
+	break;
+
+      unsigned char csum = 0;
+      string pkt;
+      for (size_t i = pos + 1; i < end; i++)
+	{
+	  unsigned char b = c->in[i];
+
+	  csum += b;
+	  if (b == '}' && i + 1 < end)
+	    {
+	      i++;
+	      csum += (unsigned char)c->in[i];
+	      b = c->in[i] ^ 0x20;
+	    }
+	  pkt.push_back (b);
+	}
+      unsigned int ecsum = strtoul (c->in.substr (end + 1, 2).c_str (),
+				    nullptr, 16);
+      pos = end + 3;
+
+      if (!c->no_ack)
+	{
+	  queue (c, ecsum == csum ? "+" : "-");
+	  if (ecsum != csum)
+	    continue;
+	}
+      handle (c, pkt);
+    }
+  c->in.erase (0, pos);
+}
+
+//  Parse "ADDR,LEN" at the start of S (after the command letter).
+static bool
+parse_addr_len (const string &s, word &addr, unsigned int &len, size_t &end)
+{
+  const char *p = s.c_str () + 1;
+  char *e;
+
+  addr = strtoul (p, &e, 16);
+  if (e == p || *e != ',')
+    return false;
+  p = e + 1;
+  len = strtoul (p, &e, 16);
+  if (e == p || len > serve_max_len)
+    return false;
+  end = e - s.c_str ();
+  return true;
+}
+
+void
+link_server::handle (serve_client *c, const string &pkt)
+{
+  serve_req r;
+  size_t end;
+
+  r.client = c;
+  nreqs++;
+
+  if (pkt.compare (0, 10, "qSupported") == 0)
+    {
+      char buf[64];
+      snprintf (buf, sizeof (buf), "PacketSize=%x;QStartNoAckMode+",
+		serve_packet_size);
+      r.reply = buf;
+    }
+  else if (pkt == "QStartNoAckMode")
+    {
+      r.reply = "OK";
+      r.start_no_ack = true;
+    }
+  else if (pkt[0] == 'm' && parse_addr_len (pkt, r.addr, r.len, end)
+	   && end == pkt.size ())
+    {
+      r.is_mem = true;
+      r.waddr = r.addr & ~3U;
+      r.nwords = (r.addr + r.len - r.waddr + 3) / 4;
+      r.data.resize (r.nwords * 4);
+      r.is_pnp = r.len != 0 && is_pnp (r.waddr, r.nwords * 4);
+    }
+  else if ((pkt[0] == 'M' || pkt[0] == 'X')
+	   && parse_addr_len (pkt, r.addr, r.len, end)
+	   && end < pkt.size () && pkt[end] == ':')
+    {
+      const char *d = pkt.c_str () + end + 1;
+      size_t dlen = pkt.size () - end - 1;
+
+      //  The board is only accessed by words.
+      if ((r.addr & 3) != 0 || (r.len & 3) != 0
+	  || dlen != (pkt[0] == 'M' ? 2 * r.len : r.len))
+	r.reply = "E02";
+      else
+	{
+	  r.is_mem = true;
+	  r.is_write = true;
+	  r.waddr = r.addr;
+	  r.nwords = r.len / 4;
+	  r.data.resize (r.len);
+	  for (unsigned int i = 0; i < r.len; i++)
+	    if (pkt[0] == 'X')
+	      r.data[i] = d[i];
+	    else
+	      r.data[i] = strtoul (string (d + 2 * i, 2).c_str (),
+				   nullptr, 16);
+	}
+    }
+  else if (pkt[0] == 'm' || pkt[0] == 'M' || pkt[0] == 'X')
+    r.reply = "E02";
+  //  Other commands are not supported: empty reply.
+
+  reqs.push_back (r);
+}
+
+void
+link_server::send_reply (serve_client *c, const string &body)
+{
+  unsigned char csum = 0;
+  char cs[3];
+
+  for (unsigned char b : body)
+    csum += b;
+  snprintf (cs, sizeof (cs), "%02x", csum);
+  c->last = "$" + body + "#" + cs;
+  queue (c, c->last);
+}
+
+void
+link_server::queue (serve_client *c, const string &s)
+{
+  c->out += s;
+  flush (c);
+}
+
+void
+link_server::flush (serve_client *c)
+{
+  size_t off = 0;
+
+  while (off < c->out.size () && !c->closed)
+    {
+      int res = send (c->sock, c->out.data () + off, c->out.size () - off,
+		      MSG_NOSIGNAL);
+      if (res < 0 && errno == EINTR)
+	continue;
+      if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	break;
+      if (res < 1)
+	c->closed = true;
+      else
+	off += res;
+    }
+  c->out.erase (0, off);
+}
+
+void
+link_server::execute (void)
+{
+  vector<dsu_xfer> xfers;
+
+  if (reqs.empty ())
+    return;
+
+  //  All the requests, in arrival order, are done by one transaction so
+  //  that the link can pack them.
+  for (auto &r : reqs)
+    {
+      if (!r.is_mem || r.nwords == 0 || r.client->closed)
+	continue;
+      if (r.is_pnp)
+	{
+	  bool hit = true;
+	  for (unsigned int i = 0; i < r.nwords && hit; i++)
+	    {
+	      auto it = pnp_cache.find (r.waddr + 4 * i);
+	      if (it == pnp_cache.end ())
+		hit = false;
+	      else
+		memcpy (&r.data[4 * i], &it->second, 4);
+	    }
+	  if (hit)
+	    {
+	      ncached++;
+	      continue;
+	    }
+	}
+      r.pending = true;
+      xfers.push_back ({ r.waddr, r.nwords, r.data.data (), r.is_write });
+    }
+
+  nbatches++;
+  if (!xfers.empty () && !link->transact (xfers.data (), xfers.size ()))
+    {
+      //  Don't fail the requests of every client for one error: do them
+      //  again one by one, so that only the failing ones get an error.
+      unsigned int i = 0;
+
+      for (auto &r : reqs)
+	if (r.pending)
+	  r.failed = !link->transact (&xfers[i++], 1);
+    }
+
+  for (auto &r : reqs)
+    {
+      serve_client *c = r.client;
+
+      if (c->closed)
+	continue;
+      if (r.is_mem)
+	{
+	  if (r.failed)
+	    r.reply = "E01";
+	  else if (r.is_write)
+	    r.reply = "OK";
+	  else
+	    {
+	      if (r.pending && !r.failed && r.is_pnp)
+		for (unsigned int i = 0; i < r.nwords; i++)
+		  memcpy (&pnp_cache[r.waddr + 4 * i], &r.data[4 * i], 4);
+	      r.reply.clear ();
+	      for (unsigned int i = 0; i < r.len; i++)
+		{
+		  unsigned char b = r.data[r.addr - r.waddr + i];
+		  r.reply.push_back (xdigits[b >> 4]);
+		  r.reply.push_back (xdigits[b & 0x0f]);
+		}
+	    }
+	}
+      send_reply (c, r.reply);
+      if (r.start_no_ack)
+	c->no_ack = true;
+    }
+  reqs.clear ();
+}
+
+void
+link_server::run (void)
+{
+  while (!user_stop)
+    {
+      vector<struct pollfd> fds (clients.size () + 1);
+
+      fds[0].fd = lsock;
+      fds[0].events = POLLIN;
+      for (unsigned int i = 0; i < clients.size (); i++)
+	{
+	  serve_client *c = clients[i];
+
+	  fds[i + 1].fd = c->sock;
+	  fds[i + 1].events = 0;
+	  if (c->out.size () < serve_max_out)
+	    fds[i + 1].events |= POLLIN;
+	  if (!c->out.empty ())
+	    fds[i + 1].events |= POLLOUT;
+	}
+
+      int res = poll (fds.data (), fds.size (), 200);
+      if (res < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("poll");
+	  break;
+	}
+
+      //  Collect the requests of all the clients, then execute them.
+      for (unsigned int i = 0; i < clients.size (); i++)
+	{
+	  serve_client *c = clients[i];
+	  short ev = fds[i + 1].revents;
+
+	  if (ev & POLLOUT)
+	    flush (c);
+	  if (ev & (POLLIN | POLLHUP | POLLERR))
+	    {
+	      if (receive (c))
+		decode (c);
+	      else
+		c->closed = true;
+	    }
+	}
+      execute ();
+
+      for (unsigned int i = 0; i < clients.size (); )
+	if (clients[i]->closed)
+	  {
+	    ::close (clients[i]->sock);
+	    delete clients[i];
+	    clients.erase (clients.begin () + i);
+	    cout << "serve: client left (" << clients.size ()
+		 << " connected)" << endl;
+	  }
+	else
+	  i++;
+
+      if (fds[0].revents & POLLIN)
+	accept_client ();
+    }
+
+  for (auto c : clients)
+    {
+      ::close (c->sock);
+      delete c;
+    }
+  clients.clear ();
+  ::close (lsock);
+
+  cout << "serve: " << nreqs << " requests in " << nbatches << " batches, "
+       << ncached << " plug and play reads from the cache" << endl;
+}
+
+void
+serve_link (soc *board, unsigned int port)
+{
+  link_server srv (board);
+
+  if (!srv.listen (port))
+    return;
+  cout << "serving on port " << dec (port) << " (C-c to stop)" << endl;
+  srv.run ();
+}
@@ -0,0 +1,12 @@
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include "soc.h"
+
+//  Share the link of BOARD with other processes, which connect to the
+//  local tcp PORT (with --remote :PORT).  Requests of all the clients are
+//  batched together in arrival order, and reads of the plug and play areas
+//  are cached.  Return when the user interrupts (C-c).
+void serve_link (soc *board, unsigned int port);
+
+#endif /* SERVE_H_ */
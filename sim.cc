@@ -0,0 +1,1618 @@
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+#include "sim.h"
+#include "links.h"
+#include "dsu.h"
+#include "outputs.h"
+#include "trace.h"
+
+using namespace std;
+
+//  Plug and play records.
+static const word ahb_pnp_masters[][8] =
+  {
+    //  leon4
+    { 0x01048000, 0, 0, 0, 0, 0, 0, 0 },
+  };
+
+static const word ahb_pnp_slaves[][8] =
+  {
+    //  ahbrom, 1 MB at 0x00000000.
+    { 0x0101b000, 0, 0, 0, 0x0000fff2, 0, 0, 0 },
+    //  ahbram, 64 MB at 0x40000000.
+    { 0x0100e000, 0, 0, 0, 0x4000fc02, 0, 0, 0 },
+    //  apbctrl, 1 MB at 0x80000000.
+    { 0x01006000, 0, 0, 0, 0x8000fff2, 0, 0, 0 },
+    //  dsu4, 16 MB at 0x90000000.
+    { 0x01049000, 0, 0, 0, 0x9000ff02, 0, 0, 0 },
+  };
+
+static const word apb_pnp[][2] =
+  {
+    //  apbuart, irq 2.
+    { 0x0100c002, 0x0010fff1 },
+    //  irqmp.
+    { 0x0100d000, 0x0020fff1 },
+    //  gptimer, irq 8.
+    { 0x01011008, 0x0030fff1 },
+  };
+
+//  Board id and build id, at 0xfffffff0.
+static const word build_id = 0x00014207;
+
+//  Cache configuration: 4 ways of 4 KB, 32 bytes per line.
+static const word cache_cfg = (3 << 24) | (2 << 20) | (3 << 16);
+
+//  Writable bits of the cache control register.
+static const word ccr_mask = CCR_ICS | CCR_DCS | CCR_IF | CCR_DF | CCR_IB
+  | CCR_DS;
+
+//  No FPU, V8 mul/div, 2 watchpoints.
+static const word asr17_val = (1 << 8) | (2 << 5);
+
+static const word dsu_ctrl_mask = CTRL_TE | CTRL_BE | CTRL_BW | CTRL_BS
+  | CTRL_BX | CTRL_BZ;
+
+enum
+  {
+    UART_DR = 1 << 0,
+    UART_TS = 1 << 1,
+    UART_TE = 1 << 2,
+    UART_TH = 1 << 7,
+    UART_TF = 1 << 9,
+  };
+
+enum
+  {
+    TIM_EN = 1 << 0,
+    TIM_RS = 1 << 1,
+    TIM_LD = 1 << 2,
+    TIM_IE = 1 << 3,
+    TIM_IP = 1 << 4,
+    TIM_CH = 1 << 5,
+  };
+
+static word
+sext (word v, unsigned int bits)
+{
+  word m = 1U << (bits - 1);
+
+  v &= (m << 1) - 1;
+  return (v ^ m) - m;
+}
+
+sim_board::sim_board (void) : ram (ram_size)
+{
+  memset (iu, 0, sizeof (iu));
+  memset (itrace, 0, sizeof (itrace));
+  memset (ahbtrace, 0, sizeof (ahbtrace));
+
+  tim_scaler = tim_scaler_reload = mhz - 1;
+  tim_config = ntimers | (8 << 3) | (1 << 8);
+  for (unsigned int i = 0; i < ntimers; i++)
+    tim_counter[i] = tim_reload[i] = tim_ctrl[i] = 0;
+}
+
+bool
+sim_board::read (word addr, unsigned int nwords, unsigned char *res)
+{
+  addr &= ~3U;
+
+  if (addr - ram_base < ram_size && nwords * 4 <= ram_base + ram_size - addr)
+    {
+      memcpy (res, &ram[addr - ram_base], nwords * 4);
+      return true;
+    }
+
+  for (unsigned int i = 0; i < nwords; i++)
+    {
+      word val;
+
+      if (!bus_read (addr + 4 * i, 4, &val))
+	return false;
+      pack_be32 (res + 4 * i, val);
+    }
+  return true;
+}
+
+bool
+sim_board::write (word addr, unsigned int nwords, const unsigned char *buf)
+{
+  addr &= ~3U;
+
+  if (addr - ram_base < ram_size && nwords * 4 <= ram_base + ram_size - addr)
+    {
+      memcpy (&ram[addr - ram_base], buf, nwords * 4);
+      return true;
+    }
+
+  for (unsigned int i = 0; i < nwords; i++)
+    if (!bus_write (addr + 4 * i, 4, unpack_be32 (buf + 4 * i)))
+      return false;
+  return true;
+}
+
+bool
+sim_board::bus_read (word addr, unsigned int sz, word *val)
+{
+  if (addr - ram_base < ram_size)
+    {
+      const unsigned char *p = &ram[addr - ram_base];
+
+      if (sz == 4)
+	*val = unpack_be32 (p);
+      else if (sz == 2)
+	*val = unpack_be16 (p);
+      else
+	*val = p[0];
+      return true;
+    }
+
+  //  Registers are read by words.
+  word w;
+
+  if (addr < rom_size)
+    w = 0;
+  else if (addr >= 0x80000000 && addr < 0x80100000)
+    w = apb_read (addr & ~3U);
+  else if (addr >= 0x90000000 && addr < 0x91000000)
+    w = dsu_read (addr & 0xfffffc);
+  else if (addr >= 0xfffff000)
+    w = pnp_read (addr & ~3U);
+  else
+    return false;
+
+  if (sz == 4)
+    *val = w;
+  else
+    *val = (w >> ((4 - sz - (addr & 3)) * 8)) & ((1U << (sz * 8)) - 1);
+  return true;
+}
+
+bool
+sim_board::bus_write (word addr, unsigned int sz, word val)
+{
+  if (addr - ram_base < ram_size)
+    {
+      unsigned char *p = &ram[addr - ram_base];
+
+      if (sz == 4)
+	pack_be32 (p, val);
+      else if (sz == 2)
+	{
+	  p[0] = val >> 8;
+	  p[1] = val;
+	}
+      else
+	p[0] = val;
+      return true;
+    }
+
+  //  Narrow writes to registers write the whole word.
+  if (sz != 4)
+    val <<= (4 - sz - (addr & 3)) * 8;
+
+  if (addr < rom_size)
+    ;
+  else if (addr >= 0x80000000 && addr < 0x80100000)
+    apb_write (addr & ~3U, val);
+  else if (addr >= 0x90000000 && addr < 0x91000000)
+    dsu_write (addr & 0xfffffc, val);
+  else if (addr < 0xfffff000)
+    return false;
+  return true;
+}
+
+word
+sim_board::pnp_read (word addr)
+{
+  unsigned int idx = (addr >> 5) & 0x7f;
+  unsigned int w = (addr >> 2) & 7;
+  const unsigned int nmst
+    = sizeof (ahb_pnp_masters) / sizeof (ahb_pnp_masters[0]);
+  const unsigned int nslv
+    = sizeof (ahb_pnp_slaves) / sizeof (ahb_pnp_slaves[0]);
+
+  if (addr == 0xfffffff0)
+    return build_id;
+  if (idx < nmst)
+    return ahb_pnp_masters[idx][w];
+  if (idx >= 64 && idx - 64 < nslv)
+    return ahb_pnp_slaves[idx - 64][w];
+  return 0;
+}
+
+word
+sim_board::apb_read (word addr)
+{
+  word off = addr & 0xff;
+
+  if ((addr & 0xff000) == 0xff000)
+    {
+      unsigned int idx = (addr >> 3) & 0x1ff;
+
+      if (idx < sizeof (apb_pnp) / sizeof (apb_pnp[0]))
+	return apb_pnp[idx][(addr >> 2) & 1];
+      return 0;
+    }
+
+  switch (addr & 0xfff00)
+    {
+    case 0x100:
+      //  APBUART.
+      switch (off)
+	{
+	case 0x00:
+	  if (!uart_rxf.empty ())
+	    {
+	      word c = uart_rxf.front ();
+	      uart_rxf.pop_front ();
+	      return c;
+	    }
+	  return 0;
+	case 0x04:
+	  {
+	    word st = (uart_txf.size () << 20) | (uart_rxf.size () << 26);
+
+	    if (!uart_rxf.empty ())
+	      st |= UART_DR;
+	    if (uart_txf.empty ())
+	      st |= UART_TS | UART_TE;
+	    if (uart_txf.size () < uart_fifo_len / 2)
+	      st |= UART_TH;
+	    if (uart_txf.size () >= uart_fifo_len)
+	      st |= UART_TF;
+	    return st;
+	  }
+	case 0x08:
+	  //  FIFOs available.
+	  return uart_ctrl | (1U << 31);
+	case 0x0c:
+	  return uart_scaler;
+	case 0x10:
+	  //  FIFO debug register: in debug mode, read the transmitter FIFO.
+	  if ((uart_ctrl & (1 << 11)) && !uart_txf.empty ())
+	    {
+	      word c = uart_txf.front ();
+	      uart_txf.pop_front ();
+	      return c;
+	    }
+	  return 0;
+	}
+      return 0;
+    case 0x200:
+      //  IRQMP.
+      switch (off)
+	{
+	case 0x00:
+	  return irq_level;
+	case 0x04:
+	  return irq_pending;
+	case 0x08:
+	case 0x80:
+	  return irq_force;
+	case 0x10:
+	  //  One cpu.
+	  return powerdown ? 1 : 0;
+	case 0x40:
+	  return irq_mask;
+	}
+      return 0;
+    case 0x300:
+      //  GPTIMER.
+      switch (off)
+	{
+	case 0x00:
+	  return tim_scaler;
+	case 0x04:
+	  return tim_scaler_reload;
+	case 0x08:
+	  return tim_config;
+	}
+      if (off >= 0x10 && off < 0x10 * (ntimers + 1))
+	{
+	  unsigned int n = (off >> 4) - 1;
+
+	  switch (off & 0xc)
+	    {
+	    case 0x0:
+	      return tim_counter[n];
+	    case 0x4:
+	      return tim_reload[n];
+	    case 0x8:
+	      return tim_ctrl[n];
+	    }
+	}
+      return 0;
+    }
+  return 0;
+}
+
+void
+sim_board::apb_write (word addr, word val)
+{
+  word off = addr & 0xff;
+
+  switch (addr & 0xfff00)
+    {
+    case 0x100:
+      switch (off)
+	{
+	case 0x00:
+	  uart_tx (val & 0xff);
+	  break;
+	case 0x08:
+	  uart_ctrl = val & 0x7fffffff;
+	  //  Send the characters queued while debug mode was enabled or the
+	  //  transmitter was disabled.
+	  if ((uart_ctrl & 2) && !(uart_ctrl & (1 << 11)))
+	    while (!uart_txf.empty ())
+	      {
+		cout << char (uart_txf.front ());
+		uart_txf.pop_front ();
+	      }
+	  cout << flush;
+	  break;
+	case 0x0c:
+	  uart_scaler = val & 0xfffff;
+	  break;
+	case 0x10:
+	  //  FIFO debug register: in debug mode, write the receiver FIFO.
+	  if ((uart_ctrl & (1 << 11)) && uart_rxf.size () < uart_fifo_len)
+	    {
+	      uart_rxf.push_back (val & 0xff);
+	      if (uart_ctrl & (1 << 2))
+		raise_irq (id_to_irq (apb_pnp[0][0]));
+	    }
+	  break;
+	}
+      break;
+    case 0x200:
+      switch (off)
+	{
+	case 0x00:
+	  irq_level = val & 0xfffe;
+	  break;
+	case 0x04:
+	  irq_pending = val & 0xfffe;
+	  break;
+	case 0x08:
+	case 0x80:
+	  irq_force = val & 0xfffe;
+	  break;
+	case 0x0c:
+	  irq_pending &= ~val;
+	  break;
+	case 0x10:
+	  //  Wake up the cpu.
+	  if (val & 1)
+	    powerdown = false;
+	  break;
+	case 0x40:
+	  irq_mask = val & 0xfffe;
+	  break;
+	}
+      break;
+    case 0x300:
+      switch (off)
+	{
+	case 0x00:
+	  tim_scaler = val & 0xffff;
+	  break;
+	case 0x04:
+	  tim_scaler_reload = val & 0xffff;
+	  break;
+	case 0x08:
+	  //  Only DF (disable freeze) is writable.
+	  tim_config = (tim_config & ~0x200U) | (val & 0x200);
+	  break;
+	}
+      if (off >= 0x10 && off < 0x10 * (ntimers + 1))
+	{
+	  unsigned int n = (off >> 4) - 1;
+
+	  switch (off & 0xc)
+	    {
+	    case 0x0:
+	      tim_counter[n] = val;
+	      break;
+	    case 0x4:
+	      tim_reload[n] = val;
+	      break;
+	    case 0x8:
+	      tim_ctrl[n] = (tim_ctrl[n] & TIM_IP)
+		| (val & (TIM_EN | TIM_RS | TIM_IE | TIM_CH));
+	      //  IP is cleared by writing 1.
+	      if (val & TIM_IP)
+		tim_ctrl[n] &= ~TIM_IP;
+	      if (val & TIM_LD)
+		tim_counter[n] = tim_reload[n];
+	      break;
+	    }
+	}
+      break;
+    }
+}
+
+void
+sim_board::uart_tx (word c)
+{
+  if (uart_txf.size () >= uart_fifo_len)
+    return;
+
+  //  In debug mode (or if the transmitter is disabled), the characters
+  //  stay in the FIFO.
+  if ((uart_ctrl & (1 << 11)) || !(uart_ctrl & 2))
+    uart_txf.push_back (c);
+  else
+    cout << char (c) << flush;
+}
+
+void
+sim_board::raise_irq (unsigned int irq)
+{
+  irq_pending |= 1 << irq;
+}
+
+int
+sim_board::irl (void)
+{
+  word p = (irq_pending | irq_force) & irq_mask;
+
+  //  Interrupts of level 1 have priority.
+  if (p & irq_level)
+    p &= irq_level;
+  for (int i = 15; i > 0; i--)
+    if ((p >> i) & 1)
+      return i;
+  return 0;
+}
+
+void
+sim_board::timers_tick (unsigned long ncycles)
+{
+  while (ncycles > 0)
+    {
+      if (ncycles <= tim_scaler)
+	{
+	  tim_scaler -= ncycles;
+	  return;
+	}
+      ncycles -= tim_scaler + 1;
+      tim_scaler = tim_scaler_reload;
+
+      //  The prescaler underflows: decrement the timers.
+      bool prev_uf = false;
+      for (unsigned int i = 0; i < ntimers; i++)
+	{
+	  bool uf = false;
+
+	  if ((tim_ctrl[i] & TIM_EN)
+	      && (!(tim_ctrl[i] & TIM_CH) || prev_uf))
+	    {
+	      if (tim_counter[i] == 0)
+		{
+		  uf = true;
+		  if (tim_ctrl[i] & TIM_IE)
+		    {
+		      tim_ctrl[i] |= TIM_IP;
+		      //  Separate interrupts.
+		      raise_irq (((tim_config >> 3) & 0x1f) + i);
+		    }
+		  if (tim_ctrl[i] & TIM_RS)
+		    tim_counter[i] = tim_reload[i];
+		  else
+		    tim_ctrl[i] &= ~TIM_EN;
+		}
+	      else
+		tim_counter[i]--;
+	    }
+	  prev_uf = uf;
+	}
+    }
+}
+
+word
+sim_board::dsu_read (word off)
+{
+  if (off >= INSTR_TB && off < INSTR_TB + itrace_len * 16)
+    return itrace[(off - INSTR_TB) >> 4][(off >> 2) & 3];
+  if (off >= AHB_TB && off < AHB_TB + ahbtrace_len * 16)
+    return ahbtrace[(off - AHB_TB) >> 4][(off >> 2) & 3];
+  if (off >= IU_REGS && off < IU_REGS + sizeof (iu))
+    return iu[(off - IU_REGS) >> 2];
+  if (off >= ASI_DIAG && off < ASI_DIAG + 0x100000)
+    return asi_read (dsu_asi, off - ASI_DIAG);
+  if (off >= ASR24 && off < ASR24 + 4 * 4)
+    return wp_read (24 + ((off - ASR24) >> 2));
+
+  switch (off)
+    {
+    case CTRL:
+      return dsu_ctrl
+	| (debug ? CTRL_DM : 0)
+	| (error ? CTRL_PE : 0)
+	| (powerdown ? CTRL_HL | CTRL_PW : 0);
+    case TIME:
+      return time;
+    case BREAK:
+      return (sstep ? 1 << 16 : 0) | (debug ? 1 : 0);
+    case MASK:
+      return dsu_mask;
+    case AHB_TB_CTRL:
+      return ahb_tb_ctrl;
+    case AHB_TB_INDEX:
+      return ahb_tb_index;
+    case AHB_TB_FILTER_CTRL:
+      return ahb_tb_filter_ctrl;
+    case AHB_TB_FILTER_MASK:
+      return ahb_tb_filter_mask;
+    case AHB_BP_ADDR1:
+    case AHB_BP_MASK1:
+    case AHB_BP_ADDR2:
+    case AHB_BP_MASK2:
+      return ahb_bp[(off - AHB_BP_ADDR1) >> 2];
+    case INSTR_COUNT:
+      return insn_count;
+    case INSTR_TB_CTRL0:
+      return itrace_ptr;
+    case INSTR_TB_CTRL1:
+      return itrace_ctrl1;
+    case Y:
+      return y;
+    case PSR:
+      return get_psr ();
+    case WIM:
+      return wim;
+    case TBR:
+      return tbr;
+    case PC:
+      return pc;
+    case NPC:
+      return npc;
+    case DSU_TRAP:
+      return dsu_trap;
+    case DSU_ASI:
+      return dsu_asi;
+    case ASR17:
+      return asr17_val | (nwin - 1);
+    default:
+      return 0;
+    }
+}
+
+void
+sim_board::dsu_write (word off, word val)
+{
+  if (off >= INSTR_TB && off < INSTR_TB + itrace_len * 16)
+    itrace[(off - INSTR_TB) >> 4][(off >> 2) & 3] = val;
+  else if (off >= AHB_TB && off < AHB_TB + ahbtrace_len * 16)
+    ahbtrace[(off - AHB_TB) >> 4][(off >> 2) & 3] = val;
+  else if (off >= IU_REGS && off < IU_REGS + sizeof (iu))
+    {
+      iu[(off - IU_REGS) >> 2] = val;
+      //  %g0
+      iu[nwin * 16] = 0;
+    }
+  else if (off >= ASI_DIAG && off < ASI_DIAG + 0x100000)
+    asi_write (dsu_asi, off - ASI_DIAG, val);
+  else if (off >= ASR24 && off < ASR24 + 4 * 4)
+    wp_write (24 + ((off - ASR24) >> 2), val);
+
+  switch (off)
+    {
+    case CTRL:
+      dsu_ctrl = val & dsu_ctrl_mask;
+      //  Writing PE clears the error mode.
+      if (val & CTRL_PE)
+	error = false;
+      if (val & CTRL_HL)
+	powerdown = true;
+      break;
+    case TIME:
+      time = val;
+      break;
+    case BREAK:
+      sstep = (val >> 16) & 1;
+      if (val & 1)
+	{
+	  //  Break now.
+	  if (!debug && (dsu_ctrl & CTRL_BW))
+	    enter_debug ();
+	}
+      else if (debug)
+	resume ();
+      break;
+    case MASK:
+      dsu_mask = val & 0x00010001;
+      break;
+    case AHB_TB_CTRL:
+      ahb_tb_ctrl = val;
+      break;
+    case AHB_TB_INDEX:
+      ahb_tb_index = val & ((ahbtrace_len - 1) << 4);
+      break;
+    case AHB_TB_FILTER_CTRL:
+      ahb_tb_filter_ctrl = val;
+      break;
+    case AHB_TB_FILTER_MASK:
+      ahb_tb_filter_mask = val;
+      break;
+    case AHB_BP_ADDR1:
+    case AHB_BP_MASK1:
+    case AHB_BP_ADDR2:
+    case AHB_BP_MASK2:
+      ahb_bp[(off - AHB_BP_ADDR1) >> 2] = val;
+      break;
+    case INSTR_TB_CTRL0:
+      //  Only writable while the trace is disabled.
+      if (!(dsu_ctrl & CTRL_TE))
+	itrace_ptr = val & (itrace_len - 1);
+      break;
+    case INSTR_TB_CTRL1:
+      itrace_ctrl1 = val;
+      break;
+    case Y:
+      y = val;
+      break;
+    case PSR:
+      set_psr (val);
+      break;
+    case WIM:
+      wim = val & ((1 << nwin) - 1);
+      break;
+    case TBR:
+      tbr = val & ~0xfU;
+      break;
+    case PC:
+      pc = val & ~3U;
+      break;
+    case NPC:
+      npc = val & ~3U;
+      break;
+    case DSU_ASI:
+      dsu_asi = val & 0xff;
+      break;
+    }
+}
+
+word
+sim_board::asi_read (word asi, word off)
+{
+  if (asi == 2)
+    switch (off)
+      {
+      case 0x00:
+	return ccr;
+      case 0x08:
+      case 0x0c:
+	return cache_cfg;
+      }
+
+  //  The caches are not modeled: the tags are always invalid.
+  return 0;
+}
+
+void
+sim_board::asi_write (word asi, word off, word val)
+{
+  //  Flushes complete at once.
+  if (asi == 2 && off == 0)
+    ccr = val & ccr_mask;
+}
+
+word
+sim_board::wp_read (unsigned int asr)
+{
+  unsigned int n = (asr - 24) >> 1;
+
+  if (n >= 2)
+    return 0;
+  return (asr & 1) ? wp_mask[n] : wp_addr[n];
+}
+
+void
+sim_board::wp_write (unsigned int asr, word val)
+{
+  unsigned int n = (asr - 24) >> 1;
+
+  if (n >= 2)
+    return;
+  if (asr & 1)
+    wp_mask[n] = val;
+  else
+    wp_addr[n] = val;
+}
+
+word &
+sim_board::gpr (unsigned int n)
+{
+  if (n < 8)
+    return iu[nwin * 16 + n];
+  return iu[(cwp * 16 + n) % (nwin * 16)];
+}
+
+word
+sim_board::get_psr (void)
+{
+  //  LEON: impl 0xf, version 3.
+  return 0xf3000000
+    | (icc_n << 23) | (icc_z << 22) | (icc_v << 21) | (icc_c << 20)
+    | (pil << 8) | (s << 7) | (ps << 6) | (et << 5) | cwp;
+}
+
+void
+sim_board::set_psr (word val)
+{
+  icc_n = (val >> 23) & 1;
+  icc_z = (val >> 22) & 1;
+  icc_v = (val >> 21) & 1;
+  icc_c = (val >> 20) & 1;
+  pil = (val >> 8) & 0xf;
+  s = (val >> 7) & 1;
+  ps = (val >> 6) & 1;
+  et = (val >> 5) & 1;
+  cwp = (val & 0x1f) % nwin;
+}
+
+void
+sim_board::set_icc (bool n, bool z, bool v, bool c)
+{
+  icc_n = n;
+  icc_z = z;
+  icc_v = v;
+  icc_c = c;
+}
+
+bool
+sim_board::cond (unsigned int c)
+{
+  bool res;
+
+  switch (c & 7)
+    {
+    case 0:
+      res = false;
+      break;
+    case 1:
+      res = icc_z;
+      break;
+    case 2:
+      res = icc_z || (icc_n != icc_v);
+      break;
+    case 3:
+      res = icc_n != icc_v;
+      break;
+    case 4:
+      res = icc_c || icc_z;
+      break;
+    case 5:
+      res = icc_c;
+      break;
+    case 6:
+      res = icc_n;
+      break;
+    default:
+      res = icc_v;
+      break;
+    }
+  return (c & 8) ? !res : res;
+}
+
+void
+sim_board::enter_debug (void)
+{
+  debug = true;
+  powerdown = false;
+}
+
+void
+sim_board::resume (void)
+{
+  debug = false;
+  error = false;
+}
+
+void
+sim_board::trap (unsigned int tt)
+{
+  bool intr = tt > 0x10 && tt < 0x20;
+  bool brk = (dsu_ctrl & CTRL_BX) != 0;
+
+  //  Software breakpoint (ta 1).
+  if (tt == 0x81 && (dsu_ctrl & CTRL_BS))
+    brk = true;
+  if (tt == 0x0b && (dsu_ctrl & CTRL_BW))
+    brk = true;
+  //  Error traps.
+  if ((dsu_ctrl & CTRL_BZ)
+      && !(tt == 0x03 || tt == 0x04 || tt == 0x05 || tt == 0x06
+	   || intr || tt >= 0x80))
+    brk = true;
+
+  if (brk)
+    {
+      //  The trap is not taken: pc is the trapped instruction.
+      dsu_trap = tt << 4;
+      enter_debug ();
+      return;
+    }
+
+  if (!et)
+    {
+      error = true;
+      dsu_trap = (1 << 12) | (tt << 4);
+      if (dsu_ctrl & CTRL_BE)
+	enter_debug ();
+      return;
+    }
+
+  if (intr)
+    {
+      //  Acknowledge the interrupt.
+      word bit = 1 << (tt - 0x10);
+
+      if (irq_force & bit)
+	irq_force &= ~bit;
+      else
+	irq_pending &= ~bit;
+    }
+
+  et = false;
+  ps = s;
+  s = true;
+  cwp = (cwp + nwin - 1) % nwin;
+  gpr (17) = pc;
+  gpr (18) = npc;
+  tbr = (tbr & 0xfffff000) | (tt << 4);
+  pc = tbr;
+  npc = pc + 4;
+}
+
+bool
+sim_board::data_watch (word addr, bool store)
+{
+  for (unsigned int i = 0; i < 2; i++)
+    {
+      //  DS (bit 0) and DL (bit 1) of the mask enable store and load
+      //  watchpoints.
+      if (!(wp_mask[i] & (store ? 1 : 2)))
+	continue;
+      if (((addr ^ wp_addr[i]) & wp_mask[i] & ~3U) == 0)
+	return true;
+    }
+  return false;
+}
+
+void
+sim_board::ahb_trace (word addr, unsigned int sz, word val, bool write)
+{
+  //  The cpu is master 0.
+  if (!(ahb_tb_ctrl & TBCR_EN) || (ahb_tb_filter_mask & 1))
+    return;
+
+  word *e = ahbtrace[ahb_tb_index >> 4];
+  word hsize = sz == 4 ? 2 : sz == 2 ? 1 : 0;
+
+  e[0] = time & 0x7fffffff;
+  //  Non sequential single transfer.
+  e[1] = (write << 15) | (2 << 13) | (hsize << 10);
+  e[2] = val << ((4 - sz - (addr & 3)) * 8);
+  e[3] = addr;
+  ahb_tb_index = (ahb_tb_index + 16) & ((ahbtrace_len - 1) << 4);
+}
+
+bool
+sim_board::load (word addr, unsigned int sz, word *val)
+{
+  if (!bus_read (addr, sz, val))
+    return false;
+  ahb_trace (addr, sz, *val, false);
+  return true;
+}
+
+bool
+sim_board::store (word addr, unsigned int sz, word val)
+{
+  if (!bus_write (addr, sz, val))
+    return false;
+  ahb_trace (addr, sz, val, true);
+  return true;
+}
+
+unsigned int
+sim_board::exec_alu (word insn, word &next_npc)
+{
+  unsigned int op3 = (insn >> 19) & 0x3f;
+  unsigned int rd = (insn >> 25) & 0x1f;
+  word a = gpr ((insn >> 14) & 0x1f);
+  word b = (insn & 0x2000) ? sext (insn, 13) : gpr (insn & 0x1f);
+  word res;
+
+  if (op3 < 0x20 || (op3 >= 0x20 && op3 <= 0x24))
+    {
+      bool cc = (op3 & 0x10) != 0 || op3 >= 0x20;
+      bool v = false;
+      bool c = false;
+      bool add = false;
+      bool sub = false;
+
+      switch (op3 < 0x20 ? op3 & 0xf : op3)
+	{
+	case 0x0:
+	  res = a + b;
+	  add = true;
+	  break;
+	case 0x1:
+	  res = a & b;
+	  break;
+	case 0x2:
+	  res = a | b;
+	  break;
+	case 0x3:
+	  res = a ^ b;
+	  break;
+	case 0x4:
+	  res = a - b;
+	  sub = true;
+	  break;
+	case 0x5:
+	  res = a & ~b;
+	  break;
+	case 0x6:
+	  res = a | ~b;
+	  break;
+	case 0x7:
+	  res = ~(a ^ b);
+	  break;
+	case 0x8:
+	  res = a + b + icc_c;
+	  add = true;
+	  break;
+	case 0xa:
+	  {
+	    uint64_t p = (uint64_t)a * b;
+
+	    y = p >> 32;
+	    res = p;
+	  }
+	  break;
+	case 0xb:
+	  {
+	    int64_t p = (int64_t)(sword)a * (sword)b;
+
+	    y = (uint64_t)p >> 32;
+	    res = p;
+	  }
+	  break;
+	case 0xc:
+	  res = a - b - icc_c;
+	  sub = true;
+	  break;
+	case 0xe:
+	  {
+	    if (b == 0)
+	      return 0x2a;
+	    uint64_t q = (((uint64_t)y << 32) | a) / b;
+
+	    v = q > 0xffffffffU;
+	    res = v ? 0xffffffffU : q;
+	  }
+	  break;
+	case 0xf:
+	  {
+	    if (b == 0)
+	      return 0x2a;
+	    int64_t n = (int64_t)(((uint64_t)y << 32) | a);
+	    int64_t q;
+
+	    if (n == INT64_MIN && (sword)b == -1)
+	      q = INT64_MAX;
+	    else
+	      q = n / (sword)b;
+	    v = q > INT32_MAX || q < INT32_MIN;
+	    res = q > INT32_MAX ? 0x7fffffffU : q < INT32_MIN ? 0x80000000U : q;
+	  }
+	  break;
+	case 0x20:
+	case 0x22:
+	  //  taddcc, taddcctv
+	  res = a + b;
+	  add = true;
+	  break;
+	case 0x21:
+	case 0x23:
+	  //  tsubcc, tsubcctv
+	  res = a - b;
+	  sub = true;
+	  break;
+	case 0x24:
+	  {
+	    //  mulscc
+	    word op1 = (a >> 1) | ((word)(icc_n != icc_v) << 31);
+	    word op2 = (y & 1) ? b : 0;
+
+	    y = (y >> 1) | (a << 31);
+	    a = op1;
+	    b = op2;
+	    res = a + b;
+	    add = true;
+	  }
+	  break;
+	default:
+	  return 0x02;
+	}
+
+      if (add)
+	{
+	  v = ((a & b & ~res) | (~a & ~b & res)) >> 31;
+	  c = ((a & b) | ((a | b) & ~res)) >> 31;
+	}
+      else if (sub)
+	{
+	  v = ((a & ~b & ~res) | (~a & b & res)) >> 31;
+	  c = ((~a & b) | (~(a ^ b) & res)) >> 31;
+	}
+      if (op3 >= 0x20 && op3 <= 0x23 && ((a | b) & 3) != 0)
+	{
+	  //  Tag overflow.
+	  if (op3 & 2)
+	    return 0x0a;
+	  v = true;
+	}
+      if (cc)
+	set_icc (res >> 31, res == 0, v, c);
+    }
+  else
+    switch (op3)
+      {
+      case 0x25:
+	res = a << (b & 31);
+	break;
+      case 0x26:
+	res = a >> (b & 31);
+	break;
+      case 0x27:
+	res = (sword)a >> (b & 31);
+	break;
+      case 0x28:
+	switch ((insn >> 14) & 0x1f)
+	  {
+	  case 0:
+	    res = y;
+	    break;
+	  case 15:
+	    //  stbar
+	    return 0;
+	  case 17:
+	    res = asr17_val | (nwin - 1);
+	    break;
+	  default:
+	    res = wp_read ((insn >> 14) & 0x1f);
+	    break;
+	  }
+	break;
+      case 0x29:
+	if (!s)
+	  return 0x03;
+	res = get_psr ();
+	break;
+      case 0x2a:
+	if (!s)
+	  return 0x03;
+	res = wim;
+	break;
+      case 0x2b:
+	if (!s)
+	  return 0x03;
+	res = tbr;
+	break;
+      case 0x30:
+	switch (rd)
+	  {
+	  case 0:
+	    y = a ^ b;
+	    break;
+	  case 19:
+	    //  Power-down until the next interrupt.
+	    powerdown = true;
+	    break;
+	  default:
+	    wp_write (rd, a ^ b);
+	    break;
+	  }
+	return 0;
+      case 0x31:
+	if (!s)
+	  return 0x03;
+	if (((a ^ b) & 0x1f) >= nwin)
+	  return 0x02;
+	set_psr (a ^ b);
+	return 0;
+      case 0x32:
+	if (!s)
+	  return 0x03;
+	wim = (a ^ b) & ((1 << nwin) - 1);
+	return 0;
+      case 0x33:
+	if (!s)
+	  return 0x03;
+	tbr = ((a ^ b) & 0xfffff000) | (tbr & 0xff0);
+	return 0;
+      case 0x34:
+      case 0x35:
+	//  fp_disabled
+	return 0x04;
+      case 0x36:
+      case 0x37:
+	//  cp_disabled
+	return 0x24;
+      case 0x38:
+	//  jmpl
+	if ((a + b) & 3)
+	  return 0x07;
+	res = pc;
+	next_npc = a + b;
+	break;
+      case 0x39:
+	{
+	  //  rett
+	  word ncwp = (cwp + 1) % nwin;
+
+	  if (!s)
+	    return 0x03;
+	  if (et)
+	    return 0x02;
+	  if ((wim >> ncwp) & 1)
+	    return 0x06;
+	  if ((a + b) & 3)
+	    return 0x07;
+	  cwp = ncwp;
+	  et = true;
+	  s = ps;
+	  next_npc = a + b;
+	  return 0;
+	}
+      case 0x3a:
+	//  Ticc
+	if (cond (rd))
+	  return 0x80 + ((a + b) & 0x7f);
+	return 0;
+      case 0x3b:
+	//  flush
+	return 0;
+      case 0x3c:
+      case 0x3d:
+	{
+	  //  save, restore
+	  word ncwp = op3 == 0x3c ? (cwp + nwin - 1) % nwin : (cwp + 1) % nwin;
+
+	  if ((wim >> ncwp) & 1)
+	    return op3 == 0x3c ? 0x05 : 0x06;
+	  res = a + b;
+	  cwp = ncwp;
+	}
+	break;
+      default:
+	return 0x02;
+      }
+
+  gpr (rd) = res;
+  result = res;
+  return 0;
+}
+
+unsigned int
+sim_board::exec_mem (word insn)
+{
+  unsigned int op3 = (insn >> 19) & 0x3f;
+  unsigned int rd = (insn >> 25) & 0x1f;
+  word addr = gpr ((insn >> 14) & 0x1f)
+    + ((insn & 0x2000) ? sext (insn, 13) : gpr (insn & 0x1f));
+  unsigned int sz;
+  bool st = false;
+
+  //  Floating point and coprocessor loads and stores.
+  if (op3 >= 0x30)
+    return 0x24;
+  if (op3 >= 0x20)
+    return 0x04;
+
+  if (op3 & 0x10)
+    {
+      word asi = (insn >> 5) & 0xff;
+
+      if (!s)
+	return 0x03;
+      if (insn & 0x2000)
+	return 0x02;
+      switch (asi)
+	{
+	case 0x02:
+	  //  Cache control registers.
+	  if (op3 == 0x10)
+	    result = gpr (rd) = asi_read (asi, addr);
+	  else if (op3 == 0x14)
+	    asi_write (asi, addr, gpr (rd));
+	  else
+	    return 0x02;
+	  return 0;
+	case 0x0c:
+	case 0x0d:
+	case 0x0e:
+	case 0x0f:
+	case 0x10:
+	case 0x11:
+	case 0x18:
+	case 0x19:
+	  //  Cache tags, data and flushes: not modeled.
+	  if (op3 == 0x10)
+	    result = gpr (rd) = 0;
+	  return 0;
+	}
+      //  Other ASIs access the memory.
+    }
+
+  switch (op3 & 0xf)
+    {
+    case 0x0:
+    case 0x3:
+    case 0x4:
+    case 0x7:
+    case 0xf:
+      sz = 4;
+      break;
+    case 0x1:
+    case 0x5:
+    case 0x9:
+    case 0xd:
+      sz = 1;
+      break;
+    case 0x2:
+    case 0x6:
+    case 0xa:
+      sz = 2;
+      break;
+    default:
+      return 0x02;
+    }
+  switch (op3 & 0xf)
+    {
+    case 0x3:
+    case 0x7:
+      //  ldd, std
+      if (rd & 1)
+	return 0x02;
+      if (addr & 7)
+	return 0x07;
+      break;
+    default:
+      if (addr & (sz - 1))
+	return 0x07;
+      break;
+    }
+  switch (op3 & 0xf)
+    {
+    case 0x4:
+    case 0x5:
+    case 0x6:
+    case 0x7:
+    case 0xd:
+    case 0xf:
+      st = true;
+      break;
+    }
+
+  if (data_watch (addr, st) || (st && (op3 & 0xf) >= 0xd
+				&& data_watch (addr, false)))
+    return 0x0b;
+
+  word val;
+  switch (op3 & 0xf)
+    {
+    case 0x0:
+    case 0x1:
+    case 0x2:
+      if (!load (addr, sz, &val))
+	return 0x09;
+      break;
+    case 0x9:
+    case 0xa:
+      if (!load (addr, sz, &val))
+	return 0x09;
+      val = sext (val, sz * 8);
+      break;
+    case 0x3:
+      {
+	word val1;
+
+	if (!load (addr, 4, &val) || !load (addr + 4, 4, &val1))
+	  return 0x09;
+	gpr (rd + 1) = val1;
+      }
+      break;
+    case 0x4:
+    case 0x5:
+    case 0x6:
+      if (!store (addr, sz, gpr (rd)))
+	return 0x09;
+      result = gpr (rd);
+      return 0;
+    case 0x7:
+      if (!store (addr, 4, gpr (rd)) || !store (addr + 4, 4, gpr (rd + 1)))
+	return 0x09;
+      result = gpr (rd);
+      return 0;
+    case 0xd:
+      //  ldstub
+      if (!load (addr, 1, &val) || !store (addr, 1, 0xff))
+	return 0x09;
+      break;
+    case 0xf:
+      //  swap
+      if (!load (addr, 4, &val) || !store (addr, 4, gpr (rd)))
+	return 0x09;
+      break;
+    }
+  gpr (rd) = val;
+  result = val;
+  return 0;
+}
+
+void
+sim_board::execute (void)
+{
+  word next_pc = npc;
+  word next_npc = npc + 4;
+  word insn = 0;
+  unsigned int tt = 0;
+  int level = irl ();
+
+  result = 0;
+  if (et && level != 0 && (level == 15 || (word)level > pil))
+    {
+      trap (0x10 + level);
+      return;
+    }
+
+  //  Instruction watchpoints (IF in the address).
+  for (unsigned int i = 0; i < 2; i++)
+    if ((wp_addr[i] & 1) && ((pc ^ wp_addr[i]) & wp_mask[i] & ~3U) == 0)
+      tt = 0x0b;
+
+  if (tt != 0)
+    ;
+  else if ((pc & 3) != 0 || !bus_read (pc, 4, &insn))
+    tt = 0x01;
+  else
+    switch (insn >> 30)
+      {
+      case 0:
+	switch ((insn >> 22) & 7)
+	  {
+	  case 2:
+	    {
+	      //  Bicc
+	      word target = pc + (sext (insn, 22) << 2);
+	      bool annul = (insn >> 29) & 1;
+	      unsigned int c = (insn >> 25) & 0xf;
+
+	      if (cond (c))
+		{
+		  if (c == 8 && annul)
+		    {
+		      next_pc = target;
+		      next_npc = target + 4;
+		    }
+		  else
+		    next_npc = target;
+		}
+	      else if (annul)
+		{
+		  next_pc = npc + 4;
+		  next_npc = npc + 8;
+		}
+	    }
+	    break;
+	  case 4:
+	    //  sethi
+	    result = gpr ((insn >> 25) & 0x1f) = insn << 10;
+	    break;
+	  case 6:
+	    tt = 0x04;
+	    break;
+	  case 7:
+	    tt = 0x24;
+	    break;
+	  default:
+	    tt = 0x02;
+	    break;
+	  }
+	break;
+      case 1:
+	//  call
+	result = gpr (15) = pc;
+	next_npc = pc + (insn << 2);
+	break;
+      case 2:
+	tt = exec_alu (insn, next_npc);
+	break;
+      case 3:
+	tt = exec_mem (insn);
+	break;
+      }
+  iu[nwin * 16] = 0;
+
+  if (dsu_ctrl & CTRL_TE)
+    {
+      word *e = itrace[itrace_ptr];
+
+      e[0] = time & 0x7fffffff;
+      e[1] = result;
+      e[2] = pc | (tt != 0 ? 2 : 0);
+      e[3] = insn;
+      itrace_ptr = (itrace_ptr + 1) & (itrace_len - 1);
+    }
+  insn_count++;
+
+  if (tt != 0)
+    trap (tt);
+  else
+    {
+      pc = next_pc;
+      npc = next_npc;
+    }
+}
+
+void
+sim_board::run (unsigned long ncycles)
+{
+  while (ncycles > 0 && !debug)
+    {
+      if (error)
+	return;
+      if (powerdown && irl () == 0)
+	{
+	  //  Wait for an interrupt.
+	  unsigned long n = ncycles < 1000 ? ncycles : 1000;
+
+	  timers_tick (n);
+	  time += n;
+	  ncycles -= n;
+	  continue;
+	}
+      powerdown = false;
+
+      execute ();
+      timers_tick (1);
+      time++;
+      ncycles--;
+
+      if (sstep)
+	enter_debug ();
+    }
+
+  //  Timers are frozen in debug mode, unless DF is set.
+  if (debug && (tim_config & 0x200))
+    timers_tick (ncycles);
+}
+
+//  Simulated link settings.
+unsigned int sim_latency = 0;
+unsigned int sim_mtu = 1024;
+
+//  Maximum time (in us) the board runs between two packets.
+static const unsigned int sim_max_run = 20000;
+
+class sim_dsu_link : public dsu_link
+{
+ public:
+  bool open (void);
+  void close (void);
+  unsigned get_max_len (void) { return sim_mtu; }
+  const char *get_name (void) { return "sim"; }
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+ private:
+  //  Start a packet of LEN data bytes: wait for the latency and let the
+  //  board run for the time elapsed since the previous packet.
+  bool packet (unsigned int len);
+  void trace (const char *pfx, word addr, const unsigned char *buf,
+	      unsigned int len);
+
+  sim_board *board = nullptr;
+  chrono::steady_clock::time_point last;
+};
+
+bool
+sim_dsu_link::open (void)
+{
+  //  Packets are made of words.
+  sim_mtu &= ~3U;
+  if (sim_mtu == 0)
+    sim_mtu = 4;
+  board = new sim_board;
+  last = chrono::steady_clock::now ();
+  if (trace_id < 0)
+    trace_id = trace_register (TRACE_DSU, get_name ());
+  return true;
+}
+
+void
+sim_dsu_link::close (void)
+{
+  delete board;
+  board = nullptr;
+}
+
+bool
+sim_dsu_link::packet (unsigned int len)
+{
+  if (len > sim_mtu)
+    {
+      cerr << "sim: packet of " << len << " bytes exceeds the mtu" << endl;
+      return false;
+    }
+  if (sim_latency != 0)
+    usleep (sim_latency);
+
+  auto now = chrono::steady_clock::now ();
+  unsigned long us = chrono::duration_cast<chrono::microseconds>
+    (now - last).count ();
+
+  last = now;
+  if (us > sim_max_run)
+    us = sim_max_run;
+  board->run (us * sim_board::mhz);
+  return true;
+}
+
+void
+sim_dsu_link::trace (const char *pfx, word addr, const unsigned char *buf,
+		     unsigned int len)
+{
+  cout << pfx << " addr=" << hex8 (addr) << ", len=" << hex4 (len) << endl;
+  for (unsigned int i = 0; i < len; i += 16)
+    {
+      cout << pfx << ":";
+      for (unsigned int j = i; j < len && j < i + 16; j++)
+	cout << " " << hex2 (buf[j]);
+      cout << endl;
+    }
+}
+
+bool
+sim_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  if (trace_id >= 0)
+    trace_dsu_cmd (trace_id, addr, nwords, false, nullptr);
+  if (!packet (nwords * 4) || !board->read (addr, nwords, res))
+    return false;
+  if (trace_com)
+    trace ("R", addr, res, nwords * 4);
+  if (trace_id >= 0)
+    trace_packet (trace_id, true, res, nwords * 4);
+  return true;
+}
+
+bool
+sim_dsu_link::do_write (word addr, unsigned int nwords,
+			const unsigned char *buf)
+{
+  if (trace_com)
+    trace ("W", addr, buf, nwords * 4);
+  if (trace_id >= 0)
+    trace_dsu_cmd (trace_id, addr, nwords, true, buf);
+  return packet (nwords * 4) && board->write (addr, nwords, buf);
+}
+
+dsu_link *
+create_sim_dsu_link (void)
+{
+  return new sim_dsu_link;
+}
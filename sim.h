@@ -0,0 +1,153 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <deque>
+#include <vector>
+
+#include "lemon.h"
+
+//  A simulated LEON4 board: an empty PROM, RAM, AHB and APB plug and play
+//  areas, a DSU4 with one cpu (executing the SPARC V8 integer instruction
+//  set), an APBUART, an IRQMP and a GPTIMER.
+//
+//  Memory map:
+//    0x00000000 - 0x000fffff  PROM (reads as 0, writes are ignored)
+//    0x40000000 - 0x43ffffff  RAM
+//    0x80000000 - 0x800fffff  APB (uart at 0x100, irqmp at 0x200,
+//                             gptimer at 0x300, plug and play at 0xff000)
+//    0x90000000 - 0x90ffffff  DSU4
+//    0xfffff000 - 0xffffffff  AHB plug and play
+class sim_board
+{
+ public:
+  sim_board (void);
+
+  //  Read or write NWORDS words at ADDR (data in target byte order), as
+  //  an AHB master different from the cpu.  The two low bits of ADDR are
+  //  ignored.  Return false if ADDR is not mapped.
+  bool read (word addr, unsigned int nwords, unsigned char *res);
+  bool write (word addr, unsigned int nwords, const unsigned char *buf);
+
+  //  Let the board run for NCYCLES clock cycles.  Stop early if the cpu
+  //  enters debug mode.
+  void run (unsigned long ncycles);
+
+  //  Clock frequency (in MHz).
+  static const unsigned int mhz = 50;
+
+  static const word rom_size = 1 << 20;
+  static const word ram_base = 0x40000000;
+  static const word ram_size = 64 << 20;
+ private:
+  static const unsigned int nwin = 8;
+  static const unsigned int itrace_len = 256;
+  static const unsigned int ahbtrace_len = 256;
+  static const unsigned int uart_fifo_len = 8;
+  static const unsigned int ntimers = 2;
+
+  //  Bus accesses of SZ bytes (1, 2 or 4).  Values are right-aligned.
+  bool bus_read (word addr, unsigned int sz, word *val);
+  bool bus_write (word addr, unsigned int sz, word val);
+
+  word dsu_read (word off);
+  void dsu_write (word off, word val);
+  word asi_read (word asi, word off);
+  void asi_write (word asi, word off, word val);
+  word apb_read (word addr);
+  void apb_write (word addr, word val);
+  word pnp_read (word addr);
+
+  //  Cpu.
+  word &gpr (unsigned int n);
+  word get_psr (void);
+  void set_psr (word val);
+  bool cond (unsigned int c);
+  void set_icc (bool n, bool z, bool v, bool c);
+  //  Highest pending interrupt level.
+  int irl (void);
+  //  Execute one instruction (or take an interrupt).
+  void execute (void);
+  //  Execute an arithmetic (resp. memory) instruction.  Return the trap
+  //  type, or 0.
+  unsigned int exec_alu (word insn, word &next_npc);
+  unsigned int exec_mem (word insn);
+  //  Take trap TT, or enter debug mode or error mode.
+  void trap (unsigned int tt);
+  bool data_watch (word addr, bool store);
+  void enter_debug (void);
+  void resume (void);
+  //  Data accesses of the cpu, which are recorded in the AHB trace.
+  bool load (word addr, unsigned int sz, word *val);
+  bool store (word addr, unsigned int sz, word val);
+  void ahb_trace (word addr, unsigned int sz, word val, bool write);
+  word wp_read (unsigned int asr);
+  void wp_write (unsigned int asr, word val);
+
+  //  Devices.
+  void raise_irq (unsigned int irq);
+  void timers_tick (unsigned long ncycles);
+  void uart_tx (word c);
+
+  std::vector<unsigned char> ram;
+
+  //  Time tag (incremented on each cycle the cpu is not in debug mode).
+  unsigned long long time = 0;
+
+  //  Cpu registers: the windows followed by the globals, in the same
+  //  layout as the DSU.
+  word iu[nwin * 16 + 8];
+  word y = 0, wim = 0, tbr = 0, pc = 0, npc = 4;
+  bool icc_n = false, icc_z = false, icc_v = false, icc_c = false;
+  word pil = 0, cwp = 0;
+  bool s = true, ps = false, et = false;
+  word wp_addr[2] = { 0, 0 };
+  word wp_mask[2] = { 0, 0 };
+  word ccr = 0;
+  word insn_count = 0;
+
+  //  Cpu state, as seen by the DSU.
+  bool debug = true;
+  bool error = false;
+  bool powerdown = false;
+  //  Single step: enter debug mode after the next instruction.
+  bool sstep = false;
+  //  Result of the current instruction, for the instruction trace.
+  word result = 0;
+
+  //  DSU registers.
+  word dsu_ctrl = 0;
+  word dsu_mask = 0;
+  word dsu_trap = 0;
+  word dsu_asi = 0;
+  word ahb_tb_ctrl = 0;
+  word ahb_tb_index = 0;
+  word ahb_tb_filter_ctrl = 0;
+  word ahb_tb_filter_mask = 0;
+  word ahb_bp[4] = { 0, 0, 0, 0 };
+  word itrace_ptr = 0;
+  word itrace_ctrl1 = 0;
+  word itrace[itrace_len][4];
+  word ahbtrace[ahbtrace_len][4];
+
+  //  APBUART.
+  std::deque<unsigned char> uart_txf;
+  std::deque<unsigned char> uart_rxf;
+  word uart_ctrl = 0;
+  word uart_scaler = 0;
+
+  //  IRQMP.
+  word irq_level = 0;
+  word irq_pending = 0;
+  word irq_force = 0;
+  word irq_mask = 0;
+
+  //  GPTIMER.
+  word tim_scaler = 0;
+  word tim_scaler_reload = 0;
+  word tim_config = 0;
+  word tim_counter[ntimers];
+  word tim_reload[ntimers];
+  word tim_ctrl[ntimers];
+};
+
+#endif /* SIM_H_ */
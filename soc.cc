@@ -5,6 +5,41 @@
 #include "devices.h"
 #include "soc.h"
 
+word
+bar_to_base (word bar, word bus_base)
+{
+  word addr = bar >> 20;
+
+  switch (bar_to_typ (bar))
+    {
+    case BAR_AHB_MEM:
+      return addr << 20;
+    case BAR_AHB_IO:
+    case BAR_APB_IO:
+      return bus_base + (addr << 8);
+    default:
+      return bad_base;
+    }
+}
+
+word
+bar_to_last (word bar, word bus_base)
+{
+  word addr = bar >> 20;
+  word mask = (~bar >> 4) & 0xfff;
+
+  switch (bar_to_typ (bar))
+    {
+    case BAR_AHB_MEM:
+      return ((addr | mask) << 20) | 0xfffff;
+    case BAR_AHB_IO:
+    case BAR_APB_IO:
+      return bus_base | ((addr | mask) << 8) | 0xff;
+    default:
+      return bad_base;
+    }
+}
+
 static void
 disp_bar (word bar, word base)
 {
@@ -76,17 +111,20 @@ apb_ctrl::probe (void)
 {
   clog << "probing apb at " << hex << base << endl;
 
+  //  Read the whole table at once, the link splits it in packets.
+  unsigned char table[16 * 8];
+
+  if (!get_link ()->read_bytes (base + 0xff000, sizeof (table), table))
+    {
+      cerr << "cannot read" << endl;
+      return;
+    }
+
   for (int j = 0; j < 16; j++)
     {
-      unsigned char data[8];
+      unsigned char *data = table + (j << 3);
       apb_pnp pnp;
 
-      if (!get_link ()->read (base + 0xff000 + (j << 3), 2, data))
-	{
-	  cerr << "cannot read" << endl;
-	  return;
-	}
-
       pnp.id = unpack_be32 (data);
       if (pnp.id == 0)
 	continue;
@@ -136,17 +174,20 @@ ahb_ctrl::probe (void)
 {
   clog << "probing ahb at " << hex << base << endl;
 
+  //  Read the whole table at once, the link splits it in packets.
+  unsigned char table[128 * 32];
+
+  if (!get_link ()->read_bytes (base + 0xff000, sizeof (table), table))
+    {
+      cerr << "cannot read" << endl;
+      return;
+    }
+
   for (int j = 0; j < 128; j++)
     {
-      unsigned char data[32];
+      unsigned char *data = table + (j << 5);
       ahb_pnp pnp;
 
-      if (!get_link ()->read (base + 0xff000 + (j << 5), 8, data))
-	{
-	  cerr << "cannot read" << endl;
-	  return;
-	}
-
       pnp.id = unpack_be32 (data);
       if (pnp.id == 0)
 	continue;
@@ -176,11 +217,20 @@ ahb_ctrl::probe (void)
 
 	  if (base != bad_base)
 	    {
+	      //  Registers of all the apb devices.
+	      get_link ()->add_io_range
+		(base, bar_to_last (pnp.bar[0], this->base));
 	      if (!parent->bus_already_known (base))
 		parent->append (new apb_ctrl (parent, base));
 	    }
 	}
 
+      for (int i = 0; i < 4; i++)
+	if (bar_to_typ (pnp.bar[i]) == BAR_AHB_IO)
+	  get_link ()->add_io_range
+	    (bar_to_base (pnp.bar[i], this->base),
+	     bar_to_last (pnp.bar[i], this->base));
+
       this->append (new ahb_device (pnp, j, this));
     }
 }
@@ -27,6 +27,9 @@ public:
   void append (bus *b) { buses.push_back (b); }
   void append (device *dev) { all_devices.push_back (dev); }
 
+  //  Get the buses (after probe, all of them).
+  const list<bus *> &get_buses (void) { return buses; }
+
   //  Get all devices that were probed.
   list<device *> get_devices(void) { return all_devices; }
 
@@ -0,0 +1,223 @@
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "links.h"
+
+using namespace std;
+
+//  A dsu_link over several links to the same board.  Large memory transfers
+//  are split between the links, proportionally to their bandwidth (measured
+//  on the previous transfers), and the parts are done in parallel.  All the
+//  other transfers (small ones and I/O areas) are done on the primary link
+//  (the first one), so that they stay ordered.
+class stripe_dsu_link : public dsu_link
+{
+ public:
+  stripe_dsu_link (const vector<dsu_link *> &links) :
+    links (links), bw (links.size (), 0.0) {}
+  bool open (void);
+  void close (void);
+  unsigned get_max_len (void) { return links[0]->get_max_len (); }
+  link_constraints get_constraints (void)
+  {
+    return links[0]->get_constraints ();
+  }
+  const char *get_name (void) { return "stripe"; }
+  dsu_link *get_next (void) { return links[0]; }
+  dsu_link *get_branch (unsigned int i)
+  {
+    return i < links.size () ? links[i] : nullptr;
+  }
+  void invalidate (void);
+  void add_io_range (word first, word last);
+ protected:
+  bool do_read (word addr, unsigned int nwords, unsigned char *res);
+  bool do_write (word addr, unsigned int nwords, const unsigned char *buf);
+  bool do_transact (dsu_xfer *xfers, unsigned int n);
+ private:
+  //  Transfers smaller than that (in bytes) are not split.
+  static const unsigned int stripe_min = 16 << 10;
+  //  Parts are multiple of this size (in bytes).
+  static const unsigned int stripe_unit = 1024;
+
+  bool is_io (word addr, unsigned int len);
+  bool stripe (const dsu_xfer &x);
+
+  vector<dsu_link *> links;
+  //  Measured bandwidth of each link (in bytes per us), 0 if unknown.
+  vector<double> bw;
+  vector<pair<word, word>> io_ranges;
+};
+
+bool
+stripe_dsu_link::open (void)
+{
+  for (unsigned int i = 0; i < links.size (); i++)
+    if (!links[i]->open ())
+      {
+	while (i-- > 0)
+	  links[i]->close ();
+	return false;
+      }
+  return true;
+}
+
+void
+stripe_dsu_link::close (void)
+{
+  for (auto l : links)
+    l->close ();
+}
+
+void
+stripe_dsu_link::invalidate (void)
+{
+  for (auto l : links)
+    l->invalidate ();
+}
+
+void
+stripe_dsu_link::add_io_range (word first, word last)
+{
+  io_ranges.push_back (make_pair (first, last));
+  for (auto l : links)
+    l->add_io_range (first, last);
+}
+
+bool
+stripe_dsu_link::is_io (word addr, unsigned int len)
+{
+  word last = addr + len - 1;
+
+  for (auto &r : io_ranges)
+    if (addr <= r.second && last >= r.first)
+      return true;
+  return false;
+}
+
+bool
+stripe_dsu_link::stripe (const dsu_xfer &x)
+{
+  unsigned int n = links.size ();
+  unsigned int len = x.nwords * 4;
+  unsigned int units = len / stripe_unit;
+  vector<dsu_xfer> parts (n);
+  vector<char> ok (n);
+  vector<double> us (n);
+  double total = 0;
+
+  //  Links not yet measured get the average bandwidth (or the same share if
+  //  none is known).
+  double avg = 0;
+  unsigned int nknown = 0;
+  for (double b : bw)
+    if (b != 0)
+      {
+	avg += b;
+	nknown++;
+      }
+  avg = nknown ? avg / nknown : 1.0;
+  for (double b : bw)
+    total += b != 0 ? b : avg;
+
+  //  Split in parts, the primary link gets the remainder.
+  word off = 0;
+  for (unsigned int i = n; i-- > 0; )
+    {
+      unsigned int plen;
+
+      if (i == 0)
+	plen = len - off;
+      else
+	plen = (unsigned int)(units * ((bw[i] != 0 ? bw[i] : avg) / total))
+	  * stripe_unit;
+      parts[i] = { x.addr + off, plen / 4, x.buf + off, x.is_write };
+      off += plen;
+    }
+
+  auto run = [&](unsigned int i)
+    {
+      auto start = chrono::steady_clock::now ();
+
+      ok[i] = links[i]->transact (&parts[i], 1);
+      us[i] = chrono::duration<double, micro>
+	(chrono::steady_clock::now () - start).count ();
+    };
+
+  vector<thread> threads;
+  for (unsigned int i = 1; i < n; i++)
+    if (parts[i].nwords != 0)
+      threads.push_back (thread (run, i));
+  run (0);
+  for (auto &t : threads)
+    t.join ();
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      if (parts[i].nwords == 0)
+	continue;
+      if (!ok[i])
+	{
+	  //  Do the part again on the primary link, and forget the bandwidth
+	  //  of the failing link so that it gets an average share.
+	  bw[i] = 0;
+	  if (i == 0 || !links[0]->transact (&parts[i], 1))
+	    return false;
+	  continue;
+	}
+      double b = parts[i].nwords * 4 / (us[i] > 1 ? us[i] : 1);
+      bw[i] = bw[i] == 0 ? b : (3 * bw[i] + b) / 4;
+    }
+  return true;
+}
+
+bool
+stripe_dsu_link::do_transact (dsu_xfer *xfers, unsigned int n)
+{
+  //  First transfer not yet done.
+  unsigned int first = 0;
+
+  for (unsigned int i = 0; i < n; i++)
+    {
+      unsigned int len = xfers[i].nwords * 4;
+
+      if (len < stripe_min || is_io (xfers[i].addr, len))
+	continue;
+
+      //  Do the previous transfers on the primary link, then split this
+      //  one.
+      if (i > first && !links[0]->transact (xfers + first, i - first))
+	return false;
+      if (!stripe (xfers[i]))
+	return false;
+      first = i + 1;
+    }
+  if (n > first && !links[0]->transact (xfers + first, n - first))
+    return false;
+  return true;
+}
+
+bool
+stripe_dsu_link::do_read (word addr, unsigned int nwords, unsigned char *res)
+{
+  dsu_xfer x = { addr, nwords, res, false };
+
+  return do_transact (&x, 1);
+}
+
+bool
+stripe_dsu_link::do_write (word addr, unsigned int nwords,
+			   const unsigned char *buf)
+{
+  dsu_xfer x = { addr, nwords, const_cast<unsigned char *>(buf), true };
+
+  return do_transact (&x, 1);
+}
+
+dsu_link *
+create_stripe_dsu_link (const vector<dsu_link *> &links)
+{
+  return new stripe_dsu_link (links);
+}
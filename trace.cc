@@ -0,0 +1,466 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+using namespace std;
+
+unsigned int trace_slots = 4096;
+
+//  Bytes kept per packet: enough for the largest EDCL datagram.
+static const unsigned int trace_snaplen = 1536 - 24;
+
+//  Maximum number of traced links.
+static const unsigned int trace_max_links = 16;
+
+//  Link types of the exported packets.
+static const unsigned int linktype_ethernet = 1;
+static const unsigned int linktype_user0 = 147;
+static const unsigned int linktype_user1 = 148;
+
+//  Ethernet, IP and UDP headers added to the EDCL datagrams, and UDP port
+//  of the EDCL.
+static const unsigned int edcl_hdr_len = 14 + 20 + 8;
+static const unsigned int edcl_port = 1025;
+
+class trace_ring
+{
+ public:
+  trace_ring (const char *filename, unsigned int nslots);
+  ~trace_ring (void) { delete[] slots; }
+
+  int add_link (trace_kind kind, const char *name, word board_ip);
+
+  //  Record packet HDR followed by BUF.
+  void add (int id, bool in, const unsigned char *hdr, unsigned int hdr_len,
+	    const unsigned char *buf, unsigned int len);
+
+  bool dump (const char *filename);
+
+  //  Number of packets recorded, and when last dumped.
+  atomic<uint64_t> next;
+  atomic<uint64_t> dumped;
+  const char *filename;
+ private:
+  struct slot
+  {
+    //  2 N + 1 while packet N is written, 2 N + 2 once it is complete.
+    atomic<uint64_t> stamp;
+    //  Time since the start (in ns), length of the packet and number of
+    //  bytes kept.
+    uint64_t ns;
+    uint32_t len;
+    uint16_t caplen;
+    uint8_t id;
+    uint8_t in;
+    unsigned char data[trace_snaplen];
+  };
+
+  struct link
+  {
+    trace_kind kind;
+    string name;
+    word board_ip;
+  };
+
+  //  Copy of packet N, or false if it was overwritten.
+  bool get (uint64_t n, slot &s);
+
+  void write_pcap (ofstream &file, const vector<uint64_t> &pkts);
+  void write_pcapng (ofstream &file, const vector<uint64_t> &pkts);
+
+  //  Timestamp of packet S (in ns since the epoch).
+  uint64_t timestamp (const slot &s)
+  {
+    return start_ns + s.ns;
+  }
+
+  //  Packet S as exported: EDCL datagrams get Ethernet, IP and UDP headers.
+  //  Return the length of the packet, and set CAPLEN.
+  unsigned int export_packet (const slot &s, vector<unsigned char> &pkt,
+			      unsigned int &caplen);
+
+  slot *slots;
+  unsigned int nslots;
+  chrono::steady_clock::time_point start;
+  uint64_t start_ns;
+
+  //  Protects the links and the dumps.
+  mutex lock;
+  link links[trace_max_links];
+  atomic<unsigned int> nlinks;
+};
+
+static trace_ring *ring;
+
+trace_ring::trace_ring (const char *filename, unsigned int nslots) :
+  next (0), dumped (0), filename (filename), nslots (nslots), nlinks (0)
+{
+  slots = new slot[nslots];
+  for (unsigned int i = 0; i < nslots; i++)
+    slots[i].stamp.store (0, memory_order_relaxed);
+  start = chrono::steady_clock::now ();
+  start_ns = chrono::duration_cast<chrono::nanoseconds>
+    (chrono::system_clock::now ().time_since_epoch ()).count ();
+}
+
+int
+trace_ring::add_link (trace_kind kind, const char *name, word board_ip)
+{
+  lock_guard<mutex> l (lock);
+  unsigned int id = nlinks.load ();
+
+  if (id == trace_max_links)
+    {
+      cerr << "trace: too many links, " << name << " not traced" << endl;
+      return -1;
+    }
+  links[id] = { kind, name, board_ip };
+  nlinks.store (id + 1);
+  return id;
+}
+
+void
+trace_ring::add (int id, bool in, const unsigned char *hdr,
+		 unsigned int hdr_len, const unsigned char *buf,
+		 unsigned int len)
+{
+  uint64_t n = next.fetch_add (1, memory_order_relaxed);
+  slot &s = slots[n % nslots];
+  unsigned int total = hdr_len + len;
+
+  s.stamp.store (2 * n + 1, memory_order_relaxed);
+  atomic_thread_fence (memory_order_release);
+
+  s.ns = chrono::duration_cast<chrono::nanoseconds>
+    (chrono::steady_clock::now () - start).count ();
+  s.len = total;
+  s.caplen = total < trace_snaplen ? total : trace_snaplen;
+  s.id = id;
+  s.in = in;
+  if (hdr_len > s.caplen)
+    hdr_len = s.caplen;
+  if (hdr_len != 0)
+    memcpy (s.data, hdr, hdr_len);
+  if (s.caplen > hdr_len)
+    memcpy (s.data + hdr_len, buf, s.caplen - hdr_len);
+
+  s.stamp.store (2 * n + 2, memory_order_release);
+}
+
+bool
+trace_ring::get (uint64_t n, slot &s)
+{
+  const slot &r = slots[n % nslots];
+
+  if (r.stamp.load (memory_order_acquire) != 2 * n + 2)
+    return false;
+  s.ns = r.ns;
+  s.len = r.len;
+  s.caplen = r.caplen;
+  s.id = r.id;
+  s.in = r.in;
+  memcpy (s.data, r.data, r.caplen);
+  atomic_thread_fence (memory_order_acquire);
+  return r.stamp.load (memory_order_relaxed) == 2 * n + 2;
+}
+
+unsigned int
+trace_ring::export_packet (const slot &s, vector<unsigned char> &pkt,
+			   unsigned int &caplen)
+{
+  const link &l = links[s.id];
+
+  pkt.clear ();
+  if (l.kind != TRACE_EDCL)
+    {
+      pkt.assign (s.data, s.data + s.caplen);
+      caplen = s.caplen;
+      return s.len;
+    }
+
+  //  Ethernet (without addresses), IP and UDP.  The address of the host
+  //  is not known.
+  pkt.resize (edcl_hdr_len);
+  pkt[12] = 0x08;
+  pkt[13] = 0x00;
+
+  unsigned char *ip = &pkt[14];
+  word src = s.in ? l.board_ip : 0;
+  word dst = s.in ? 0 : l.board_ip;
+  ip[0] = 0x45;
+  ip[2] = (20 + 8 + s.len) >> 8;
+  ip[3] = (20 + 8 + s.len) & 0xff;
+  ip[6] = 0x40;
+  ip[8] = 64;
+  ip[9] = 17;
+  pack_be32 (ip + 12, src);
+  pack_be32 (ip + 16, dst);
+  word sum = 0;
+  for (int i = 0; i < 20; i += 2)
+    sum += unpack_be16 (ip + i);
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  ip[10] = ~sum >> 8;
+  ip[11] = ~sum & 0xff;
+
+  unsigned char *udp = ip + 20;
+  udp[0] = udp[2] = edcl_port >> 8;
+  udp[1] = udp[3] = edcl_port & 0xff;
+  udp[4] = (8 + s.len) >> 8;
+  udp[5] = (8 + s.len) & 0xff;
+
+  pkt.insert (pkt.end (), s.data, s.data + s.caplen);
+  caplen = edcl_hdr_len + s.caplen;
+  return edcl_hdr_len + s.len;
+}
+
+//  Append VAL to BUF, in host byte order (pcap and pcapng files are
+//  written in the byte order of the writer).
+template <typename T>
+static void
+put (vector<unsigned char> &buf, T val)
+{
+  unsigned char b[sizeof (T)];
+
+  memcpy (b, &val, sizeof (T));
+  buf.insert (buf.end (), b, b + sizeof (T));
+}
+
+static void
+pad32 (vector<unsigned char> &buf)
+{
+  while (buf.size () & 3)
+    buf.push_back (0);
+}
+
+//  Append pcapng option CODE with LEN bytes of DATA.
+static void
+put_option (vector<unsigned char> &buf, uint16_t code, const void *data,
+	    uint16_t len)
+{
+  put<uint16_t> (buf, code);
+  put<uint16_t> (buf, len);
+  buf.insert (buf.end (), (const unsigned char *)data,
+	      (const unsigned char *)data + len);
+  pad32 (buf);
+}
+
+//  Write pcapng block TYPE with body BODY.
+static void
+write_block (ofstream &file, uint32_t type, const vector<unsigned char> &body)
+{
+  vector<unsigned char> blk;
+  uint32_t len = 12 + body.size ();
+
+  put<uint32_t> (blk, type);
+  put<uint32_t> (blk, len);
+  blk.insert (blk.end (), body.begin (), body.end ());
+  put<uint32_t> (blk, len);
+  file.write ((const char *)blk.data (), blk.size ());
+}
+
+void
+trace_ring::write_pcap (ofstream &file, const vector<uint64_t> &pkts)
+{
+  vector<unsigned char> buf;
+  vector<unsigned char> pkt;
+  slot s;
+
+  //  Header, with timestamps in ns.
+  put<uint32_t> (buf, 0xa1b23c4d);
+  put<uint16_t> (buf, 2);
+  put<uint16_t> (buf, 4);
+  put<uint32_t> (buf, 0);
+  put<uint32_t> (buf, 0);
+  put<uint32_t> (buf, edcl_hdr_len + trace_snaplen);
+  put<uint32_t> (buf, linktype_ethernet);
+  file.write ((const char *)buf.data (), buf.size ());
+
+  for (uint64_t n : pkts)
+    {
+      if (!get (n, s) || links[s.id].kind != TRACE_EDCL)
+	continue;
+
+      unsigned int caplen;
+      unsigned int len = export_packet (s, pkt, caplen);
+      uint64_t ts = timestamp (s);
+
+      buf.clear ();
+      put<uint32_t> (buf, ts / 1000000000);
+      put<uint32_t> (buf, ts % 1000000000);
+      put<uint32_t> (buf, caplen);
+      put<uint32_t> (buf, len);
+      buf.insert (buf.end (), pkt.begin (), pkt.end ());
+      file.write ((const char *)buf.data (), buf.size ());
+    }
+}
+
+void
+trace_ring::write_pcapng (ofstream &file, const vector<uint64_t> &pkts)
+{
+  vector<unsigned char> body;
+  vector<unsigned char> pkt;
+  slot s;
+
+  //  Section header: byte-order magic, version 1.0, unknown length.
+  put<uint32_t> (body, 0x1a2b3c4d);
+  put<uint16_t> (body, 1);
+  put<uint16_t> (body, 0);
+  put<int64_t> (body, -1);
+  write_block (file, 0x0a0d0d0a, body);
+
+  //  One interface per link, with timestamps in ns.
+  unsigned int n_links = nlinks.load ();
+  for (unsigned int i = 0; i < n_links; i++)
+    {
+      const link &l = links[i];
+      const unsigned char tsresol = 9;
+      const char *desc;
+      uint16_t type;
+
+      switch (l.kind)
+	{
+	case TRACE_DSU:
+	  type = linktype_user0;
+	  desc = "DSU commands: address, length (bit 31: write), data";
+	  break;
+	case TRACE_EDCL:
+	  type = linktype_ethernet;
+	  desc = "EDCL";
+	  break;
+	default:
+	  type = linktype_user1;
+	  desc = "GDB remote protocol";
+	  break;
+	}
+
+      body.clear ();
+      put<uint16_t> (body, type);
+      put<uint16_t> (body, 0);
+      put<uint32_t> (body, edcl_hdr_len + trace_snaplen);
+      put_option (body, 2, l.name.c_str (), l.name.size ());
+      put_option (body, 3, desc, strlen (desc));
+      put_option (body, 9, &tsresol, 1);
+      put<uint32_t> (body, 0);
+      write_block (file, 1, body);
+    }
+
+  //  Enhanced packet blocks, with the direction in the flags.
+  for (uint64_t n : pkts)
+    {
+      if (!get (n, s))
+	continue;
+
+      unsigned int caplen;
+      unsigned int len = export_packet (s, pkt, caplen);
+      uint64_t ts = timestamp (s);
+      uint32_t flags = s.in ? 1 : 2;
+
+      body.clear ();
+      put<uint32_t> (body, s.id);
+      put<uint32_t> (body, ts >> 32);
+      put<uint32_t> (body, ts & 0xffffffff);
+      put<uint32_t> (body, caplen);
+      put<uint32_t> (body, len);
+      body.insert (body.end (), pkt.begin (), pkt.end ());
+      pad32 (body);
+      put_option (body, 2, &flags, 4);
+      put<uint32_t> (body, 0);
+      write_block (file, 6, body);
+    }
+}
+
+bool
+trace_ring::dump (const char *name)
+{
+  lock_guard<mutex> l (lock);
+  uint64_t end = next.load (memory_order_acquire);
+  vector<uint64_t> pkts;
+  size_t len = strlen (name);
+  bool pcap = len >= 5 && strcmp (name + len - 5, ".pcap") == 0;
+
+  for (uint64_t n = end > nslots ? end - nslots : 0; n < end; n++)
+    pkts.push_back (n);
+
+  ofstream file (name, ios::out | ios::binary | ios::trunc);
+  if (!file.is_open ())
+    {
+      cerr << name << ": unable to create" << endl;
+      return false;
+    }
+  if (pcap)
+    write_pcap (file, pkts);
+  else
+    write_pcapng (file, pkts);
+  file.close ();
+  if (file.fail ())
+    {
+      cerr << name << ": write error" << endl;
+      return false;
+    }
+  dumped = end;
+  return true;
+}
+
+void
+trace_init (const char *filename)
+{
+  if (ring != nullptr)
+    return;
+  if (trace_slots == 0)
+    trace_slots = 1;
+  ring = new trace_ring (filename, trace_slots);
+}
+
+int
+trace_register (trace_kind kind, const char *name, word board_ip)
+{
+  if (ring == nullptr)
+    return -1;
+  return ring->add_link (kind, name, board_ip);
+}
+
+void
+trace_packet (int id, bool in, const unsigned char *buf, unsigned int len)
+{
+  ring->add (id, in, nullptr, 0, buf, len);
+}
+
+void
+trace_dsu_cmd (int id, word addr, unsigned int nwords, bool is_write,
+	       const unsigned char *data)
+{
+  unsigned char cmd[8];
+
+  pack_be32 (cmd, addr);
+  pack_be32 (cmd + 4, (nwords << 2) | (is_write ? 0x80000000 : 0));
+  ring->add (id, false, cmd, 8, data, is_write ? nwords << 2 : 0);
+}
+
+bool
+trace_dump (const char *filename)
+{
+  if (ring == nullptr)
+    {
+      cerr << "the link trace is not enabled (see --trace)" << endl;
+      return false;
+    }
+  return ring->dump (filename != nullptr ? filename : ring->filename);
+}
+
+void
+trace_error (void)
+{
+  if (ring == nullptr || ring->next.load () == ring->dumped)
+    return;
+  if (ring->dump (ring->filename))
+    cerr << "link trace written to " << ring->filename << endl;
+}
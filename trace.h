@@ -0,0 +1,58 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "lemon.h"
+
+//  Binary trace of the link traffic.  The last packets exchanged with the
+//  board are kept in a ring in memory, without locks nor formatting so that
+//  tracing barely changes the timings.  The ring is written on demand, or
+//  on errors, as a pcap or pcapng file to be analysed offline (e.g. with
+//  Wireshark).
+
+//  Protocols of the traced links.
+enum trace_kind
+{
+  //  USB, JTAG and simulated links.  Commands are the address and the
+  //  length in bytes (with bit 31 set for writes), as big-endian words,
+  //  followed by the data of the writes.  Replies are the data read.
+  //  Exported with the LINKTYPE_USER0 link type.
+  TRACE_DSU,
+  //  EDCL datagrams (UDP payload).  Exported as Ethernet frames.
+  TRACE_EDCL,
+  //  GDB remote protocol (TCP payload).  Exported with LINKTYPE_USER1.
+  TRACE_RSP
+};
+
+//  Number of packets kept in the ring.
+extern unsigned int trace_slots;
+
+//  Start tracing.  FILENAME is written on errors (see trace_error), and by
+//  default by trace_dump.
+void trace_init (const char *filename);
+
+//  Declare a link of kind KIND named NAME.  For TRACE_EDCL, BOARD_IP is the
+//  IP address of the board.  Return the id of the link for trace_packet,
+//  or -1 if tracing is off.
+int trace_register (trace_kind kind, const char *name, word board_ip = 0);
+
+//  Record packet BUF of LEN bytes on link ID, sent to the board (or received
+//  from it if IN).  Long packets are truncated.
+void trace_packet (int id, bool in, const unsigned char *buf,
+		   unsigned int len);
+
+//  Record a TRACE_DSU command on link ID: access of NWORDS words at ADDR,
+//  with DATA for writes.
+void trace_dsu_cmd (int id, word addr, unsigned int nwords, bool is_write,
+		    const unsigned char *data);
+
+//  Write the ring to FILENAME (or to the trace_init file if null): as pcap
+//  if it ends with ".pcap" (only the EDCL packets can be written), else as
+//  pcapng.  Return true for success.
+bool trace_dump (const char *filename = nullptr);
+
+//  Called on errors (link failures, or bad data found by a test): write the
+//  ring to the trace_init file, if packets were recorded since the last
+//  time it was written.
+void trace_error (void);
+
+#endif /* TRACE_H_ */